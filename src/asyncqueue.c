@@ -7,6 +7,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <time.h>
+#include <errno.h>
 #include "asyncqueue.h"
 
 async_queue_t *
@@ -54,6 +55,34 @@ async_queue_new( void )
 	return async_queue;
 }
 
+async_queue_t *
+async_queue_new_bounded(size_t capacity)
+{
+	async_queue_t *async_queue;
+
+	async_queue = async_queue_new();
+	if (async_queue == NULL || capacity == 0)
+		return async_queue;
+
+	async_queue->not_full = (pthread_cond_t *)malloc(sizeof(pthread_cond_t));
+	if (async_queue->not_full == NULL)
+	{
+		async_queue_destroy(async_queue);
+		return NULL;
+	}
+
+	if (pthread_cond_init(async_queue->not_full, NULL) != 0)
+	{
+		free(async_queue->not_full);
+		async_queue->not_full = NULL;
+		async_queue_destroy(async_queue);
+		return NULL;
+	}
+	async_queue->capacity = capacity;
+
+	return async_queue;
+}
+
 void
 async_queue_destroy(async_queue_t *queue)
 {
@@ -67,6 +96,12 @@ async_queue_destroy(async_queue_t *queue)
 		pthread_cond_destroy(queue->cond);
 		free(queue->cond);
 	}
+
+	if (queue->not_full)
+	{
+		pthread_cond_destroy(queue->not_full);
+		free(queue->not_full);
+	}
 	
 	if (queue->mutex)
 	{
@@ -86,6 +121,28 @@ async_queue_push_unlocked(async_queue_t *queue, void *data)
 	pthread_cond_signal(queue->cond);
 }
 
+static inline void
+async_queue_wait_room(async_queue_t *queue)
+{
+	while (queue->capacity && queue_length(queue->queue) >= queue->capacity)
+		pthread_cond_wait(queue->not_full, queue->mutex);
+}
+
+/*
+ * "count" data were taken, wake pushers waiting for room
+ */
+static inline void
+async_queue_taken(async_queue_t *queue, size_t count)
+{
+	if (queue->capacity == 0 || count == 0)
+		return;
+
+	if (count > 1)
+		pthread_cond_broadcast(queue->not_full);
+	else
+		pthread_cond_signal(queue->not_full);
+}
+
 void
 async_queue_push(async_queue_t *queue, void *data)
 {
@@ -93,10 +150,98 @@ async_queue_push(async_queue_t *queue, void *data)
 	assert(queue->mutex != NULL);
 
 	pthread_mutex_lock(queue->mutex);
+	async_queue_wait_room(queue);
 	async_queue_push_unlocked(queue, data);
 	pthread_mutex_unlock(queue->mutex);
 }
 
+void *
+async_queue_push_overflow(async_queue_t *queue, void *data,
+	queue_overflow_t policy, func_compare_custom match)
+{
+	list_t *link;
+	void *dropped = NULL;
+
+	assert(queue != NULL && data != NULL);
+
+	pthread_mutex_lock(queue->mutex);
+	if (queue->capacity == 0 || queue_length(queue->queue) < queue->capacity)
+	{
+		async_queue_push_unlocked(queue, data);
+		pthread_mutex_unlock(queue->mutex);
+		return NULL;
+	}
+
+	switch (policy)
+	{
+	case QUEUE_OVERFLOW_DROP_NEWEST:
+		dropped = data;
+		break;
+
+	case QUEUE_OVERFLOW_COALESCE:
+		// the newest match is the one most likely still pending longest
+		for (link = queue->queue->tail; match && link; link = link->prev)
+		{
+			if (!(*match)(link->data, data))
+			{
+				dropped = link->data;
+				link->data = data;
+				break;
+			}
+		}
+		if (dropped)
+			break;
+		// nothing to coalesce with, drop the oldest instead
+		/* fall through */
+	case QUEUE_OVERFLOW_DROP_OLDEST:
+		dropped = queue_pop_head(queue->queue);
+		async_queue_push_unlocked(queue, data);
+		break;
+
+	default:
+		async_queue_wait_room(queue);
+		async_queue_push_unlocked(queue, data);
+		break;
+	}
+	pthread_mutex_unlock(queue->mutex);
+
+	return dropped;
+}
+
+/*
+ * push "count" data with one lock round trip, and wake consumers once
+ */
+void
+async_queue_push_batch(async_queue_t *queue, void **data, size_t count)
+{
+	size_t index;
+
+	assert(queue != NULL);
+	assert(queue->mutex != NULL);
+
+	if (count == 0)
+		return;
+
+	pthread_mutex_lock(queue->mutex);
+	for (index = 0; index < count; index++)
+	{
+		assert(data[index] != NULL);
+		if (queue->capacity && queue_length(queue->queue) >= queue->capacity)
+		{
+			// let consumers see what is already queued while we wait
+			pthread_cond_broadcast(queue->cond);
+			async_queue_wait_room(queue);
+		}
+		queue_push_tail(queue->queue, data[index]);
+	}
+
+	if (count > 1)
+		pthread_cond_broadcast(queue->cond);
+	else
+		pthread_cond_signal(queue->cond);
+	pthread_mutex_unlock(queue->mutex);
+}
+
 static void *
 async_queue_pop_unlocked(async_queue_t *queue)
 {
@@ -107,7 +252,10 @@ async_queue_pop_unlocked(async_queue_t *queue)
 	{
 		data = queue_pop_head(queue->queue);
 		if (data)
+		{
+			async_queue_taken(queue, 1);
 			return data;
+		}
 
 		assert(queue->cond != NULL);
 		result = pthread_cond_wait(queue->cond, queue->mutex);		
@@ -132,6 +280,68 @@ async_queue_pop(async_queue_t *queue)
 	return retval;
 }
 
+void *
+async_queue_timed_pop(async_queue_t *queue, unsigned int timeout_ms)
+{
+	struct timespec deadline;
+	void *data;
+	int result;
+
+	assert(queue != NULL);
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L)
+	{
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(queue->mutex);
+	for (;;)
+	{
+		data = queue_pop_head(queue->queue);
+		if (data)
+			break;
+
+		result = pthread_cond_timedwait(queue->cond, queue->mutex, &deadline);
+		if (result == ETIMEDOUT)
+		{
+			data = queue_pop_head(queue->queue);
+			break;
+		}
+	}
+	async_queue_taken(queue, data != NULL);
+	pthread_mutex_unlock(queue->mutex);
+
+	return data;
+}
+
+/*
+ * wait until the queue isn't empty, then take up to "max" data under the
+ * same lock. Returns the number of data stored in "data"
+ */
+size_t
+async_queue_pop_batch(async_queue_t *queue, void **data, size_t max)
+{
+	size_t count;
+	assert(queue != NULL && data != NULL && max > 0);
+
+	pthread_mutex_lock(queue->mutex);
+	data[0] = async_queue_pop_unlocked(queue);
+	for (count = 1; count < max; count++)
+	{
+		data[count] = queue_pop_head(queue->queue);
+		if (data[count] == NULL)
+			break;
+	}
+	async_queue_taken(queue, count - 1);	// the first one signaled already
+	pthread_mutex_unlock(queue->mutex);
+
+	return count;
+}
+
 void
 async_queue_foreach(async_queue_t *queue, func_visit_custom func, void *data)
 {
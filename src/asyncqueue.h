@@ -20,12 +20,30 @@ struct _async_queue
 	queue_t			*queue;
 	pthread_mutex_t *mutex;
 	pthread_cond_t 	*cond;
+
+	/*
+	 * bounded queue only, 0 is unbounded and "not_full" is NULL
+	 */
+	size_t			capacity;
+	pthread_cond_t	*not_full;
 };
 
 
 async_queue_t *async_queue_new(void);
-void async_queue_push(async_queue_t *queue, void *data);
+async_queue_t *async_queue_new_bounded(size_t capacity);
+void async_queue_push(async_queue_t *queue, void *data);	// waits for room when bounded
+
+/*
+ * push into a bounded queue following "policy" when it is full, "match"
+ * finds the data to coalesce with (0 on match, like list_find_custom()).
+ * Returns the data dropped, "data" itself or a queued one, NULL if none
+ */
+void *async_queue_push_overflow(async_queue_t *queue, void *data,
+	queue_overflow_t policy, func_compare_custom match);
+void async_queue_push_batch(async_queue_t *queue, void **data, size_t count);
 void *async_queue_pop(async_queue_t *queue);
+void *async_queue_timed_pop(async_queue_t *queue, unsigned int timeout_ms);	// NULL on timeout
+size_t async_queue_pop_batch(async_queue_t *queue, void **data, size_t max);
 void async_queue_foreach(async_queue_t *queue, func_visit_custom func, void *data);
 void async_queue_destroy(async_queue_t *queue);
 
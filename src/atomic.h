@@ -37,6 +37,34 @@ typedef volatile int atomic_t;
 # define atomic_dec(p) __sync_sub_and_fetch(p, 1)
 # define atomic_dec_and_test_zero(p) (__sync_sub_and_fetch(p, 1) == 0)
 
+/*
+ * ordered load/store and cas, used by the lock-free rings. They work on any
+ * naturally aligned integer or pointer, not only atomic_t
+ */
+# define atomic_cas(p, old, val) __sync_bool_compare_and_swap(p, old, val)
+# define atomic_fence() __sync_synchronize()
+
+#if __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 7)
+# define atomic_load_relaxed(p) __atomic_load_n(p, __ATOMIC_RELAXED)
+# define atomic_load_acquire(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+# define atomic_store_relaxed(p, val) __atomic_store_n(p, val, __ATOMIC_RELAXED)
+# define atomic_store_release(p, val) __atomic_store_n(p, val, __ATOMIC_RELEASE)
+# define atomic_xchg(p, val) __atomic_exchange_n(p, val, __ATOMIC_ACQ_REL)
+#else
+# define atomic_load_relaxed(p) (*(p))
+# define atomic_load_acquire(p) ({ __typeof__(*(p)) __v = *(p); __sync_synchronize(); __v; })
+# define atomic_store_relaxed(p, val) ((*(p)) = (val))
+# define atomic_store_release(p, val) do { __sync_synchronize(); *(p) = (val); } while (0)
+# define atomic_xchg(p, val) ({ __typeof__(*(p)) __o; \
+	do { __o = *(p); } while (!__sync_bool_compare_and_swap(p, __o, val)); __o; })
+#endif
+
+#if defined(__i386__) || defined(__x86_64__)
+# define cpu_relax() __asm__ __volatile__("pause" ::: "memory")
+#else
+# define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
 #else
 
 #if defined _ARM_
@@ -0,0 +1,353 @@
+/*
+ * busrequest.c
+ * Copyright by Zhang Shiyong, 2014. shiyong.zhang.cn@outlook.com
+ */
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "common.h"
+#include "atomic.h"
+#include "objpool.h"
+#include "tinybus.h"
+
+#define TINY_BUS_FUTURE_PENDING		0
+#define TINY_BUS_FUTURE_DONE		1
+#define TINY_BUS_FUTURE_CANCELLED	2
+
+/*
+ * "refs" counts the caller and the pending table, whoever takes the
+ * future out of the table completes it. "arms" counts the completion and
+ * tiny_bus_future_then(), the second one runs the callback
+ */
+struct _tiny_bus_future
+{
+	event_count_t			done;
+	volatile uint32_t		state;
+	atomic_t				refs;
+	atomic_t				arms;
+	uint32_t				seq;
+	tiny_msg_t *			reply;
+	tiny_bus_requests_t *	requests;
+	tiny_bus_future_cb_t	callback;
+	void *					user_data;
+};
+
+struct _tiny_bus_requests
+{
+	pthread_mutex_t	mutex;
+	uint32_t		next_seq;
+	id_map_t		pending;	// correlation ID to tiny_bus_future_t
+};
+
+/*
+ * futures may outlive their bus, like messages their pool lives as long
+ * as the process
+ */
+static obj_pool_t *tiny_bus_future_pool;
+static pthread_once_t tiny_bus_future_pool_once = PTHREAD_ONCE_INIT;
+
+static void
+tiny_bus_future_pool_init(void)
+{
+	tiny_bus_future_pool = obj_pool_new(sizeof(tiny_bus_future_t));
+}
+
+static tiny_bus_future_t *
+tiny_bus_future_new(tiny_bus_requests_t *requests)
+{
+	tiny_bus_future_t *future;
+
+	pthread_once(&tiny_bus_future_pool_once, tiny_bus_future_pool_init);
+	if (tiny_bus_future_pool == NULL)
+		return NULL;
+
+	future = (tiny_bus_future_t *)obj_pool_alloc(tiny_bus_future_pool);
+	if (future == NULL)
+	{
+		show_err2(ENOMEM, "obj_pool_alloc");
+		return NULL;
+	}
+
+	memset(future, 0, sizeof(tiny_bus_future_t));
+	event_count_init(&future->done);
+	future->refs = 2;
+	future->requests = requests;
+
+	return future;
+}
+
+static void
+tiny_bus_future_unref(tiny_bus_future_t *future)
+{
+	if (!atomic_dec_and_test_zero(&future->refs))
+		return;
+
+	if (future->reply)
+		tiny_msg_release(future->reply);
+
+	event_count_destroy(&future->done);
+	obj_pool_free(tiny_bus_future_pool, future);
+}
+
+static void
+tiny_bus_future_arm(tiny_bus_future_t *future)
+{
+	if (atomic_inc(&future->arms) != 2)
+		return;
+
+	(*future->callback)(future->state == TINY_BUS_FUTURE_DONE ? future->reply : NULL,
+		future->user_data);
+
+	// the caller's reference, handed over by tiny_bus_future_then()
+	tiny_bus_future_unref(future);
+}
+
+/*
+ * the future has just been taken out of the pending table, its reference
+ * comes with it
+ */
+static void
+tiny_bus_future_complete(tiny_bus_future_t *future, tiny_msg_t *reply, uint32_t state)
+{
+	future->reply = reply;
+	atomic_store_release(&future->state, state);
+	event_count_notify(&future->done, 1);
+
+	tiny_bus_future_arm(future);
+	tiny_bus_future_unref(future);
+}
+
+static tiny_bus_requests_t *
+tiny_bus_requests_new(void)
+{
+	tiny_bus_requests_t *requests;
+
+	requests = (tiny_bus_requests_t *)calloc(1, sizeof(tiny_bus_requests_t));
+	if (requests == NULL)
+	{
+		show_err2(errno, "calloc");
+		return NULL;
+	}
+
+	if (id_map_init(&requests->pending, 16) != 0)
+	{
+		show_err2(errno, "id_map_init");
+		free(requests);
+		return NULL;
+	}
+
+	pthread_mutex_init(&requests->mutex, NULL);
+
+	return requests;
+}
+
+static tiny_bus_requests_t *
+tiny_bus_requests_get(tiny_bus_t *bus)
+{
+	tiny_bus_requests_t *requests;
+
+	requests = atomic_load_acquire(&bus->requests);
+	if (requests)
+		return requests;
+
+	pthread_mutex_lock(bus->mutex);
+	requests = bus->requests;
+	if (requests == NULL)
+	{
+		requests = tiny_bus_requests_new();
+		atomic_store_release(&bus->requests, requests);
+	}
+	pthread_mutex_unlock(bus->mutex);
+
+	return requests;
+}
+
+static void
+tiny_bus_request_cancel(uint32_t seq, void *future, void *data)
+{
+	tiny_bus_future_complete((tiny_bus_future_t *)future, NULL, TINY_BUS_FUTURE_CANCELLED);
+}
+
+void
+tiny_bus_requests_free(tiny_bus_requests_t *requests)
+{
+	assert(requests);
+
+	// after any reply still being handed over
+	pthread_mutex_lock(&requests->mutex);
+	id_map_foreach(&requests->pending, tiny_bus_request_cancel, NULL);
+	pthread_mutex_unlock(&requests->mutex);
+	id_map_destroy(&requests->pending);
+	pthread_mutex_destroy(&requests->mutex);
+	free(requests);
+}
+
+tiny_bus_future_t *
+tiny_bus_request(tiny_bus_t *bus, tiny_msg_t *request)
+{
+	tiny_bus_requests_t *requests;
+	tiny_bus_future_t *future, *pending;
+	uint32_t seq;
+
+	assert(bus);
+	assert(request);
+
+	requests = tiny_bus_requests_get(bus);
+	future = requests ? tiny_bus_future_new(requests) : NULL;
+	if (future == NULL)
+	{
+		tiny_msg_release(request);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&requests->mutex);
+	do {
+		seq = ++requests->next_seq;
+	} while (seq == 0 || seq == ID_MAP_EMPTY_KEY
+		|| id_map_get(&requests->pending, seq) != NULL);
+
+	if (id_map_set(&requests->pending, seq, future) != 0)
+	{
+		pthread_mutex_unlock(&requests->mutex);
+		event_count_destroy(&future->done);
+		obj_pool_free(tiny_bus_future_pool, future);
+		tiny_msg_release(request);
+		return NULL;
+	}
+	future->seq = seq;
+	pthread_mutex_unlock(&requests->mutex);
+
+	request->seq = seq;
+	if (tiny_bus_post(bus, request) != TINY_BUS_DROPPED)
+		return future;
+
+	// nobody will answer, unless the drop was an older message's
+	pthread_mutex_lock(&requests->mutex);
+	pending = (tiny_bus_future_t *)id_map_remove(&requests->pending, seq);
+	pthread_mutex_unlock(&requests->mutex);
+
+	if (pending)
+		tiny_bus_future_complete(pending, NULL, TINY_BUS_FUTURE_CANCELLED);
+
+	return future;
+}
+
+tiny_bus_result_t
+tiny_bus_reply(tiny_bus_t *bus, tiny_msg_t *request, tiny_msg_t *reply)
+{
+	tiny_bus_requests_t *requests;
+	tiny_bus_future_t *future = NULL;
+
+	assert(bus);
+	assert(request);
+	assert(reply);
+
+	// by correlation ID, no subscriber lookup
+	requests = atomic_load_acquire(&bus->requests);
+	if (requests && request->seq != 0 && request->seq != ID_MAP_EMPTY_KEY)
+	{
+		pthread_mutex_lock(&requests->mutex);
+		future = (tiny_bus_future_t *)id_map_remove(&requests->pending, request->seq);
+		pthread_mutex_unlock(&requests->mutex);
+	}
+
+	if (future == NULL)
+	{
+		tiny_msg_release(reply);
+		return TINY_BUS_FAILED;
+	}
+
+	reply->seq = request->seq;
+	tiny_bus_future_complete(future, reply, TINY_BUS_FUTURE_DONE);
+
+	return TINY_BUS_SUCCEED;
+}
+
+tiny_msg_t *
+tiny_bus_future_wait(tiny_bus_future_t *future)
+{
+	uint32_t key;
+
+	assert(future);
+
+	while (atomic_load_acquire(&future->state) == TINY_BUS_FUTURE_PENDING)
+	{
+		key = event_count_prepare_wait(&future->done);
+		if (atomic_load_acquire(&future->state) != TINY_BUS_FUTURE_PENDING)
+			event_count_cancel_wait(&future->done);
+		else
+			event_count_wait(&future->done, key);
+	}
+
+	return future->reply;
+}
+
+tiny_msg_t *
+tiny_bus_future_timed_wait(tiny_bus_future_t *future, unsigned int timeout_ms)
+{
+	struct timespec deadline;
+	uint32_t key;
+
+	assert(future);
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L)
+	{
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	while (atomic_load_acquire(&future->state) == TINY_BUS_FUTURE_PENDING)
+	{
+		key = event_count_prepare_wait(&future->done);
+		if (atomic_load_acquire(&future->state) != TINY_BUS_FUTURE_PENDING)
+			event_count_cancel_wait(&future->done);
+		else if (event_count_timed_wait(&future->done, key, &deadline) == ETIMEDOUT)
+			break;
+	}
+
+	if (atomic_load_acquire(&future->state) != TINY_BUS_FUTURE_DONE)
+		return NULL;
+
+	return future->reply;
+}
+
+void
+tiny_bus_future_then(tiny_bus_future_t *future, tiny_bus_future_cb_t callback, void *user_data)
+{
+	assert(future);
+	assert(callback);
+
+	future->callback = callback;
+	future->user_data = user_data;
+	tiny_bus_future_arm(future);
+}
+
+void
+tiny_bus_future_free(tiny_bus_future_t *future)
+{
+	tiny_bus_requests_t *requests;
+	tiny_bus_future_t *pending = NULL;
+
+	assert(future);
+
+	// still in the table, a late reply finds nothing
+	if (atomic_load_acquire(&future->state) == TINY_BUS_FUTURE_PENDING)
+	{
+		requests = future->requests;
+		pthread_mutex_lock(&requests->mutex);
+		if (id_map_get(&requests->pending, future->seq) == future)
+			pending = (tiny_bus_future_t *)id_map_remove(&requests->pending, future->seq);
+		pthread_mutex_unlock(&requests->mutex);
+
+		if (pending)
+			tiny_bus_future_complete(pending, NULL, TINY_BUS_FUTURE_CANCELLED);
+	}
+
+	tiny_bus_future_unref(future);
+}
@@ -0,0 +1,319 @@
+/*
+ * bustimer.c
+ * Copyright by Zhang Shiyong, 2014. shiyong.zhang.cn@outlook.com
+ */
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "common.h"
+#include "atomic.h"
+#include "timerwheel.h"
+#include "tinybus.h"
+
+#define TINY_BUS_TIMER_TICK_NS		(TINY_BUS_TIMER_TICK_MS * 1000000ULL)
+
+/*
+ * messages built under the lock before the thread lets go of it to
+ * publish them
+ */
+#define TINY_BUS_TIMER_FIRE_MAX		64
+
+typedef struct _tiny_bus_timer
+{
+	timer_node_t	node;		// first, a node is its timer
+	uint32_t		id;
+	uint32_t		period;		// ticks, 0 for a one-shot timer
+	message_id_t	msg_id;
+	size_t			size;
+	char			payload[TINY_MSG_INLINE_MAX];
+} tiny_bus_timer_t;
+
+/*
+ * "mutex" protects everything below it. The thread sleeps on "cond" until
+ * tick "wake", a timer added before that wakes it up
+ */
+struct _tiny_bus_timers
+{
+	tiny_bus_t *	bus;
+	pthread_t		thread;
+	pthread_mutex_t	mutex;
+	pthread_cond_t	cond;		// on CLOCK_MONOTONIC
+	uint64_t		base_ns;	// tick 0
+	int				stop;
+	uint64_t		wake;
+	uint32_t		next_id;
+	id_map_t		timers;		// ID to tiny_bus_timer_t
+	timer_wheel_t	wheel;
+};
+
+static inline uint64_t
+tiny_bus_timers_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint64_t
+tiny_bus_timers_tick(tiny_bus_timers_t *timers)
+{
+	return (tiny_bus_timers_now_ns() - timers->base_ns) / TINY_BUS_TIMER_TICK_NS;
+}
+
+/*
+ * mutex held. Rearm a periodic timer one period after its last deadline,
+ * so it doesn't drift, skipping the periods already missed
+ */
+static void
+tiny_bus_timers_fire(tiny_bus_timers_t *timers, tiny_bus_timer_t *timer, uint64_t now)
+{
+	uint64_t next;
+
+	if (timer->period == 0)
+	{
+		id_map_remove(&timers->timers, timer->id);
+		free(timer);
+		return;
+	}
+
+	next = timer->node.expires + timer->period;
+	if (next <= now)
+		next += ((now - next) / timer->period + 1) * timer->period;
+	timer_wheel_add(&timers->wheel, &timer->node, next);
+}
+
+static void *
+tiny_bus_timers_worker(void *arg)
+{
+	tiny_bus_timers_t *timers = (tiny_bus_timers_t *)arg;
+	tiny_msg_t *msgs[TINY_BUS_TIMER_FIRE_MAX];
+	tiny_bus_timer_t *timer;
+	struct timespec deadline;
+	uint64_t now, ns;
+	size_t index, count;
+
+	pthread_mutex_lock(&timers->mutex);
+	while (!timers->stop)
+	{
+		now = tiny_bus_timers_tick(timers);
+		for (count = 0; count < TINY_BUS_TIMER_FIRE_MAX; )
+		{
+			timer = (tiny_bus_timer_t *)timer_wheel_poll(&timers->wheel, now);
+			if (timer == NULL)
+				break;
+
+			msgs[count] = tiny_msg_alloc_inline(timer->msg_id, timer->payload, timer->size);
+			if (msgs[count])
+				count++;
+
+			tiny_bus_timers_fire(timers, timer, now);
+		}
+
+		if (count)
+		{
+			// a full ingress may block us, timers can still be added
+			pthread_mutex_unlock(&timers->mutex);
+			for (index = 0; index < count; index++)
+				tiny_bus_post(timers->bus, msgs[index]);
+			pthread_mutex_lock(&timers->mutex);
+			continue;
+		}
+
+		timers->wake = timer_wheel_next(&timers->wheel);
+		if (timers->wake == TIMER_WHEEL_NEVER)
+		{
+			pthread_cond_wait(&timers->cond, &timers->mutex);
+			continue;
+		}
+
+		ns = timers->base_ns + timers->wake * TINY_BUS_TIMER_TICK_NS;
+		deadline.tv_sec = ns / 1000000000ULL;
+		deadline.tv_nsec = ns % 1000000000ULL;
+		pthread_cond_timedwait(&timers->cond, &timers->mutex, &deadline);
+	}
+	pthread_mutex_unlock(&timers->mutex);
+
+	return NULL;
+}
+
+static tiny_bus_timers_t *
+tiny_bus_timers_new(tiny_bus_t *bus)
+{
+	tiny_bus_timers_t *timers;
+	pthread_condattr_t attr;
+	int result;
+
+	timers = (tiny_bus_timers_t *)calloc(1, sizeof(tiny_bus_timers_t));
+	if (timers == NULL)
+	{
+		show_err2(errno, "calloc");
+		return NULL;
+	}
+
+	if (id_map_init(&timers->timers, 16) != 0)
+	{
+		show_err2(errno, "id_map_init");
+		free(timers);
+		return NULL;
+	}
+
+	pthread_mutex_init(&timers->mutex, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&timers->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	timers->bus = bus;
+	timers->base_ns = tiny_bus_timers_now_ns();
+	timers->wake = TIMER_WHEEL_NEVER;
+	timer_wheel_init(&timers->wheel, 0);
+
+	result = pthread_create(&timers->thread, NULL, tiny_bus_timers_worker, timers);
+	if (result)
+	{
+		show_err2(result, "pthread_create");
+		pthread_cond_destroy(&timers->cond);
+		pthread_mutex_destroy(&timers->mutex);
+		id_map_destroy(&timers->timers);
+		free(timers);
+		return NULL;
+	}
+
+	return timers;
+}
+
+static tiny_bus_timers_t *
+tiny_bus_timers_get(tiny_bus_t *bus)
+{
+	tiny_bus_timers_t *timers;
+
+	timers = atomic_load_acquire(&bus->timers);
+	if (timers)
+		return timers;
+
+	pthread_mutex_lock(bus->mutex);
+	timers = bus->timers;
+	if (timers == NULL)
+	{
+		timers = tiny_bus_timers_new(bus);
+		atomic_store_release(&bus->timers, timers);
+	}
+	pthread_mutex_unlock(bus->mutex);
+
+	return timers;
+}
+
+static void
+tiny_bus_timer_free(uint32_t id, void *timer, void *data)
+{
+	free(timer);
+}
+
+void
+tiny_bus_timers_free(tiny_bus_timers_t *timers)
+{
+	assert(timers);
+
+	pthread_mutex_lock(&timers->mutex);
+	timers->stop = 1;
+	pthread_cond_signal(&timers->cond);
+	pthread_mutex_unlock(&timers->mutex);
+	pthread_join(timers->thread, NULL);
+
+	id_map_foreach(&timers->timers, tiny_bus_timer_free, NULL);
+	id_map_destroy(&timers->timers);
+	pthread_cond_destroy(&timers->cond);
+	pthread_mutex_destroy(&timers->mutex);
+	free(timers);
+}
+
+uint32_t
+tiny_bus_timer_add(tiny_bus_t *bus, message_id_t id, const void *data, size_t size,
+	uint32_t delay_ms, uint32_t period_ms)
+{
+	tiny_bus_timers_t *timers;
+	tiny_bus_timer_t *timer;
+	uint64_t expires;
+	uint32_t timer_id;
+
+	assert(bus);
+
+	if (size > TINY_MSG_INLINE_MAX)
+		return 0;
+
+	timers = tiny_bus_timers_get(bus);
+	if (timers == NULL)
+		return 0;
+
+	timer = (tiny_bus_timer_t *)calloc(1, sizeof(tiny_bus_timer_t));
+	if (timer == NULL)
+	{
+		show_err2(errno, "calloc");
+		return 0;
+	}
+
+	timer->msg_id = id;
+	timer->size = size;
+	if (data)
+		memcpy(timer->payload, data, size);
+	if (period_ms)
+		timer->period = (period_ms + TINY_BUS_TIMER_TICK_MS - 1) / TINY_BUS_TIMER_TICK_MS;
+
+	pthread_mutex_lock(&timers->mutex);
+	do {
+		timer->id = ++timers->next_id;
+	} while (timer->id == 0 || timer->id == ID_MAP_EMPTY_KEY
+		|| id_map_get(&timers->timers, timer->id) != NULL);
+
+	if (id_map_set(&timers->timers, timer->id, timer) != 0)
+	{
+		pthread_mutex_unlock(&timers->mutex);
+		free(timer);
+		return 0;
+	}
+
+	// first tick not before the deadline
+	expires = tiny_bus_timers_now_ns() - timers->base_ns
+		+ (uint64_t)delay_ms * 1000000ULL;
+	expires = (expires + TINY_BUS_TIMER_TICK_NS - 1) / TINY_BUS_TIMER_TICK_NS;
+	timer_wheel_add(&timers->wheel, &timer->node, expires);
+
+	if (expires < timers->wake)
+		pthread_cond_signal(&timers->cond);
+
+	// once unlocked the timer may fire, or be cancelled, and be freed
+	timer_id = timer->id;
+	pthread_mutex_unlock(&timers->mutex);
+
+	return timer_id;
+}
+
+tiny_bus_result_t
+tiny_bus_timer_cancel(tiny_bus_t *bus, uint32_t id)
+{
+	tiny_bus_timers_t *timers;
+	tiny_bus_timer_t *timer;
+
+	assert(bus);
+
+	timers = atomic_load_acquire(&bus->timers);
+	if (timers == NULL || id == 0 || id == ID_MAP_EMPTY_KEY)
+		return TINY_BUS_FAILED;
+
+	pthread_mutex_lock(&timers->mutex);
+	timer = (tiny_bus_timer_t *)id_map_remove(&timers->timers, id);
+	if (timer)
+		timer_wheel_del(&timers->wheel, &timer->node);
+	pthread_mutex_unlock(&timers->mutex);
+
+	if (timer == NULL)
+		return TINY_BUS_FAILED;
+
+	free(timer);
+
+	return TINY_BUS_SUCCEED;
+}
@@ -14,15 +14,23 @@
     	int error = (err); 							\
     	if (error)	 		 		 			\
     		fprintf(stderr, "file %s: line %d (%s): error '%d' during '%s'",	\
-               __FILE__, __LINE__, __FUNCTION__, err, name);				\
+               __FILE__, __LINE__, __FUNCTION__, error, name);				\
     } while (0)
     
 #else
     #define show_err(name)
-    #define show_err2(err, name)
+    // still evaluate err, posix_check_cmd() relies on it running the command
+    #define show_err2(err, name) do { (void)(err); } while (0)
     
 #endif
 
 #define posix_check_cmd(cmd) show_err2((cmd), #cmd)
 
+/*
+ * lock-free structures pad their hot fields to this size, so producer and
+ * consumer indexes never share a cache line
+ */
+#define CACHE_LINE_SIZE		64
+#define CACHE_LINE_PAD(n)	char n[CACHE_LINE_SIZE]
+
 #endif
@@ -0,0 +1,231 @@
+/*
+ * epoch.c
+ * Copyright by Zhang Shiyong, 2014. shiyong.zhang.cn@outlook.com
+ */
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include "common.h"
+#include "atomic.h"
+#include "epoch.h"
+
+/*
+ * Each thread that ever entered a critical section owns a record. Its state
+ * is "(epoch << 1) | 1" while inside, 0 outside, written with one store so
+ * writers never see a half updated record. Records of exited threads are
+ * recycled, never freed.
+ */
+typedef struct _epoch_record epoch_record_t;
+struct _epoch_record
+{
+	volatile uint32_t	state;
+	volatile int		in_use;
+	epoch_record_t *	next;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+typedef struct _epoch_retired epoch_retired_t;
+struct _epoch_retired
+{
+	void *				ptr;
+	epoch_free_t		func;
+	uint32_t			epoch;
+	epoch_retired_t *	next;
+};
+
+static volatile uint32_t	epoch_global = 1;
+static epoch_record_t * volatile epoch_records;
+
+// writers only: retired list and epoch advance
+static pthread_mutex_t		epoch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static epoch_retired_t *	epoch_limbo;
+
+static pthread_once_t		epoch_once = PTHREAD_ONCE_INIT;
+static pthread_key_t		epoch_key;
+static __thread epoch_record_t *epoch_local;
+static __thread int			epoch_nest;
+
+static void
+epoch_thread_exit(void *arg)
+{
+	epoch_record_t *record = (epoch_record_t *)arg;
+
+	atomic_store_release(&record->state, 0);
+	atomic_store_release(&record->in_use, 0);
+}
+
+static void
+epoch_init_once(void)
+{
+	pthread_key_create(&epoch_key, epoch_thread_exit);
+}
+
+static epoch_record_t *
+epoch_register(void)
+{
+	epoch_record_t *record, *head;
+
+	pthread_once(&epoch_once, epoch_init_once);
+
+	for (record = epoch_records; record; record = record->next)
+	{
+		if (!record->in_use && atomic_cas(&record->in_use, 0, 1))
+			break;
+	}
+
+	if (record == NULL)
+	{
+		if (posix_memalign((void **)&record, CACHE_LINE_SIZE, sizeof(epoch_record_t)))
+			abort();
+		memset(record, 0, sizeof(epoch_record_t));
+		record->in_use = 1;
+
+		do {
+			head = epoch_records;
+			record->next = head;
+		} while (!atomic_cas(&epoch_records, head, record));
+	}
+
+	pthread_setspecific(epoch_key, record);
+	epoch_local = record;
+
+	return record;
+}
+
+void
+epoch_enter(void)
+{
+	epoch_record_t *record;
+
+	if (epoch_nest++ > 0)
+		return;
+
+	record = epoch_local ? epoch_local : epoch_register();
+	atomic_store_relaxed(&record->state,
+		(atomic_load_relaxed(&epoch_global) << 1) | 1);
+
+	// announce the epoch before any shared pointer is read
+	atomic_fence();
+}
+
+void
+epoch_exit(void)
+{
+	assert(epoch_nest > 0);
+
+	if (--epoch_nest > 0)
+		return;
+
+	atomic_store_release(&epoch_local->state, 0);
+}
+
+/*
+ * epoch_mutex held. Global epoch moves on only when every reader inside a
+ * critical section has observed the current one
+ */
+static int
+epoch_try_advance(void)
+{
+	epoch_record_t *record;
+	uint32_t global, state;
+
+	global = atomic_load_relaxed(&epoch_global);
+	for (record = epoch_records; record; record = record->next)
+	{
+		state = atomic_load_acquire(&record->state);
+		if ((state & 1) && (state >> 1) != global)
+			return 0;
+	}
+
+	atomic_store_release(&epoch_global, global + 1);
+
+	return 1;
+}
+
+/*
+ * epoch_mutex held. Data retired in epoch E can't be referenced by readers
+ * once the global epoch reaches E + 2
+ */
+static void
+epoch_reclaim(void)
+{
+	epoch_retired_t **link, *item;
+	uint32_t global;
+
+	global = atomic_load_relaxed(&epoch_global);
+	link = &epoch_limbo;
+	while ((item = *link) != NULL)
+	{
+		if ((int32_t)(global - item->epoch) >= 2)
+		{
+			*link = item->next;
+			(*item->func)(item->ptr);
+			free(item);
+		}
+		else
+			link = &item->next;
+	}
+}
+
+void
+epoch_retire(void *ptr, epoch_free_t func)
+{
+	epoch_retired_t *item;
+
+	if (ptr == NULL)
+		return;
+
+	item = (epoch_retired_t *)malloc(sizeof(epoch_retired_t));
+	if (item == NULL)
+	{
+		// can't defer, wait for readers instead
+		epoch_synchronize();
+		(*func)(ptr);
+		return;
+	}
+
+	item->ptr = ptr;
+	item->func = func;
+
+	// the pointer was unpublished before we read the epoch
+	atomic_fence();
+
+	pthread_mutex_lock(&epoch_mutex);
+	item->epoch = atomic_load_relaxed(&epoch_global);
+	item->next = epoch_limbo;
+	epoch_limbo = item;
+
+	epoch_try_advance();
+	epoch_reclaim();
+	pthread_mutex_unlock(&epoch_mutex);
+}
+
+/*
+ * wait until every reader has left the critical section it was in when we
+ * were called, and free everything retired so far. A thread calling this
+ * from inside its own critical section can't wait for itself, so it only
+ * reclaims what is already safe
+ */
+void
+epoch_synchronize(void)
+{
+	uint32_t target;
+
+	atomic_fence();
+
+	pthread_mutex_lock(&epoch_mutex);
+	target = atomic_load_relaxed(&epoch_global) + 2;
+	while (epoch_nest == 0 && (int32_t)(atomic_load_relaxed(&epoch_global) - target) < 0)
+	{
+		if (!epoch_try_advance())
+		{
+			pthread_mutex_unlock(&epoch_mutex);
+			sched_yield();
+			pthread_mutex_lock(&epoch_mutex);
+		}
+	}
+
+	epoch_reclaim();
+	pthread_mutex_unlock(&epoch_mutex);
+}
@@ -0,0 +1,38 @@
+/*
+ * epoch.h
+ * Copyright by Zhang Shiyong, 2014. shiyong.zhang.cn@outlook.com
+ */
+
+#ifndef _EPOCH_H_
+#define _EPOCH_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Epoch based reclamation for read-mostly shared data, e.g. the bus
+ * subscriber table.
+ *
+ * Readers wrap every access between epoch_enter() and epoch_exit(), they
+ * never lock or write shared cache lines. Writers serialize among
+ * themselves, publish a new copy with a release store, and hand the old copy
+ * to epoch_retire(); it is freed once every reader that might still see it
+ * has left its critical section.
+ */
+typedef void (*epoch_free_t)(void *ptr);
+
+void epoch_enter(void);
+void epoch_exit(void);
+void epoch_retire(void *ptr, epoch_free_t func);
+void epoch_synchronize(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _EPOCH_H_ */
+
+// ~ end
@@ -0,0 +1,174 @@
+/*
+ * eventcount.c
+ * Copyright by Zhang Shiyong, 2014. shiyong.zhang.cn@outlook.com
+ */
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+#include "atomic.h"
+#include "eventcount.h"
+
+#ifdef __linux__
+static inline void
+futex_wait(volatile uint32_t *addr, uint32_t val)
+{
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+/*
+ * "deadline" is absolute on CLOCK_MONOTONIC with FUTEX_WAIT_BITSET
+ */
+static inline int
+futex_timed_wait(volatile uint32_t *addr, uint32_t val, const struct timespec *deadline)
+{
+	if (syscall(SYS_futex, addr, FUTEX_WAIT_BITSET_PRIVATE, val, deadline,
+		NULL, FUTEX_BITSET_MATCH_ANY) != 0 && errno == ETIMEDOUT)
+		return ETIMEDOUT;
+
+	return 0;
+}
+
+static inline void
+futex_wake(volatile uint32_t *addr, int count)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+#endif
+
+void
+event_count_init(event_count_t *ec)
+{
+#ifndef __linux__
+	pthread_condattr_t attr;
+#endif
+
+	assert(ec);
+
+	memset(ec, 0, sizeof(event_count_t));
+#ifndef __linux__
+	pthread_mutex_init(&ec->mutex, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&ec->cond, &attr);
+	pthread_condattr_destroy(&attr);
+#endif
+}
+
+void
+event_count_init_exclusive(event_count_t *ec)
+{
+	event_count_init(ec);
+	ec->exclusive = 1;
+}
+
+void
+event_count_destroy(event_count_t *ec)
+{
+	assert(ec);
+#ifndef __linux__
+	pthread_cond_destroy(&ec->cond);
+	pthread_mutex_destroy(&ec->mutex);
+#endif
+}
+
+uint32_t
+event_count_prepare_wait(event_count_t *ec)
+{
+	// full barrier: the waiter count must be visible before the caller
+	// re-checks its condition
+	if (ec->exclusive)
+	{
+		atomic_store_relaxed(&ec->waiters, 1);
+		atomic_fence();
+	}
+	else
+		atomic_inc(&ec->waiters);
+
+	return atomic_load_acquire(&ec->seq);
+}
+
+void
+event_count_cancel_wait(event_count_t *ec)
+{
+	// if exclusive waiter has been claimed by a notifier, leave it alone
+	if (ec->exclusive)
+		atomic_cas(&ec->waiters, 1, 0);
+	else
+		atomic_dec(&ec->waiters);
+}
+
+void
+event_count_wait(event_count_t *ec, uint32_t key)
+{
+#ifdef __linux__
+	while (atomic_load_acquire(&ec->seq) == key)
+		futex_wait(&ec->seq, key);
+#else
+	pthread_mutex_lock(&ec->mutex);
+	while (atomic_load_acquire(&ec->seq) == key)
+		pthread_cond_wait(&ec->cond, &ec->mutex);
+	pthread_mutex_unlock(&ec->mutex);
+#endif
+
+	if (!ec->exclusive)
+		atomic_dec(&ec->waiters);
+}
+
+int
+event_count_timed_wait(event_count_t *ec, uint32_t key, const struct timespec *deadline)
+{
+	int result = 0;
+
+#ifdef __linux__
+	while (result == 0 && atomic_load_acquire(&ec->seq) == key)
+		result = futex_timed_wait(&ec->seq, key, deadline);
+#else
+	pthread_mutex_lock(&ec->mutex);
+	while (result == 0 && atomic_load_acquire(&ec->seq) == key)
+		result = pthread_cond_timedwait(&ec->cond, &ec->mutex, deadline);
+	pthread_mutex_unlock(&ec->mutex);
+#endif
+
+	// notified after all
+	if (result != 0 && atomic_load_acquire(&ec->seq) != key)
+		result = 0;
+
+	if (result != 0)
+		event_count_cancel_wait(ec);
+	else if (!ec->exclusive)
+		atomic_dec(&ec->waiters);
+
+	return result;
+}
+
+void
+event_count_notify(event_count_t *ec, int all)
+{
+	// pairs with the barrier in event_count_prepare_wait(): either the
+	// waiter sees the producer's data, or the producer sees the waiter
+	atomic_fence();
+	if (atomic_load_relaxed(&ec->waiters) <= 0)
+		return;
+
+	if (ec->exclusive && !atomic_cas(&ec->waiters, 1, 0))
+		return;	// another notifier has claimed the waiter
+
+#ifdef __linux__
+	atomic_inc(&ec->seq);
+	futex_wake(&ec->seq, all ? INT_MAX : 1);
+#else
+	pthread_mutex_lock(&ec->mutex);
+	atomic_inc(&ec->seq);
+	if (all)
+		pthread_cond_broadcast(&ec->cond);
+	else
+		pthread_cond_signal(&ec->cond);
+	pthread_mutex_unlock(&ec->mutex);
+#endif
+}
@@ -0,0 +1,65 @@
+/*
+ * eventcount.h
+ * Copyright by Zhang Shiyong, 2014. shiyong.zhang.cn@outlook.com
+ */
+
+#ifndef _EVENT_COUNT_H_
+#define _EVENT_COUNT_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Event count lets a lock-free consumer park when its queue is empty,
+ * while producers pay only a fence and a load when nobody is parked:
+ *
+ *   key = event_count_prepare_wait(ec);
+ *   if (condition is true)
+ *       event_count_cancel_wait(ec);
+ *   else
+ *       event_count_wait(ec, key);
+ *
+ * Producers make the condition true first and then call
+ * event_count_notify(), which only enters the kernel when waiters exist.
+ *
+ * An exclusive event count allows a single waiting thread, e.g. the consumer
+ * of a mpsc ring. The notifier claims that waiter before waking it, so a
+ * burst of notifications costs one wakeup instead of one per message.
+ */
+typedef struct _event_count
+{
+	volatile uint32_t	seq;
+	volatile int32_t	waiters;
+	int					exclusive;
+#ifndef __linux__
+	pthread_mutex_t		mutex;
+	pthread_cond_t		cond;
+#endif
+} event_count_t;
+
+void event_count_init(event_count_t *ec);
+void event_count_init_exclusive(event_count_t *ec);
+void event_count_destroy(event_count_t *ec);
+uint32_t event_count_prepare_wait(event_count_t *ec);
+void event_count_cancel_wait(event_count_t *ec);
+void event_count_wait(event_count_t *ec, uint32_t key);
+
+/*
+ * same, giving up at "deadline" on CLOCK_MONOTONIC. 0 when notified,
+ * ETIMEDOUT otherwise; either way the wait is over
+ */
+int event_count_timed_wait(event_count_t *ec, uint32_t key, const struct timespec *deadline);
+void event_count_notify(event_count_t *ec, int all);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _EVENT_COUNT_H_ */
+
+// ~ end
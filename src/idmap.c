@@ -0,0 +1,227 @@
+/*
+ * idmap.c
+ * Copyright by Zhang Shiyong, 2014. shiyong.zhang.cn@outlook.com
+ */
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+#include "atomic.h"
+#include "epoch.h"
+#include "idmap.h"
+
+#define ID_MAP_MIN_CAPACITY		8
+
+/*
+ * fibonacci hashing, takes the high bits so consecutive IDs spread out
+ */
+static inline uint32_t
+id_map_hash(id_map_table_t *table, uint32_t key)
+{
+	return (key * 0x9E3779B1u) >> table->shift;
+}
+
+static id_map_table_t *
+id_map_table_new(uint32_t capacity)
+{
+	id_map_table_t *table;
+	uint32_t size, bits, index;
+
+	for (size = ID_MAP_MIN_CAPACITY, bits = 3; size < capacity; size <<= 1)
+		bits++;
+
+	if (posix_memalign((void **)&table, CACHE_LINE_SIZE,
+		sizeof(id_map_table_t) + size * sizeof(id_map_entry_t)))
+		return NULL;
+
+	table->mask = size - 1;
+	table->shift = 32 - bits;
+	table->used = 0;
+	for (index = 0; index < size; index++)
+	{
+		table->entries[index].key = ID_MAP_EMPTY_KEY;
+		table->entries[index].value = NULL;
+	}
+
+	return table;
+}
+
+/*
+ * writer side, no publication ordering needed: table isn't visible yet
+ */
+static void
+id_map_table_insert(id_map_table_t *table, uint32_t key, void *value)
+{
+	uint32_t pos;
+
+	for (pos = id_map_hash(table, key); ; pos = (pos + 1) & table->mask)
+	{
+		if (table->entries[pos].key == ID_MAP_EMPTY_KEY)
+		{
+			table->entries[pos].value = value;
+			table->entries[pos].key = key;
+			table->used++;
+			return;
+		}
+	}
+}
+
+static int
+id_map_resize(id_map_t *map, uint32_t count)
+{
+	id_map_table_t *table, *old;
+	uint32_t index;
+
+	// keep load factor under 1/2 after growing
+	table = id_map_table_new(count * 4);
+	if (table == NULL)
+		return -1;
+
+	old = map->table;
+	for (index = 0; index <= old->mask; index++)
+	{
+		if (old->entries[index].key != ID_MAP_EMPTY_KEY
+			&& old->entries[index].value != NULL)
+			id_map_table_insert(table, old->entries[index].key,
+				old->entries[index].value);
+	}
+
+	atomic_store_release(&map->table, table);
+	epoch_retire(old, free);
+
+	return 0;
+}
+
+int
+id_map_init(id_map_t *map, uint32_t capacity)
+{
+	assert(map);
+
+	map->count = 0;
+	map->table = id_map_table_new(capacity * 2);
+
+	return map->table ? 0 : -1;
+}
+
+void
+id_map_destroy(id_map_t *map)
+{
+	assert(map);
+
+	// readers must be gone already
+	if (map->table)
+		free(map->table);
+	map->table = NULL;
+	map->count = 0;
+}
+
+void *
+id_map_get(id_map_t *map, uint32_t key)
+{
+	id_map_table_t *table;
+	uint32_t pos, k;
+
+	table = atomic_load_acquire(&map->table);
+	for (pos = id_map_hash(table, key); ; pos = (pos + 1) & table->mask)
+	{
+		k = atomic_load_acquire(&table->entries[pos].key);
+		if (k == key)
+			return atomic_load_acquire(&table->entries[pos].value);
+		if (k == ID_MAP_EMPTY_KEY)
+			return NULL;
+	}
+
+	return NULL;
+}
+
+int
+id_map_set(id_map_t *map, uint32_t key, void *value)
+{
+	id_map_table_t *table;
+	id_map_entry_t *entry;
+	uint32_t pos;
+
+	assert(key != ID_MAP_EMPTY_KEY);
+	assert(value != NULL);
+
+	table = map->table;
+	for (pos = id_map_hash(table, key); ; pos = (pos + 1) & table->mask)
+	{
+		entry = &table->entries[pos];
+		if (entry->key == key)
+		{
+			if (entry->value == NULL)
+				map->count++;
+			atomic_store_release(&entry->value, value);
+			return 0;
+		}
+
+		if (entry->key == ID_MAP_EMPTY_KEY)
+			break;
+	}
+
+	// new key, grow first if the table would become more than half full
+	if ((table->used + 1) * 2 > table->mask + 1)
+	{
+		if (id_map_resize(map, map->count + 1) != 0)
+			return -1;
+
+		table = map->table;
+		for (pos = id_map_hash(table, key);
+			table->entries[pos].key != ID_MAP_EMPTY_KEY;
+			pos = (pos + 1) & table->mask)
+			;
+		entry = &table->entries[pos];
+	}
+
+	// value first, a reader that finds the key must find the value too
+	entry->value = value;
+	atomic_store_release(&entry->key, key);
+	table->used++;
+	map->count++;
+
+	return 0;
+}
+
+void *
+id_map_remove(id_map_t *map, uint32_t key)
+{
+	id_map_table_t *table;
+	uint32_t pos;
+	void *value;
+
+	table = map->table;
+	for (pos = id_map_hash(table, key); ; pos = (pos + 1) & table->mask)
+	{
+		if (table->entries[pos].key == ID_MAP_EMPTY_KEY)
+			return NULL;
+
+		if (table->entries[pos].key == key)
+		{
+			value = table->entries[pos].value;
+			if (value != NULL)
+			{
+				atomic_store_release(&table->entries[pos].value, NULL);
+				map->count--;
+			}
+			return value;
+		}
+	}
+
+	return NULL;
+}
+
+void
+id_map_foreach(id_map_t *map, id_map_visit_t func, void *data)
+{
+	id_map_table_t *table;
+	uint32_t index;
+
+	table = map->table;
+	for (index = 0; index <= table->mask; index++)
+	{
+		if (table->entries[index].key != ID_MAP_EMPTY_KEY
+			&& table->entries[index].value != NULL)
+			(*func)(table->entries[index].key, table->entries[index].value, data);
+	}
+}
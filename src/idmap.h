@@ -0,0 +1,61 @@
+/*
+ * idmap.h
+ * Copyright by Zhang Shiyong, 2014. shiyong.zhang.cn@outlook.com
+ */
+
+#ifndef _ID_MAP_H_
+#define _ID_MAP_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ID_MAP_EMPTY_KEY	0xFFFFFFFF	// can't be used as a key
+
+/*
+ * Growable open-addressing hash map from a 32 bits ID to a pointer.
+ *
+ * id_map_get() is lock-free and must run inside epoch_enter()/epoch_exit().
+ * Writers must be serialized by the caller. A removed ID keeps its entry
+ * with a NULL value until the next resize, and a resize publishes a new
+ * table and retires the old one through the epoch module, so memory is
+ * proportional to the IDs in use rather than to the largest ID.
+ */
+typedef struct _id_map_entry
+{
+	volatile uint32_t	key;
+	void * volatile		value;
+} id_map_entry_t;
+
+typedef struct _id_map_table
+{
+	uint32_t			mask;
+	uint32_t			shift;
+	uint32_t			used;	// entries with a key, removed ones included
+	id_map_entry_t		entries[];
+} id_map_table_t;
+
+typedef struct _id_map
+{
+	id_map_table_t * volatile	table;
+	uint32_t					count;	// entries with a non NULL value
+} id_map_t;
+
+typedef void (*id_map_visit_t)(uint32_t key, void *value, void *data);
+
+int id_map_init(id_map_t *map, uint32_t capacity);
+void id_map_destroy(id_map_t *map);
+void *id_map_get(id_map_t *map, uint32_t key);
+int id_map_set(id_map_t *map, uint32_t key, void *value);
+void *id_map_remove(id_map_t *map, uint32_t key);
+void id_map_foreach(id_map_t *map, id_map_visit_t func, void *data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _ID_MAP_H_ */
+
+// ~ end
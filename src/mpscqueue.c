@@ -0,0 +1,295 @@
+/*
+ * mpscqueue.c
+ * Copyright by Zhang Shiyong, 2014. shiyong.zhang.cn@outlook.com
+ */
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "atomic.h"
+#include "mpscqueue.h"
+
+/*
+ * how many times a blocked side polls the ring before parking
+ */
+#define MPSC_QUEUE_SPIN		128
+
+mpsc_queue_t *
+mpsc_queue_new(uint32_t capacity)
+{
+	mpsc_queue_t *queue;
+	uint32_t size, index;
+
+	if (capacity == 0)
+		capacity = MPSC_QUEUE_DEFAULT_CAPACITY;
+
+	// round up to power of 2, so position maps to cell with a mask
+	for (size = 2; size < capacity; size <<= 1)
+		;
+
+	if (posix_memalign((void **)&queue, CACHE_LINE_SIZE, sizeof(mpsc_queue_t)))
+		return NULL;
+	memset(queue, 0, sizeof(mpsc_queue_t));
+
+	if (posix_memalign((void **)&queue->cells,
+		CACHE_LINE_SIZE, size * sizeof(mpsc_cell_t)))
+	{
+		free(queue);
+		return NULL;
+	}
+
+	for (index = 0; index < size; index++)
+	{
+		queue->cells[index].seq = index;
+		queue->cells[index].data = NULL;
+	}
+
+	queue->mask = size - 1;
+	event_count_init_exclusive(&queue->not_empty);
+	event_count_init(&queue->not_full);
+
+	return queue;
+}
+
+void
+mpsc_queue_destroy(mpsc_queue_t *queue)
+{
+	assert(queue);
+
+	event_count_destroy(&queue->not_empty);
+	event_count_destroy(&queue->not_full);
+	free(queue->cells);
+	free(queue);
+}
+
+int
+mpsc_queue_try_push(mpsc_queue_t *queue, void *data)
+{
+	mpsc_cell_t *cell;
+	uint32_t pos, seq;
+	int32_t dif;
+
+	assert(queue != NULL && data != NULL);
+
+	pos = atomic_load_relaxed(&queue->tail);
+	for (;;)
+	{
+		cell = &queue->cells[pos & queue->mask];
+		seq = atomic_load_acquire(&cell->seq);
+		dif = (int32_t)(seq - pos);
+
+		if (dif == 0)
+		{
+			if (atomic_cas(&queue->tail, pos, pos + 1))
+				break;
+			pos = atomic_load_relaxed(&queue->tail);
+		}
+		else if (dif < 0)
+			return -1;	// consumer hasn't released this cell yet, full
+		else
+			pos = atomic_load_relaxed(&queue->tail);
+	}
+
+	cell->data = data;
+	atomic_store_release(&cell->seq, pos + 1);
+
+	event_count_notify(&queue->not_empty, 0);
+
+	return 0;
+}
+
+void
+mpsc_queue_push(mpsc_queue_t *queue, void *data)
+{
+	uint32_t key;
+	int spin;
+
+	for (;;)
+	{
+		for (spin = 0; spin < MPSC_QUEUE_SPIN; spin++)
+		{
+			if (mpsc_queue_try_push(queue, data) == 0)
+				return;
+			cpu_relax();
+		}
+
+		key = event_count_prepare_wait(&queue->not_full);
+		if (mpsc_queue_try_push(queue, data) == 0)
+		{
+			event_count_cancel_wait(&queue->not_full);
+			return;
+		}
+		event_count_wait(&queue->not_full, key);
+	}
+}
+
+/*
+ * reserve as many consecutive cells as possible, up to "count", with a
+ * single cas. The consumer frees cells in order, so when the last cell of a
+ * range is free, the whole range is. Returns the number of data pushed
+ */
+uint32_t
+mpsc_queue_try_push_batch(mpsc_queue_t *queue, void **data, uint32_t count)
+{
+	uint32_t pos, seq, num, index;
+
+	assert(queue != NULL && data != NULL);
+
+	if (count == 0)
+		return 0;
+
+	if (count > queue->mask + 1)
+		count = queue->mask + 1;
+
+	pos = atomic_load_relaxed(&queue->tail);
+	num = count;
+	for (;;)
+	{
+		seq = atomic_load_acquire(&queue->cells[(pos + num - 1) & queue->mask].seq);
+		if (seq == pos + num - 1)
+		{
+			if (atomic_cas(&queue->tail, pos, pos + num))
+				break;
+
+			// lost the race to another producer, start over
+			pos = atomic_load_relaxed(&queue->tail);
+			num = count;
+		}
+		else if ((int32_t)(seq - (pos + num - 1)) < 0)
+		{
+			if (num == 1)
+				return 0;	// full
+			num >>= 1;
+		}
+		else
+		{
+			pos = atomic_load_relaxed(&queue->tail);
+			num = count;
+		}
+	}
+
+	for (index = 0; index < num; index++)
+	{
+		assert(data[index] != NULL);
+		queue->cells[(pos + index) & queue->mask].data = data[index];
+	}
+
+	// publish in order, the consumer stops at the first unpublished cell
+	for (index = 0; index < num; index++)
+		atomic_store_release(&queue->cells[(pos + index) & queue->mask].seq, pos + index + 1);
+
+	event_count_notify(&queue->not_empty, 0);
+
+	return num;
+}
+
+void
+mpsc_queue_push_batch(mpsc_queue_t *queue, void **data, uint32_t count)
+{
+	uint32_t key, num;
+
+	while (count > 0)
+	{
+		num = mpsc_queue_try_push_batch(queue, data, count);
+		if (num == 0)
+		{
+			key = event_count_prepare_wait(&queue->not_full);
+			num = mpsc_queue_try_push_batch(queue, data, count);
+			if (num == 0)
+			{
+				event_count_wait(&queue->not_full, key);
+				continue;
+			}
+			event_count_cancel_wait(&queue->not_full);
+		}
+
+		data += num;
+		count -= num;
+	}
+}
+
+void *
+mpsc_queue_try_pop(mpsc_queue_t *queue)
+{
+	mpsc_cell_t *cell;
+	uint32_t pos, seq;
+	void *data;
+
+	assert(queue != NULL);
+
+	pos = queue->head;
+	cell = &queue->cells[pos & queue->mask];
+	seq = atomic_load_acquire(&cell->seq);
+	if ((int32_t)(seq - (pos + 1)) < 0)
+		return NULL;	// producer hasn't filled it yet, empty
+
+	data = cell->data;
+	atomic_store_release(&cell->seq, pos + queue->mask + 1);
+	atomic_store_relaxed(&queue->head, pos + 1);	// mpsc_queue_length() reads it
+
+	// wake blocked producers once per quarter ring rather than per message,
+	// a full ring always crosses such a boundary before it drains
+	if (((pos + 1) & (queue->mask >> 2)) == 0)
+		event_count_notify(&queue->not_full, 1);
+
+	return data;
+}
+
+void *
+mpsc_queue_pop(mpsc_queue_t *queue)
+{
+	uint32_t key;
+	void *data;
+	int spin;
+
+	for (;;)
+	{
+		for (spin = 0; spin < MPSC_QUEUE_SPIN; spin++)
+		{
+			data = mpsc_queue_try_pop(queue);
+			if (data)
+				return data;
+			cpu_relax();
+		}
+
+		key = event_count_prepare_wait(&queue->not_empty);
+		data = mpsc_queue_try_pop(queue);
+		if (data)
+		{
+			event_count_cancel_wait(&queue->not_empty);
+			return data;
+		}
+		event_count_wait(&queue->not_empty, key);
+	}
+
+	return NULL;
+}
+
+/*
+ * wait until the ring isn't empty, then take up to "max" data without
+ * blocking again. Returns the number of data stored in "data"
+ */
+uint32_t
+mpsc_queue_pop_batch(mpsc_queue_t *queue, void **data, uint32_t max)
+{
+	uint32_t count;
+
+	assert(queue != NULL && data != NULL && max > 0);
+
+	data[0] = mpsc_queue_pop(queue);
+	for (count = 1; count < max; count++)
+	{
+		data[count] = mpsc_queue_try_pop(queue);
+		if (data[count] == NULL)
+			break;
+	}
+
+	return count;
+}
+
+uint32_t
+mpsc_queue_length(mpsc_queue_t *queue)
+{
+	assert(queue != NULL);
+
+	return atomic_load_relaxed(&queue->tail) - atomic_load_relaxed(&queue->head);
+}
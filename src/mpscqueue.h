@@ -0,0 +1,66 @@
+/*
+ * mpscqueue.h
+ * Copyright by Zhang Shiyong, 2014. shiyong.zhang.cn@outlook.com
+ */
+
+#ifndef _MPSC_QUEUE_H_
+#define _MPSC_QUEUE_H_
+
+#include <stdint.h>
+#include "common.h"
+#include "eventcount.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MPSC_QUEUE_DEFAULT_CAPACITY		4096
+
+/*
+ * Bounded lock-free multi-producer/single-consumer ring. Each cell carries
+ * a sequence number telling producers and the consumer whose turn it is,
+ * so pushing costs one cas on the tail and popping needs no atomic RMW at
+ * all. The consumer parks on an event count when the ring is empty, and
+ * producers park on another one when it is full.
+ */
+typedef struct _mpsc_cell
+{
+	volatile uint32_t	seq;
+	void *				data;
+} mpsc_cell_t;
+
+typedef struct _mpsc_queue
+{
+	mpsc_cell_t *		cells;
+	uint32_t			mask;
+	CACHE_LINE_PAD(pad0);
+
+	volatile uint32_t	tail;	// next position to push, shared by producers
+	CACHE_LINE_PAD(pad1);
+
+	uint32_t			head;	// next position to pop, owned by consumer
+	CACHE_LINE_PAD(pad2);
+
+	event_count_t		not_empty;
+	event_count_t		not_full;
+} mpsc_queue_t;
+
+
+mpsc_queue_t *mpsc_queue_new(uint32_t capacity);
+void mpsc_queue_destroy(mpsc_queue_t *queue);
+int mpsc_queue_try_push(mpsc_queue_t *queue, void *data);
+void mpsc_queue_push(mpsc_queue_t *queue, void *data);
+uint32_t mpsc_queue_try_push_batch(mpsc_queue_t *queue, void **data, uint32_t count);
+void mpsc_queue_push_batch(mpsc_queue_t *queue, void **data, uint32_t count);
+void *mpsc_queue_try_pop(mpsc_queue_t *queue);
+void *mpsc_queue_pop(mpsc_queue_t *queue);
+uint32_t mpsc_queue_pop_batch(mpsc_queue_t *queue, void **data, uint32_t max);
+uint32_t mpsc_queue_length(mpsc_queue_t *queue);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _MPSC_QUEUE_H_ */
+
+// ~ end
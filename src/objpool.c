@@ -0,0 +1,242 @@
+/*
+ * objpool.c
+ * Copyright by Zhang Shiyong, 2014. shiyong.zhang.cn@outlook.com
+ */
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+#include "objpool.h"
+
+typedef struct _obj_pool_cache
+{
+	obj_pool_t *	pool;
+	void *			head;
+	uint32_t		count;
+} obj_pool_cache_t;
+
+// a free object stores the link to the next one in its first word
+#define OBJ_NEXT(obj)	(*(void **)(obj))
+
+/*
+ * lock held, move up to "count" objects from the shared list into cache,
+ * carving a new slab when the list is empty
+ */
+static int
+obj_pool_refill(obj_pool_t *pool, obj_pool_cache_t *cache, uint32_t count)
+{
+	char *slab, *obj;
+	uint32_t index;
+
+	if (pool->free_list == NULL)
+	{
+		// first line of a slab links it into pool->slabs
+		if (posix_memalign((void **)&slab, CACHE_LINE_SIZE,
+			CACHE_LINE_SIZE + pool->slab_objects * pool->obj_size))
+			return -1;
+
+		OBJ_NEXT(slab) = pool->slabs;
+		pool->slabs = slab;
+
+		for (index = 0; index < pool->slab_objects; index++)
+		{
+			obj = slab + CACHE_LINE_SIZE + index * pool->obj_size;
+			OBJ_NEXT(obj) = pool->free_list;
+			pool->free_list = obj;
+		}
+		pool->free_count += pool->slab_objects;
+	}
+
+	while (count-- > 0 && pool->free_list)
+	{
+		obj = pool->free_list;
+		pool->free_list = OBJ_NEXT(obj);
+		pool->free_count--;
+
+		OBJ_NEXT(obj) = cache->head;
+		cache->head = obj;
+		cache->count++;
+	}
+
+	return 0;
+}
+
+/*
+ * lock held, give "count" objects of cache back to the shared list
+ */
+static void
+obj_pool_drain(obj_pool_t *pool, obj_pool_cache_t *cache, uint32_t count)
+{
+	void *obj;
+
+	while (count-- > 0 && cache->head)
+	{
+		obj = cache->head;
+		cache->head = OBJ_NEXT(obj);
+		cache->count--;
+
+		OBJ_NEXT(obj) = pool->free_list;
+		pool->free_list = obj;
+		pool->free_count++;
+	}
+}
+
+static void
+obj_pool_cache_exit(void *arg)
+{
+	obj_pool_cache_t *cache = (obj_pool_cache_t *)arg;
+	obj_pool_t *pool = cache->pool;
+
+	pthread_mutex_lock(&pool->lock);
+	obj_pool_drain(pool, cache, cache->count);
+	pthread_mutex_unlock(&pool->lock);
+
+	free(cache);
+}
+
+static inline obj_pool_cache_t *
+obj_pool_cache(obj_pool_t *pool)
+{
+	obj_pool_cache_t *cache;
+
+	cache = (obj_pool_cache_t *)pthread_getspecific(pool->key);
+	if (cache == NULL)
+	{
+		cache = (obj_pool_cache_t *)calloc(1, sizeof(obj_pool_cache_t));
+		if (cache == NULL)
+			return NULL;
+
+		cache->pool = pool;
+		pthread_setspecific(pool->key, cache);
+	}
+
+	return cache;
+}
+
+obj_pool_t *
+obj_pool_new(size_t obj_size)
+{
+	obj_pool_t *pool;
+	int result;
+
+	pool = (obj_pool_t *)calloc(1, sizeof(obj_pool_t));
+	if (pool == NULL)
+	{
+		show_err2(errno, "calloc");
+		return NULL;
+	}
+
+	// room for the free list link, and keep every object pointer aligned.
+	// Objects of a line or more start on a line so they touch no extra one
+	if (obj_size < sizeof(void *))
+		obj_size = sizeof(void *);
+	if (obj_size >= CACHE_LINE_SIZE)
+		pool->obj_size = (obj_size + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1);
+	else
+		pool->obj_size = (obj_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	pool->slab_objects = OBJ_POOL_SLAB_OBJECTS;
+	pool->cache_objects = OBJ_POOL_CACHE_OBJECTS;
+
+	result = pthread_key_create(&pool->key, obj_pool_cache_exit);
+	if (result != 0)
+	{
+		show_err2(result, "pthread_key_create");
+		free(pool);
+		return NULL;
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+
+	return pool;
+}
+
+void
+obj_pool_destroy(obj_pool_t *pool)
+{
+	obj_pool_cache_t *cache;
+	void *slab;
+
+	assert(pool);
+
+	// the calling thread's cache only, other users must have exited
+	cache = (obj_pool_cache_t *)pthread_getspecific(pool->key);
+	if (cache)
+	{
+		pthread_setspecific(pool->key, NULL);
+		free(cache);
+	}
+	pthread_key_delete(pool->key);
+
+	while ((slab = pool->slabs) != NULL)
+	{
+		pool->slabs = OBJ_NEXT(slab);
+		free(slab);
+	}
+
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+void *
+obj_pool_alloc(obj_pool_t *pool)
+{
+	obj_pool_cache_t *cache;
+	void *obj;
+
+	assert(pool);
+
+	cache = obj_pool_cache(pool);
+	if (cache == NULL)
+		return NULL;
+
+	if (cache->head == NULL)
+	{
+		pthread_mutex_lock(&pool->lock);
+		obj_pool_refill(pool, cache, pool->cache_objects / 2);
+		pthread_mutex_unlock(&pool->lock);
+
+		if (cache->head == NULL)
+			return NULL;
+	}
+
+	obj = cache->head;
+	cache->head = OBJ_NEXT(obj);
+	cache->count--;
+
+	return obj;
+}
+
+void
+obj_pool_free(obj_pool_t *pool, void *obj)
+{
+	obj_pool_cache_t *cache;
+
+	assert(pool);
+
+	if (obj == NULL)
+		return;
+
+	cache = obj_pool_cache(pool);
+	if (cache == NULL)
+	{
+		pthread_mutex_lock(&pool->lock);
+		OBJ_NEXT(obj) = pool->free_list;
+		pool->free_list = obj;
+		pool->free_count++;
+		pthread_mutex_unlock(&pool->lock);
+		return;
+	}
+
+	OBJ_NEXT(obj) = cache->head;
+	cache->head = obj;
+	cache->count++;
+
+	// producers allocate and slot threads free, hand surplus back in bulk
+	if (cache->count > pool->cache_objects)
+	{
+		pthread_mutex_lock(&pool->lock);
+		obj_pool_drain(pool, cache, pool->cache_objects / 2);
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
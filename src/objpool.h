@@ -0,0 +1,52 @@
+/*
+ * objpool.h
+ * Copyright by Zhang Shiyong, 2014. shiyong.zhang.cn@outlook.com
+ */
+
+#ifndef _OBJ_POOL_H_
+#define _OBJ_POOL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define OBJ_POOL_SLAB_OBJECTS	256	// objects carved from one malloc
+#define OBJ_POOL_CACHE_OBJECTS	64	// per-thread cache high-water mark
+
+/*
+ * Fixed-size object allocator. Objects are carved from slabs and recycled
+ * through a free list, each thread keeps a small cache in front of it so
+ * alloc and free normally touch no lock at all; the shared list is only
+ * locked to move half a cache at once. Slabs go back to the system in
+ * obj_pool_destroy() only.
+ */
+typedef struct _obj_pool
+{
+	size_t			obj_size;
+	uint32_t		slab_objects;
+	uint32_t		cache_objects;
+
+	pthread_key_t	key;		// obj_pool_cache_t of the calling thread
+
+	pthread_mutex_t	lock;
+	void *			free_list;
+	uint32_t		free_count;
+	void *			slabs;
+} obj_pool_t;
+
+obj_pool_t *obj_pool_new(size_t obj_size);
+void obj_pool_destroy(obj_pool_t *pool);	// every object must be freed, every user thread gone
+void *obj_pool_alloc(obj_pool_t *pool);
+void obj_pool_free(obj_pool_t *pool, void *obj);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _OBJ_POOL_H_ */
+
+// ~ end
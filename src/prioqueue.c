@@ -0,0 +1,310 @@
+/*
+ * prioqueue.c
+ * Copyright by Zhang Shiyong, 2014. shiyong.zhang.cn@outlook.com
+ */
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include "prioqueue.h"
+
+prio_queue_t *
+prio_queue_new(uint32_t lanes, size_t capacity)
+{
+	prio_queue_t *queue;
+	uint32_t index;
+
+	queue = (prio_queue_t *)calloc(1, sizeof(prio_queue_t));
+	if (queue == NULL)
+		return NULL;
+
+	if (lanes == 0)
+		lanes = 1;
+	queue->lane_count = (lanes < PRIO_QUEUE_MAX_LANES) ? lanes : PRIO_QUEUE_MAX_LANES;
+	queue->capacity = capacity;
+	for (index = 0; index < PRIO_QUEUE_MAX_LANES; index++)
+		queue_init(&queue->lanes[index]);
+
+	if (pthread_mutex_init(&queue->mutex, NULL) != 0)
+	{
+		free(queue);
+		return NULL;
+	}
+
+	if (pthread_cond_init(&queue->cond, NULL) != 0)
+	{
+		pthread_mutex_destroy(&queue->mutex);
+		free(queue);
+		return NULL;
+	}
+
+	if (pthread_cond_init(&queue->not_full, NULL) != 0)
+	{
+		pthread_cond_destroy(&queue->cond);
+		pthread_mutex_destroy(&queue->mutex);
+		free(queue);
+		return NULL;
+	}
+
+	return queue;
+}
+
+void
+prio_queue_destroy(prio_queue_t *queue)
+{
+	uint32_t index;
+
+	assert(queue);
+
+	for (index = 0; index < PRIO_QUEUE_MAX_LANES; index++)
+		queue_clear(&queue->lanes[index]);
+
+	pthread_cond_destroy(&queue->not_full);
+	pthread_cond_destroy(&queue->cond);
+	pthread_mutex_destroy(&queue->mutex);
+	free(queue);
+}
+
+static inline int
+prio_queue_full(prio_queue_t *queue)
+{
+	return queue->capacity && queue->length >= queue->capacity;
+}
+
+static void
+prio_queue_push_unlocked(prio_queue_t *queue, void *data, uint32_t lane)
+{
+	queue_push_tail(&queue->lanes[lane], data);
+	queue->ready |= 1u << lane;
+	queue->length++;
+	pthread_cond_signal(&queue->cond);
+}
+
+void
+prio_queue_push(prio_queue_t *queue, void *data, uint32_t lane)
+{
+	assert(queue != NULL && data != NULL);
+
+	if (lane >= queue->lane_count)
+		lane = queue->lane_count - 1;
+
+	pthread_mutex_lock(&queue->mutex);
+	while (prio_queue_full(queue))
+		pthread_cond_wait(&queue->not_full, &queue->mutex);
+	prio_queue_push_unlocked(queue, data, lane);
+	pthread_mutex_unlock(&queue->mutex);
+}
+
+void *
+prio_queue_push_overflow(prio_queue_t *queue, void *data, uint32_t lane,
+	queue_overflow_t policy, func_compare_custom match)
+{
+	list_t *link;
+	uint32_t lowest;
+	void *dropped = NULL;
+
+	assert(queue != NULL && data != NULL);
+
+	if (lane >= queue->lane_count)
+		lane = queue->lane_count - 1;
+
+	pthread_mutex_lock(&queue->mutex);
+	if (!prio_queue_full(queue))
+	{
+		prio_queue_push_unlocked(queue, data, lane);
+		pthread_mutex_unlock(&queue->mutex);
+		return NULL;
+	}
+
+	switch (policy)
+	{
+	case QUEUE_OVERFLOW_DROP_NEWEST:
+		dropped = data;
+		break;
+
+	case QUEUE_OVERFLOW_COALESCE:
+		for (link = queue->lanes[lane].tail; match && link; link = link->prev)
+		{
+			if (!(*match)(link->data, data))
+			{
+				dropped = link->data;
+				link->data = data;
+				break;
+			}
+		}
+		if (dropped)
+			break;
+		// nothing to coalesce with, drop the oldest instead
+		/* fall through */
+	case QUEUE_OVERFLOW_DROP_OLDEST:
+		// never make room for less important data
+		lowest = __builtin_ctz(queue->ready);
+		if (lowest > lane)
+		{
+			dropped = data;
+			break;
+		}
+
+		dropped = queue_pop_head(&queue->lanes[lowest]);
+		if (queue_length(&queue->lanes[lowest]) == 0)
+			queue->ready &= ~(1u << lowest);
+		queue->length--;
+		prio_queue_push_unlocked(queue, data, lane);
+		break;
+
+	default:
+		while (prio_queue_full(queue))
+			pthread_cond_wait(&queue->not_full, &queue->mutex);
+		prio_queue_push_unlocked(queue, data, lane);
+		break;
+	}
+	pthread_mutex_unlock(&queue->mutex);
+
+	return dropped;
+}
+
+static void *
+prio_queue_pop_unlocked(prio_queue_t *queue)
+{
+	uint32_t lane;
+	void *data;
+
+	if (queue->ready == 0)
+		return NULL;
+
+	lane = prio_queue_pick(queue->skipped, queue->ready);
+	data = queue_pop_head(&queue->lanes[lane]);
+	if (queue_length(&queue->lanes[lane]) == 0)
+		queue->ready &= ~(1u << lane);
+	queue->length--;
+
+	if (queue->capacity)
+		pthread_cond_signal(&queue->not_full);
+
+	return data;
+}
+
+void *
+prio_queue_pop(prio_queue_t *queue)
+{
+	void *data;
+
+	assert(queue != NULL);
+
+	pthread_mutex_lock(&queue->mutex);
+	while ((data = prio_queue_pop_unlocked(queue)) == NULL && !queue->closed)
+		pthread_cond_wait(&queue->cond, &queue->mutex);
+	pthread_mutex_unlock(&queue->mutex);
+
+	return data;
+}
+
+void *
+prio_queue_timed_pop(prio_queue_t *queue, unsigned int timeout_ms)
+{
+	struct timespec deadline;
+	void *data;
+
+	assert(queue != NULL);
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L)
+	{
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&queue->mutex);
+	while ((data = prio_queue_pop_unlocked(queue)) == NULL && !queue->closed)
+	{
+		if (pthread_cond_timedwait(&queue->cond, &queue->mutex, &deadline) == ETIMEDOUT)
+		{
+			data = prio_queue_pop_unlocked(queue);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&queue->mutex);
+
+	return data;
+}
+
+void *
+prio_queue_try_pop(prio_queue_t *queue)
+{
+	void *data;
+
+	assert(queue != NULL);
+
+	pthread_mutex_lock(&queue->mutex);
+	data = prio_queue_pop_unlocked(queue);
+	pthread_mutex_unlock(&queue->mutex);
+
+	return data;
+}
+
+/*
+ * wait until the queue isn't empty, then take up to "max" data in priority
+ * order under the same lock
+ */
+size_t
+prio_queue_pop_batch(prio_queue_t *queue, void **data, size_t max)
+{
+	size_t count = 0;
+
+	assert(queue != NULL && data != NULL && max > 0);
+
+	pthread_mutex_lock(&queue->mutex);
+	while (queue->ready == 0 && !queue->closed)
+		pthread_cond_wait(&queue->cond, &queue->mutex);
+
+	while (count < max && (data[count] = prio_queue_pop_unlocked(queue)) != NULL)
+		count++;
+	pthread_mutex_unlock(&queue->mutex);
+
+	return count;
+}
+
+/*
+ * no push may follow, consumers get what is queued and then NULL
+ */
+void
+prio_queue_close(prio_queue_t *queue)
+{
+	assert(queue != NULL);
+
+	pthread_mutex_lock(&queue->mutex);
+	queue->closed = 1;
+	pthread_cond_broadcast(&queue->cond);
+	pthread_mutex_unlock(&queue->mutex);
+}
+
+int
+prio_queue_drained(prio_queue_t *queue)
+{
+	int drained;
+
+	assert(queue != NULL);
+
+	pthread_mutex_lock(&queue->mutex);
+	drained = queue->closed && queue->length == 0;
+	pthread_mutex_unlock(&queue->mutex);
+
+	return drained;
+}
+
+size_t
+prio_queue_length(prio_queue_t *queue)
+{
+	size_t length;
+
+	assert(queue != NULL);
+
+	pthread_mutex_lock(&queue->mutex);
+	length = queue->length;
+	pthread_mutex_unlock(&queue->mutex);
+
+	return length;
+}
@@ -0,0 +1,100 @@
+/*
+ * prioqueue.h
+ * Copyright by Zhang Shiyong, 2014. shiyong.zhang.cn@outlook.com
+ */
+
+#ifndef _PRIO_QUEUE_H_
+#define _PRIO_QUEUE_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include "queue.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PRIO_QUEUE_MAX_LANES		4
+
+/*
+ * pops a non-empty lane may be passed over by higher lanes before it gets
+ * one, so a flood of urgent data slows bulk data down but never stops it
+ */
+#define PRIO_QUEUE_STARVE_LIMIT		32
+
+/*
+ * Queue with a few fixed priority lanes, the highest lane number is served
+ * first. Each lane is FIFO, a bitmask of non-empty lanes gives the next
+ * lane without scanning, "skipped" implements the starvation limit above.
+ * "capacity" bounds all lanes together, 0 is unbounded.
+ */
+typedef struct _prio_queue prio_queue_t;
+struct _prio_queue
+{
+	pthread_mutex_t	mutex;
+	pthread_cond_t	cond;
+	pthread_cond_t	not_full;
+	size_t			capacity;
+	uint32_t		lane_count;
+	uint32_t		ready;		// bit N set when lane N isn't empty
+	uint32_t		skipped[PRIO_QUEUE_MAX_LANES];
+	size_t			length;
+	int				closed;
+	queue_t			lanes[PRIO_QUEUE_MAX_LANES];
+};
+
+/*
+ * lane to serve next among the "ready" ones, and account for the lanes
+ * passed over. Shared with lock-free consumers keeping their own "skipped"
+ */
+static inline uint32_t
+prio_queue_pick(uint32_t *skipped, uint32_t ready)
+{
+	uint32_t top, lane, index;
+
+	top = 31 - __builtin_clz(ready);
+	lane = top;
+	for (index = 0; index < top; index++)
+	{
+		if ((ready & (1u << index)) && skipped[index] >= PRIO_QUEUE_STARVE_LIMIT)
+		{
+			lane = index;
+			break;
+		}
+	}
+
+	for (index = 0; index <= top; index++)
+	{
+		if (ready & (1u << index))
+			skipped[index] = (index == lane) ? 0 : skipped[index] + 1;
+	}
+
+	return lane;
+}
+
+prio_queue_t *prio_queue_new(uint32_t lanes, size_t capacity);
+void prio_queue_destroy(prio_queue_t *queue);
+void prio_queue_push(prio_queue_t *queue, void *data, uint32_t lane);	// lane clamped, waits for room
+
+/*
+ * same as async_queue_push_overflow(). Dropping the oldest takes the head
+ * of the lowest lane, or "data" itself if that lane is above "lane";
+ * coalescing looks in "lane" only
+ */
+void *prio_queue_push_overflow(prio_queue_t *queue, void *data, uint32_t lane,
+	queue_overflow_t policy, func_compare_custom match);
+void *prio_queue_pop(prio_queue_t *queue);		// NULL once closed and drained
+void *prio_queue_timed_pop(prio_queue_t *queue, unsigned int timeout_ms);	// NULL on timeout too
+void *prio_queue_try_pop(prio_queue_t *queue);
+size_t prio_queue_pop_batch(prio_queue_t *queue, void **data, size_t max);	// 0 once closed and drained
+void prio_queue_close(prio_queue_t *queue);
+int prio_queue_drained(prio_queue_t *queue);	// closed and empty
+size_t prio_queue_length(prio_queue_t *queue);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _PRIO_QUEUE_H_ */
+
+// ~ end
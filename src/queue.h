@@ -3,6 +3,9 @@
  * Copyright by Zhang Shiyong, 2014. shiyong.zhang.cn@outlook.com
  */
 
+#ifndef _QUEUE_H_
+#define _QUEUE_H_
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -56,6 +59,17 @@ struct _queue
 	unsigned int	count;	// total nodes of queue
 };
 
+/*
+ * what a push into a full bounded queue does
+ */
+typedef enum _queue_overflow
+{
+	QUEUE_OVERFLOW_BLOCK = 0,		// wait for room
+	QUEUE_OVERFLOW_DROP_NEWEST,		// drop the data pushed
+	QUEUE_OVERFLOW_DROP_OLDEST,		// drop the head to make room
+	QUEUE_OVERFLOW_COALESCE			// the data replaces the newest matching one, else drop oldest
+} queue_overflow_t;
+
 /*
  * queue operation
  */
@@ -73,4 +87,6 @@ void 			queue_foreach(queue_t *queue, func_visit_custom func, void *data);
 
 #ifdef __cplusplus
 }
-#endif
\ No newline at end of file
+#endif
+
+#endif /* _QUEUE_H_ */
@@ -7,16 +7,178 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
 #include "common.h"
 #include "trace.h"
+#include "epoch.h"
 #include "slot.h"
 
+/*
+ * latest message of one conflation key. "msg" is set while a token for the
+ * cell waits in the pool: a writer finding it set swaps its message in,
+ * one finding it empty queues a new token. Each token holds a reference,
+ * the conflation state holds one
+ */
+typedef struct _slot_cell
+{
+    tiny_msg_t * volatile msg;
+    atomic_t        refs;
+} slot_cell_t;
+
+typedef struct _slot_conflation
+{
+    tiny_msg_key_t  key;
+    slot_cell_t     *cell;      // NULL "key", one cell for the ID
+    id_map_t        cells;      // otherwise key to cell
+} slot_conflation_t;
+
+// a token is the cell address with the low bit set, messages are aligned
+#define SLOT_TOKEN(cell)        ((void *)((uintptr_t)(cell) | 1))
+#define SLOT_IS_TOKEN(data)     ((uintptr_t)(data) & 1)
+#define SLOT_TOKEN_CELL(data)   ((slot_cell_t *)((uintptr_t)(data) & ~(uintptr_t)1))
+
+static slot_cell_t *
+slot_cell_new(void)
+{
+    slot_cell_t *cell;
+
+    cell = (slot_cell_t *)calloc(1, sizeof(slot_cell_t));
+    if (cell)
+        cell->refs = 1;
+
+    return cell;
+}
+
+static void
+slot_cell_unref(slot_cell_t *cell)
+{
+    if (atomic_dec(&cell->refs) == 0)
+        free(cell);
+}
+
+static void
+slot_cell_drop(uint32_t key, void *cell, void *data)
+{
+    slot_cell_unref((slot_cell_t *)cell);
+}
+
+static slot_conflation_t *
+slot_conflation_new(tiny_msg_key_t key)
+{
+    slot_conflation_t *conf;
+
+    conf = (slot_conflation_t *)calloc(1, sizeof(slot_conflation_t));
+    if (conf == NULL)
+        return NULL;
+
+    conf->key = key;
+    if ((key && id_map_init(&conf->cells, 0) == 0)
+        || (!key && (conf->cell = slot_cell_new()) != NULL))
+        return conf;
+
+    free(conf);
+    return NULL;
+}
+
+static void
+slot_conflation_free(void *ptr)
+{
+    slot_conflation_t *conf = (slot_conflation_t *)ptr;
+
+    if (conf->key)
+    {
+        id_map_foreach(&conf->cells, slot_cell_drop, NULL);
+        id_map_destroy(&conf->cells);
+    }
+    else
+        slot_cell_unref(conf->cell);
+
+    free(conf);
+}
+
+static void
+slot_conflation_drop(uint32_t id, void *conf, void *data)
+{
+    slot_conflation_free(conf);
+}
+
+/*
+ * pool's resolve hook: a token runs the latest message of its cell
+ */
+static void *
+slot_msg_take(void *data)
+{
+    slot_cell_t *cell;
+    tiny_msg_t *msg;
+
+    if (!SLOT_IS_TOKEN(data))
+        return data;
+
+    cell = SLOT_TOKEN_CELL(data);
+    msg = atomic_xchg(&cell->msg, NULL);
+    slot_cell_unref(cell);
+
+    return msg;
+}
+
+/*
+ * worker side of every slot, drops the reference the bus gave this slot
+ * once the module's function has returned, or when the pool dropped it
+ */
+static void
+slot_msg_done(void *data)
+{
+    if (SLOT_IS_TOKEN(data))
+        data = slot_msg_take(data);
+
+    if (data)
+        tiny_msg_release((tiny_msg_t *)data);
+}
+
+/*
+ * messages coalesce with waiting ones of the same ID, a token only with
+ * itself
+ */
+static uint32_t
+slot_msg_key(void *data)
+{
+    if (SLOT_IS_TOKEN(data))
+        return (uint32_t)(uintptr_t)data;
+
+    return ((tiny_msg_t *)data)->msg_id;
+}
+
+void
+slot_attr_init(slot_attr_t *attr)
+{
+    assert(attr);
+
+    memset(attr, 0, sizeof(slot_attr_t));
+    thread_pool_attr_init(&attr->pool);
+    attr->inline_budget_us = SLOT_INLINE_BUDGET_US;
+}
+
 slot_t*
 slot_new(char *name, 
     uint32_t msg_delta, exec_t func, void *usr_data, int max_threads)
+{
+    slot_attr_t attr;
+
+    slot_attr_init(&attr);
+    attr.pool.max_threads = max_threads;
+
+    return slot_new_with_attr(name, msg_delta, func, usr_data, &attr);
+}
+
+slot_t*
+slot_new_with_attr(char *name,
+    uint32_t msg_delta, exec_t func, void *usr_data, const slot_attr_t *attr)
 {
 	slot_t *slot;
+	thread_pool_attr_t pool_attr;
 	int length;
+
+	assert(attr);
 	
 	slot = (slot_t *)calloc(1, sizeof(slot_t));
 	if (slot == NULL)
@@ -25,18 +187,64 @@ slot_new(char *name,
 		return NULL;
 	}
 
-    slot->msg_pool = thread_pool_new(func, usr_data, max_threads);
-    if (slot->msg_pool == NULL)
+    if (id_map_init(&slot->msg_funcs, 0) != 0)
+    {
+        show_err2(errno, "id_map_init");
+        free(slot);
+
+        return NULL;
+    }
+
+    if (id_map_init(&slot->conflation, 0) != 0)
     {
-        show_err2(errno, "thread_pool_new");
+        show_err2(errno, "id_map_init");
+        id_map_destroy(&slot->msg_funcs);
         free(slot);
-        
+
         return NULL;
     }
+    pthread_mutex_init(&slot->handler_lock, NULL);
+    pthread_mutex_init(&slot->write_lock, NULL);
+
+    slot->flags = attr->flags;
+    slot->msg_exec = func;
+    slot->usr_data = usr_data;
+    slot->inline_budget_ns = (uint64_t)attr->inline_budget_us * 1000;
+
+    // an inline slot runs in the delivering thread, it has no pool
+    if (!(slot->flags & SLOT_INLINE))
+    {
+        pool_attr = attr->pool;
+        pool_attr.done = slot_msg_done;
+        pool_attr.resolve = slot_msg_take;
+        if (pool_attr.key == NULL)
+            pool_attr.key = slot_msg_key;
+
+        if (slot->flags & SLOT_EXECUTOR)
+        {
+            pool_attr.mode = THREAD_POOL_STEAL;
+            pool_attr.steal_pool = thread_pool_executor();
+            pool_attr.serial = (pool_attr.max_threads <= 1);
+        }
+
+        slot->msg_pool = thread_pool_new_with_attr(func, usr_data, &pool_attr);
+        if (slot->msg_pool == NULL)
+        {
+            show_err2(errno, "thread_pool_new");
+            pthread_mutex_destroy(&slot->handler_lock);
+            pthread_mutex_destroy(&slot->write_lock);
+            id_map_destroy(&slot->msg_funcs);
+            id_map_destroy(&slot->conflation);
+            free(slot);
+
+            return NULL;
+        }
+    }
 
 	length = strlen(name);
 	length = (length < sizeof(slot->slot_name)) ? length : (sizeof(slot->slot_name) - 1);
 	strncpy(slot->slot_name, name, length);
+    TRACE_MODULE_INIT(&slot->trace, slot->slot_name);
 
     slot->msg_delta = msg_delta;
 	return slot;
@@ -46,52 +254,167 @@ void
 slot_free(slot_t *slot)
 {
 	assert(slot);
-	assert(slot->msg_pool);
     
-    thread_pool_free(slot->msg_pool);
+    if (slot->msg_pool)
+        thread_pool_free(slot->msg_pool);
+
+    pthread_mutex_destroy(&slot->handler_lock);
+    pthread_mutex_destroy(&slot->write_lock);
+    epoch_synchronize();
+    id_map_destroy(&slot->msg_funcs);
+
+    // tokens still queued keep their cells
+    id_map_foreach(&slot->conflation, slot_conflation_drop, NULL);
+    id_map_destroy(&slot->conflation);
 		
 	free(slot);
 }
 
-static inline uint32_t
-slot_entry_index(slot_t *slot, message_id_t id)
+static void
+slot_set_handler(slot_t *slot, message_id_t id, msg_func_t handler)
 {
+    pthread_mutex_lock(&slot->handler_lock);
+    if (handler)
+        id_map_set(&slot->msg_funcs, id, (void *)handler);
+    else
+        id_map_remove(&slot->msg_funcs, id);
+    pthread_mutex_unlock(&slot->handler_lock);
+}
+
+/*
+ * NULL "conf" turns conflation of "id" off. The old state is freed once no
+ * writer can be using it
+ */
+static void
+slot_set_conflation(slot_t *slot, message_id_t id, slot_conflation_t *conf)
+{
+    slot_conflation_t *old;
+
+    pthread_mutex_lock(&slot->handler_lock);
+    old = (slot_conflation_t *)id_map_remove(&slot->conflation, id);
+    if (conf && id_map_set(&slot->conflation, id, conf) != 0)
+    {
+        slot_conflation_free(conf);
+        conf = NULL;
+    }
+    pthread_mutex_unlock(&slot->handler_lock);
+
+    if (old)
+        epoch_retire(old, slot_conflation_free);
+}
+
+/*
+ * in an epoch. Creates the cell of a key seen for the first time
+ */
+static slot_cell_t *
+slot_cell_find(slot_t *slot, slot_conflation_t *conf, tiny_msg_t *msg)
+{
+    slot_cell_t *cell;
+    uint32_t key;
+
+    if (conf->key == NULL)
+        return conf->cell;
+
+    key = (*conf->key)(msg);
+    if (key == ID_MAP_EMPTY_KEY)
+        return NULL;
+
+    cell = (slot_cell_t *)id_map_get(&conf->cells, key);
+    if (cell)
+        return cell;
+
+    pthread_mutex_lock(&slot->handler_lock);
+    cell = (slot_cell_t *)id_map_get(&conf->cells, key);
+    if (cell == NULL)
+    {
+        cell = slot_cell_new();
+        if (cell && id_map_set(&conf->cells, key, cell) != 0)
+        {
+            free(cell);
+            cell = NULL;
+        }
+    }
+    pthread_mutex_unlock(&slot->handler_lock);
+
+    return cell;
+}
+
+msg_func_t
+slot_get_handler(slot_t *slot, message_id_t id)
+{
+    msg_func_t handler;
+
     assert(slot);
-    assert(id >= slot->msg_delta);
-    
-    return (id - slot->msg_delta);
+
+    epoch_enter();
+    handler = (msg_func_t)id_map_get(&slot->msg_funcs, id);
+    epoch_exit();
+
+    return handler;
+}
+
+static tiny_bus_result_t
+slot_subscribe0(tiny_bus_t *bus, slot_t *slot, message_id_t id,
+    msg_func_t handler, slot_conflation_t *conf)
+{
+    assert(slot);
+
+    // handler must be in place before the bus can deliver to us
+    slot_set_handler(slot, id, handler);
+    slot_set_conflation(slot, id, conf);
+
+    if (bus->dispatcher_count > 1 || bus->direct)
+        slot->write_shared = 1;
+
+    // this message id's slot array must be allocated;
+    if (tiny_bus_subscribe(bus, slot, id, handler) != TINY_BUS_SUCCEED)
+    {
+        show_err("Failed to subscribe message. You must allocat message id firstly.\r\n");
+        slot_set_handler(slot, id, NULL);
+        slot_set_conflation(slot, id, NULL);
+        return TINY_BUS_FAILED;
+    }
+	
+	return TINY_BUS_SUCCEED;
 }
 
 tiny_bus_result_t
 slot_subscribe_message(
     tiny_bus_t *bus, slot_t *slot, message_id_t id, msg_func_t handler)
 {
-	// this message id's slot lish must be allocated;
-	if (bus->slots[id] == NULL)
+    return slot_subscribe0(bus, slot, id, handler, NULL);
+}
+
+tiny_bus_result_t
+slot_subscribe_conflated(tiny_bus_t *bus, slot_t *slot, message_id_t id,
+    msg_func_t handler, tiny_msg_key_t key)
+{
+    slot_conflation_t *conf;
+
+    assert(slot);
+
+    // nothing ever waits in an inline slot
+    if (slot->flags & SLOT_INLINE)
+        return slot_subscribe0(bus, slot, id, handler, NULL);
+
+    conf = slot_conflation_new(key);
+    if (conf == NULL)
     {
-        show_err("Failed to subscribe message. You must allocat message id firstly.\r\n");
+        show_err2(ENOMEM, "slot_conflation_new");
         return TINY_BUS_FAILED;
     }
-	
-	pthread_mutex_lock(bus->mutex);
-	list_insert_tail(bus->slots[id], slot);
-	pthread_mutex_unlock(bus->mutex);
 
-    slot->msg_funcs[slot_entry_index(slot, id)] = handler;
-	
-	return TINY_BUS_SUCCEED;
+    return slot_subscribe0(bus, slot, id, handler, conf);
 }
 
 void
 slot_unsubscribe_message(tiny_bus_t *bus, slot_t *slot, message_id_t id)
 {
-    assert(bus->slots[id]);
-
-    pthread_mutex_lock(bus->mutex);
-    list_remove(bus->slots[id], slot);
-    pthread_mutex_unlock(bus->mutex);
+    // returns after the bus has stopped delivering "id" to this slot
+    tiny_bus_unsubscribe(bus, slot, id);
 
-    slot->msg_funcs[slot_entry_index(slot, id)] = NULL;
+    slot_set_handler(slot, id, NULL);
+    slot_set_conflation(slot, id, NULL);
 
     return;
 }
@@ -103,21 +426,133 @@ slot_unsubscribe_message(tiny_bus_t *bus, slot_t *slot, message_id_t id)
 tiny_bus_result_t
 slot_write(slot_t *slot, tiny_msg_t *msg)
 {
+    slot_conflation_t *conf;
+    slot_cell_t *cell;
+    tiny_msg_t *old;
+    void *data = msg;
+    uint32_t lane;
+    int dropped;
+
 	assert(slot);
-	assert(slot->msg_pool);
 	assert(msg);
 
-    thread_pool_push(slot->msg_pool, msg);
-	
-	return TINY_BUS_SUCCEED;
+    if (slot->flags & SLOT_INLINE)
+        return slot_call(slot, slot_get_handler(slot, msg->msg_id), msg);
+
+    // once in a cell "msg" may be replaced and released by another writer
+    lane = msg->priority;
+    if (slot->conflation.count)
+    {
+        epoch_enter();
+        conf = (slot_conflation_t *)id_map_get(&slot->conflation, msg->msg_id);
+        cell = conf ? slot_cell_find(slot, conf, msg) : NULL;
+        if (cell)
+        {
+            old = atomic_xchg(&cell->msg, msg);
+            if (old)
+            {
+                // its token is still waiting and will run us instead
+                epoch_exit();
+                atomic_inc(&slot->conflated);
+                tiny_msg_release(old);
+                return TINY_BUS_SUCCEED;
+            }
+
+            atomic_inc(&cell->refs);
+            data = SLOT_TOKEN(cell);
+        }
+        epoch_exit();
+    }
+
+    if (slot->write_shared && slot->msg_pool->mode == THREAD_POOL_RING)
+    {
+        pthread_mutex_lock(&slot->write_lock);
+        dropped = thread_pool_push_lane(slot->msg_pool, data, lane);
+        pthread_mutex_unlock(&slot->write_lock);
+    }
+    else
+        dropped = thread_pool_push_lane(slot->msg_pool, data, lane);
+
+    return dropped ? TINY_BUS_DROPPED : TINY_BUS_SUCCEED;
 }
 
-void
+static inline uint64_t
+slot_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+slot_report_overrun(slot_t *slot, tiny_msg_t *msg, uint64_t elapsed)
+{
+    uint64_t max;
+    uint32_t count;
+
+    do {
+        max = slot->inline_max_ns;
+    } while (elapsed > max && !atomic_cas(&slot->inline_max_ns, max, elapsed));
+
+    // 1st, 2nd, 4th, 8th... overrun, a slow handler can't flood the trace
+    count = atomic_inc(&slot->inline_overruns);
+    if ((count & (count - 1)) == 0)
+    {
+        TRACE_MODULE_LOG(&slot->trace, TRACE_WARNING_LEVEL,
+            "slot %s: inline handler for message %u took %llu ns, "
+            "budget %llu ns, %u overruns\r\n", slot->slot_name, msg->msg_id,
+            (unsigned long long)elapsed,
+            (unsigned long long)slot->inline_budget_ns, count);
+    }
+}
+
+tiny_bus_result_t
+slot_call(slot_t *slot, msg_func_t handler, tiny_msg_t *msg)
+{
+    uint64_t start, elapsed;
+
+    assert(slot);
+    assert(msg);
+
+    start = slot_now_ns();
+    if (handler)
+        (*handler)(slot, msg);
+    else if (slot->msg_exec)
+        (*slot->msg_exec)(msg, slot->usr_data);
+    elapsed = slot_now_ns() - start;
+
+    if (elapsed > slot->inline_budget_ns)
+        slot_report_overrun(slot, msg, elapsed);
+
+    // the reference the bus gave this slot
+    tiny_msg_release(msg);
+
+    return TINY_BUS_SUCCEED;
+}
+
+tiny_bus_result_t
 slot_publish(tiny_bus_t *bus, tiny_msg_t *msg)
 {
     assert(bus);
 
-    async_queue_push(bus->msg_queue, msg);
+    return tiny_bus_post(bus, msg);
+}
+
+tiny_bus_result_t
+slot_publish_keyed(tiny_bus_t *bus, tiny_msg_t *msg, uint32_t key)
+{
+    assert(bus);
+
+    return tiny_bus_post_keyed(bus, msg, key);
+}
+
+size_t
+slot_publish_batch(tiny_bus_t *bus, tiny_msg_t **msgs, size_t count)
+{
+    assert(bus);
+
+    return tiny_bus_post_batch(bus, msgs, count);
 }
 
 
@@ -14,13 +14,13 @@
 #include <stdint.h>
 #include "tinybus.h"
 #include "threadpool.h"
+#include "idmap.h"
+#include "trace.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-#define SLOT_MAX_MSG_NUM    256
-
 typedef enum _slot_status
 {
 	SLOT_NOT_READY		= 0,
@@ -29,14 +29,41 @@ typedef enum _slot_status
 	SLOT_READWRITE_READ	= 0X0003
 } slot_status_t;
 
-typedef enum _msg_result_t
+#define SLOT_INLINE				0x0001	// handlers run in the delivering thread
+#define SLOT_EXECUTOR			0x0002	// run on the process-wide executor
+
+#define SLOT_INLINE_BUDGET_US	50		// default time budget of an inline handler
+
+/*
+ * slot creation options, "pool" selects how the bus hands messages to the
+ * slot's worker threads. With THREAD_POOL_RING the bus thread writes into a
+ * fixed-capacity lock-free ring and nothing is allocated per delivery. With
+ * THREAD_POOL_STEAL messages run on a work-stealing pool, several slots can
+ * share one by setting the same "pool.steal_pool".
+ *
+ * SLOT_EXECUTOR is a shortcut for the latter with thread_pool_executor(),
+ * sized to the CPU count: the slot owns no thread at all. With
+ * "pool.max_threads" 1, the default, its messages still run one at a time
+ * in delivery order, as a strand; otherwise they run concurrently. The
+ * executor is shared, so "pool.cpus" is refused: pin a private
+ * THREAD_POOL_STEAL pool instead.
+ *
+ * A slot created with SLOT_INLINE in "flags" has no thread pool: the bus
+ * dispatcher, or the publisher on a direct bus, calls the handler itself.
+ * Meant for trivial handlers, each call longer than "inline_budget_us" is
+ * counted and reported since it holds up every other subscriber.
+ */
+typedef struct _slot_attr
 {
-    MSG_SUCCEED = 0,
-    MSG_FAILED  = 0X0001
-} msg_result_t;
+	thread_pool_attr_t	pool;
+	uint32_t			flags;
+	uint32_t			inline_budget_us;
+} slot_attr_t;
 
-typedef struct _slot slot_t;
-typedef msg_result_t (*msg_func_t)(slot_t *slot, tiny_msg_t *msg);
+/*
+ * conflation key of a message within its ID, see slot_subscribe_conflated()
+ */
+typedef uint32_t (*tiny_msg_key_t)(tiny_msg_t *msg);
 
 /*
  *  Each mudole should own a slot, which is used to communicate with bus
@@ -54,27 +81,70 @@ struct _slot
 	slot_status_t	slot_ready;	
 
     /*
-     * store message handler function in array msg_funcs, and array's index
-     * is "message id" actually.
-     * Attension: here slot's message ID is different from bus's message ID,
-     * so we need a map to transform bus's message ID to slot's message ID,
-     * it should be "index = msg_id - msg_delta"
+     * store message handler function in hash map msg_funcs, keyed by bus
+     * message ID, so a slot only pays for the IDs it subscribed. Use
+     * slot_get_handler() to look a handler up, "handler_lock" serializes
+     * subscription changes.
+     * msg_delta was the base of the old fixed-size handler array, it is
+     * kept for applications that still use it as their own ID offset
      */
     uint32_t        msg_delta;
-    msg_func_t      msg_funcs[SLOT_MAX_MSG_NUM];
+    id_map_t        msg_funcs;
+    pthread_mutex_t handler_lock;
 
     /*
      * contain message queue, using thread pool invoking message function to
      * process message
      */
     thread_pool_t   *msg_pool;
+
+    /*
+     * a THREAD_POOL_RING pool takes one writer at a time. Set once the
+     * slot is subscribed on a bus with several dispatchers or with direct
+     * publishing, then slot_write() serializes them on "write_lock"
+     */
+    volatile int    write_shared;
+    pthread_mutex_t write_lock;
+
+    /*
+     * SLOT_INLINE: "msg_exec" runs for messages without a subscribed
+     * handler. Calls over budget are counted in "inline_overruns", the
+     * longest call seen is "inline_max_ns"
+     */
+    uint32_t        flags;
+    exec_t          msg_exec;
+    void            *usr_data;
+    uint64_t        inline_budget_ns;
+    volatile uint32_t inline_overruns;
+    volatile uint64_t inline_max_ns;
+
+    /*
+     * message ID to its conflation state, for IDs subscribed with
+     * slot_subscribe_conflated(). Messages replaced while waiting are
+     * counted in "conflated"
+     */
+    id_map_t        conflation;
+    volatile uint32_t conflated;
+
+    /*
+     * the slot's own trace level, named after the slot. It follows the
+     * global level until trace_module_adjust(&slot->trace, level)
+     */
+    trace_module_t  trace;
     
 };
 
 
+void
+slot_attr_init(slot_attr_t *attr);
+
 slot_t *
 slot_new(char *name, uint32_t msg_delta, exec_t func, void *usr_data, int max_threads);
 
+slot_t *
+slot_new_with_attr(char *name,
+    uint32_t msg_delta, exec_t func, void *usr_data, const slot_attr_t *attr);
+
 void
 slot_free(slot_t *slot);
 
@@ -85,17 +155,62 @@ void
 slot_unsubscribe_message(tiny_bus_t *bus, slot_t *slot, message_id_t id);
 
 /*
- * module publish message into bus
+ * subscribe with "latest value wins" delivery: a message of "id" written
+ * while one with the same "key" (all of them if "key" is NULL) is still
+ * waiting in the slot replaces it, the waiting one is released unhandled.
+ * Keys are remembered until unsubscribed, 0xFFFFFFFF isn't conflated.
+ * Subscribing again with slot_subscribe_message() turns it off. Meaningless
+ * on a SLOT_INLINE slot, which subscribes normally
  */
-void
+tiny_bus_result_t
+slot_subscribe_conflated(tiny_bus_t *bus, slot_t *slot, message_id_t id,
+    msg_func_t handler, tiny_msg_key_t key);
+
+/*
+ * handler subscribed for message ID, NULL if none. Lock-free
+ */
+msg_func_t
+slot_get_handler(slot_t *slot, message_id_t id);
+
+/*
+ * module publish message into bus. On a bus created with "direct" the
+ * calling thread writes it into the subscribers' slots right away.
+ * TINY_BUS_DROPPED when the full ingress, or on a direct bus a full
+ * subscriber slot, dropped a message
+ */
+tiny_bus_result_t
 slot_publish(tiny_bus_t *bus, tiny_msg_t *msg);    
 
 /*
- * bus send message into slot's msg queue
+ * publish with a partition key instead of the message ID: messages sharing
+ * a key are delivered in publish order by the same bus dispatcher
+ */
+tiny_bus_result_t
+slot_publish_keyed(tiny_bus_t *bus, tiny_msg_t *msg, uint32_t key);
+
+/*
+ * publish "count" messages in order, paying one ingress synchronization for
+ * the whole burst instead of one per message. Returns the messages dropped
+ */
+size_t
+slot_publish_batch(tiny_bus_t *bus, tiny_msg_t **msgs, size_t count);
+
+/*
+ * bus send message into slot's msg queue, or run it now on an inline slot.
+ * A slot bounded by "pool.capacity" applies "pool.overflow" when full and
+ * returns TINY_BUS_DROPPED if a message, this one or an older one, was
+ * dropped; "msg_pool->dropped" counts them
  */
 tiny_bus_result_t
 slot_write(slot_t *slot, tiny_msg_t *msg);
 
+/*
+ * run "handler" (msg_exec if NULL) on an inline slot in the calling thread,
+ * used by the bus which already knows the handler
+ */
+tiny_bus_result_t
+slot_call(slot_t *slot, msg_func_t handler, tiny_msg_t *msg);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,177 @@
+/*
+ * spscqueue.c
+ * Copyright by Zhang Shiyong, 2014. shiyong.zhang.cn@outlook.com
+ */
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "atomic.h"
+#include "spscqueue.h"
+
+/*
+ * how many times a blocked side polls the ring before parking
+ */
+#define SPSC_QUEUE_SPIN		128
+
+spsc_queue_t *
+spsc_queue_new(uint32_t capacity)
+{
+	spsc_queue_t *queue;
+	uint32_t size;
+
+	if (capacity == 0)
+		capacity = SPSC_QUEUE_DEFAULT_CAPACITY;
+
+	for (size = 2; size < capacity; size <<= 1)
+		;
+
+	if (posix_memalign((void **)&queue, CACHE_LINE_SIZE, sizeof(spsc_queue_t)))
+		return NULL;
+	memset(queue, 0, sizeof(spsc_queue_t));
+
+	if (posix_memalign((void **)&queue->cells,
+		CACHE_LINE_SIZE, size * sizeof(void *)))
+	{
+		free(queue);
+		return NULL;
+	}
+	memset(queue->cells, 0, size * sizeof(void *));
+
+	queue->mask = size - 1;
+	event_count_init_exclusive(&queue->not_empty);
+	event_count_init_exclusive(&queue->not_full);
+
+	return queue;
+}
+
+void
+spsc_queue_destroy(spsc_queue_t *queue)
+{
+	assert(queue);
+
+	event_count_destroy(&queue->not_empty);
+	event_count_destroy(&queue->not_full);
+	free(queue->cells);
+	free(queue);
+}
+
+int
+spsc_queue_try_push(spsc_queue_t *queue, void *data)
+{
+	uint32_t tail;
+
+	assert(queue != NULL && data != NULL);
+
+	tail = queue->tail;
+	if (tail - queue->head_cache > queue->mask)
+	{
+		queue->head_cache = atomic_load_acquire(&queue->head);
+		if (tail - queue->head_cache > queue->mask)
+			return -1;
+	}
+
+	queue->cells[tail & queue->mask] = data;
+	atomic_store_release(&queue->tail, tail + 1);
+
+	event_count_notify(&queue->not_empty, 0);
+
+	return 0;
+}
+
+void
+spsc_queue_push(spsc_queue_t *queue, void *data)
+{
+	uint32_t key;
+	int spin;
+
+	for (;;)
+	{
+		for (spin = 0; spin < SPSC_QUEUE_SPIN; spin++)
+		{
+			if (spsc_queue_try_push(queue, data) == 0)
+				return;
+			cpu_relax();
+		}
+
+		key = event_count_prepare_wait(&queue->not_full);
+		if (spsc_queue_try_push(queue, data) == 0)
+		{
+			event_count_cancel_wait(&queue->not_full);
+			return;
+		}
+		event_count_wait(&queue->not_full, key);
+	}
+}
+
+void *
+spsc_queue_try_pop(spsc_queue_t *queue)
+{
+	uint32_t head;
+	void *data;
+
+	assert(queue != NULL);
+
+	head = queue->head;
+	if (head == queue->tail_cache)
+	{
+		queue->tail_cache = atomic_load_acquire(&queue->tail);
+		if (head == queue->tail_cache)
+			return NULL;
+	}
+
+	data = queue->cells[head & queue->mask];
+	atomic_store_release(&queue->head, head + 1);
+
+	// producer only blocks on a full ring, wake it once per quarter ring
+	if (((head + 1) & (queue->mask >> 2)) == 0)
+		event_count_notify(&queue->not_full, 0);
+
+	return data;
+}
+
+void *
+spsc_queue_pop(spsc_queue_t *queue)
+{
+	uint32_t key;
+	void *data;
+	int spin;
+
+	for (;;)
+	{
+		for (spin = 0; spin < SPSC_QUEUE_SPIN; spin++)
+		{
+			data = spsc_queue_try_pop(queue);
+			if (data)
+				return data;
+			cpu_relax();
+		}
+
+		key = event_count_prepare_wait(&queue->not_empty);
+		data = spsc_queue_try_pop(queue);
+		if (data || atomic_load_acquire(&queue->closed))
+		{
+			event_count_cancel_wait(&queue->not_empty);
+			return data;
+		}
+		event_count_wait(&queue->not_empty, key);
+	}
+
+	return NULL;
+}
+
+void
+spsc_queue_close(spsc_queue_t *queue)
+{
+	assert(queue);
+
+	atomic_store_release(&queue->closed, 1);
+	event_count_notify(&queue->not_empty, 1);
+}
+
+uint32_t
+spsc_queue_length(spsc_queue_t *queue)
+{
+	assert(queue != NULL);
+
+	return atomic_load_relaxed(&queue->tail) - atomic_load_relaxed(&queue->head);
+}
@@ -0,0 +1,59 @@
+/*
+ * spscqueue.h
+ * Copyright by Zhang Shiyong, 2014. shiyong.zhang.cn@outlook.com
+ */
+
+#ifndef _SPSC_QUEUE_H_
+#define _SPSC_QUEUE_H_
+
+#include <stdint.h>
+#include "common.h"
+#include "eventcount.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SPSC_QUEUE_DEFAULT_CAPACITY		1024
+
+/*
+ * Bounded lock-free single-producer/single-consumer ring of pointers. Each
+ * side keeps a private copy of the other side's index, so in steady state a
+ * push or pop touches only its own cache line and the slot itself.
+ */
+typedef struct _spsc_queue
+{
+	void **				cells;
+	uint32_t			mask;
+	volatile int		closed;
+	CACHE_LINE_PAD(pad0);
+
+	volatile uint32_t	tail;		// written by producer
+	uint32_t			head_cache;	// producer's view of head
+	CACHE_LINE_PAD(pad1);
+
+	volatile uint32_t	head;		// written by consumer
+	uint32_t			tail_cache;	// consumer's view of tail
+	CACHE_LINE_PAD(pad2);
+
+	event_count_t		not_empty;
+	event_count_t		not_full;
+} spsc_queue_t;
+
+
+spsc_queue_t *spsc_queue_new(uint32_t capacity);
+void spsc_queue_destroy(spsc_queue_t *queue);
+int spsc_queue_try_push(spsc_queue_t *queue, void *data);
+void spsc_queue_push(spsc_queue_t *queue, void *data);
+void *spsc_queue_try_pop(spsc_queue_t *queue);
+void *spsc_queue_pop(spsc_queue_t *queue);	// NULL once closed and drained
+void spsc_queue_close(spsc_queue_t *queue);
+uint32_t spsc_queue_length(spsc_queue_t *queue);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _SPSC_QUEUE_H_ */
+
+// ~ end
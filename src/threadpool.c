@@ -1,25 +1,296 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <time.h>
 #include "common.h"
 #include "threadpool.h"
 
+/*
+ * data a strand runs before yielding its worker to other tasks
+ */
+#define THREAD_POOL_STRAND_BATCH	64
+
+static ws_pool_t *thread_pool_shared;
+static pthread_once_t thread_pool_shared_once = PTHREAD_ONCE_INIT;
+
+static void
+thread_pool_destroy(thread_pool_t *tp)
+{
+	if (tp->queue)
+		async_queue_destroy(tp->queue);
+
+	if (tp->lanes)
+		prio_queue_destroy(tp->lanes);
+
+	if (tp->ring)
+	{
+		spsc_queue_destroy(tp->ring);
+		pthread_mutex_destroy(&tp->ring_lock);
+	}
+
+	if (tp->strand)
+		mpsc_queue_destroy(tp->strand);
+
+	if (tp->mode == THREAD_POOL_QUEUE)
+		pthread_mutex_destroy(&tp->resize_lock);
+
+	if (tp->cpus)
+		free(tp->cpus);
+
+	free(tp);
+}
+
+static inline uint64_t
+thread_pool_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *thread_pool_thread_proxy(void *arg);
+
+static int
+thread_pool_queue_new(thread_pool_t *tp, const thread_pool_attr_t *attr)
+{
+	if (tp->mode == THREAD_POOL_RING)
+		tp->ring = spsc_queue_new(attr->ring_capacity);
+	else if (attr->lanes > 1)
+		tp->lanes = prio_queue_new(attr->lanes, attr->capacity);
+	else
+		tp->queue = async_queue_new_bounded(attr->capacity);
+
+	return (tp->queue || tp->lanes || tp->ring) ? 0 : -1;
+}
+
+typedef struct _thread_pool_placement
+{
+	thread_pool_t *				tp;
+	const thread_pool_attr_t *	attr;
+} thread_pool_placement_t;
 
 static void *
-thread_pool_thread_proxy(void *arg)
+thread_pool_place_proxy(void *arg)
 {
-	thread_pool_t *tp = (thread_pool_t*)arg;
-	task_data_t *data;
-	int num;
+	thread_pool_placement_t *placement = (thread_pool_placement_t *)arg;
+	int result;
+
+	result = thread_pool_set_affinity(pthread_self(),
+		placement->tp->cpus, placement->tp->cpu_count);
+	show_err2(result, "thread_pool_set_affinity");
+
+	// first touch from here, the kernel puts the pages on the workers' node
+	thread_pool_queue_new(placement->tp, placement->attr);
+
+	return NULL;
+}
+
+/*
+ * queue or ring of a pinned pool, allocated by a thread pinned like its
+ * workers. Done before any worker starts, so pushing is possible as soon
+ * as thread_pool_new_with_attr() returns
+ */
+static void
+thread_pool_place(thread_pool_t *tp, const thread_pool_attr_t *attr)
+{
+	thread_pool_placement_t placement;
+	pthread_t thread;
+	int result;
+
+	placement.tp = tp;
+	placement.attr = attr;
+	result = pthread_create(&thread, NULL, thread_pool_place_proxy, &placement);
+	if (result != 0)
+	{
+		show_err2(result, "pthread_create");
+		thread_pool_queue_new(tp, attr);	// unplaced rather than none
+		return;
+	}
+	pthread_join(thread, NULL);
+}
+
+/*
+ * 0 when "b" may replace the waiting "a", see list_find_custom()
+ */
+static int
+thread_pool_task_match(void *a, void *b)
+{
+	task_data_t *queued = (task_data_t *)a, *data = (task_data_t *)b;
+
+	return !(queued->id == task_run && queued->key == data->key);
+}
+
+static inline void
+thread_pool_exec(thread_pool_t *tp, void *data)
+{
+	if (tp->resolve && (data = (*tp->resolve)(data)) == NULL)
+		return;
+
+	(*tp->exec)(data, tp->usr_data);
+	if (tp->done)
+		(*tp->done)(data);
+}
+
+/*
+ * THREAD_POOL_STEAL without strand: with "resolve" the tasks need us, the
+ * last one or thread_pool_free() frees us
+ */
+static void
+thread_pool_unref(thread_pool_t *tp)
+{
+	if (atomic_dec(&tp->refs) == 0)
+		free(tp);
+}
+
+static void
+thread_pool_run_resolved(void *data, void *arg)
+{
+	thread_pool_t *tp = (thread_pool_t *)arg;
+
+	thread_pool_exec(tp, data);
+	thread_pool_unref(tp);
+}
+
+/*
+ * data refused or evicted by the overflow policy
+ */
+static int
+thread_pool_drop(thread_pool_t *tp, task_data_t *td)
+{
+	atomic_inc(&tp->dropped);
+	if (tp->elastic)
+		atomic_dec(&tp->pending);
+
+	if (tp->done)
+		(*tp->done)(td->param);
+	free(td);
+
+	return 1;
+}
+
+static int
+thread_pool_spawn(thread_pool_t *tp)
+{
+	pthread_t 		thread;
+	pthread_attr_t	attr;	
+	int				result;
 	
+	posix_check_cmd(pthread_attr_init(&attr));
+	posix_check_cmd(
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED));
+
+	result = pthread_create(&thread, &attr, thread_pool_thread_proxy, tp);
+	show_err2(result, "pthread_create");
+
+	posix_check_cmd(pthread_attr_destroy(&attr));
+
+	return result;
+}
+
+/*
+ * elastic pool: add a thread if none is idle and we are under the limit.
+ * The new thread counts as idle from the start, so a burst of triggers
+ * before it runs doesn't spawn one thread each
+ */
+static void
+thread_pool_grow(thread_pool_t *tp)
+{
+	pthread_mutex_lock(&tp->resize_lock);
+	if (!tp->stopping && atomic_get(&tp->idle_threads) == 0
+		&& (atomic_get(&tp->max_threads) == -1
+			|| atomic_get(&tp->num_threads) < atomic_get(&tp->max_threads)))
+	{
+		atomic_inc(&tp->num_threads);
+		atomic_inc(&tp->idle_threads);
+		if (thread_pool_spawn(tp) != 0)
+		{
+			atomic_dec(&tp->idle_threads);
+			atomic_dec(&tp->num_threads);
+		}
+	}
+	pthread_mutex_unlock(&tp->resize_lock);
+}
+
+/*
+ * elastic pool: an idle thread leaves while there are more than
+ * "min_threads". The caller exits when this returns 1, already uncounted
+ */
+static int
+thread_pool_retire(thread_pool_t *tp)
+{
+	int retired = 0;
+
+	pthread_mutex_lock(&tp->resize_lock);
+	if (!tp->stopping && atomic_get(&tp->num_threads) > atomic_get(&tp->min_threads))
+	{
+		atomic_dec(&tp->num_threads);
+		retired = 1;
+	}
+	pthread_mutex_unlock(&tp->resize_lock);
+
+	return retired;
+}
+
+/*
+ * returns 1 if the thread retired, 0 on a stop task or once the closed
+ * lanes are drained
+ */
+static int
+thread_pool_run_queue(thread_pool_t *tp)
+{
+	task_data_t *data;
+
 	while ( 1 )
 	{
-		data = (task_data_t *)async_queue_pop(tp->queue);
+		if (tp->elastic)
+		{
+			// idle_threads counts us while we wait
+			if (tp->lanes)
+				data = (task_data_t *)prio_queue_timed_pop(tp->lanes, tp->idle_timeout_ms);
+			else
+				data = (task_data_t *)async_queue_timed_pop(tp->queue, tp->idle_timeout_ms);
+			if (data == NULL)
+			{
+				if (tp->lanes && prio_queue_drained(tp->lanes))
+					break;
+				if (thread_pool_retire(tp))
+				{
+					atomic_dec(&tp->idle_threads);
+					return 1;
+				}
+				continue;
+			}
+			atomic_dec(&tp->idle_threads);
+		}
+		else if (tp->lanes)
+		{
+			data = (task_data_t *)prio_queue_pop(tp->lanes);
+			if (data == NULL)
+				break;
+		}
+		else
+			data = (task_data_t *)async_queue_pop(tp->queue);
+
 		if (data->id == task_run)
 		{
-			(*tp->exec)(data->param, tp->usr_data);
+			if (tp->elastic)
+			{
+				atomic_dec(&tp->pending);
+				if (tp->grow_wait_ns && atomic_get(&tp->idle_threads) == 0
+					&& thread_pool_now_ns() - data->pushed_ns > tp->grow_wait_ns)
+					thread_pool_grow(tp);
+			}
+
+			thread_pool_exec(tp, data->param);
 			free(data);
+
+			if (tp->elastic)
+				atomic_inc(&tp->idle_threads);
 		}
 		else if (data->id == task_stop)
 		{
@@ -28,12 +299,131 @@ thread_pool_thread_proxy(void *arg)
 		}
 	}
 
+	return 0;
+}
+
+static void
+thread_pool_run_ring(thread_pool_t *tp)
+{
+	void *data;
+
+	while ( 1 )
+	{
+		// only one worker waits on the ring, the others wait on the lock
+		pthread_mutex_lock(&tp->ring_lock);
+		data = spsc_queue_pop(tp->ring);
+		pthread_mutex_unlock(&tp->ring_lock);
+
+		if (data == NULL)
+			break;	// ring closed by thread_pool_free() and drained
+
+		thread_pool_exec(tp, data);
+	}
+}
+
+/*
+ * one run of a strand on a pool worker. Only one run is scheduled at a
+ * time, so data are executed one by one in push order. "tp" itself is
+ * pushed by thread_pool_free() as the last data
+ */
+static void
+thread_pool_run_strand(void *arg, void *unused)
+{
+	thread_pool_t *tp = (thread_pool_t *)arg;
+	void *data;
+	int count;
+
+	for (count = 1; ; count++)
+	{
+		// counted by strand_pending, so it is there or about to be
+		while ((data = mpsc_queue_try_pop(tp->strand)) == NULL)
+			cpu_relax();
+
+		if (data == tp)
+		{
+			thread_pool_destroy(tp);
+			return;
+		}
+
+		thread_pool_exec(tp, data);
+
+		if (atomic_dec(&tp->strand_pending) == 0)
+			return;
+
+		// still busy, requeue behind the other tasks of the pool
+		if (count == THREAD_POOL_STRAND_BATCH)
+		{
+			ws_pool_submit(tp->steal, thread_pool_run_strand, NULL, tp, NULL);
+			return;
+		}
+	}
+}
+
+static void
+thread_pool_strand_push(thread_pool_t *tp, void *data)
+{
+	mpsc_queue_push(tp->strand, data);
+
+	if (atomic_inc(&tp->strand_pending) == 1)
+		ws_pool_submit(tp->steal, thread_pool_run_strand, NULL, tp, NULL);
+}
+
+int
+thread_pool_set_affinity(pthread_t thread, const int *cpus, uint32_t count)
+{
+#ifdef __linux__
+	cpu_set_t set;
+	uint32_t index;
+
+	CPU_ZERO(&set);
+	for (index = 0; index < count; index++)
+	{
+		if (cpus[index] >= 0 && cpus[index] < CPU_SETSIZE)
+			CPU_SET(cpus[index], &set);
+	}
+
+	return pthread_setaffinity_np(thread, sizeof(cpu_set_t), &set);
+#else
+	return ENOSYS;
+#endif
+}
+
+static void
+thread_pool_shared_init(void)
+{
+	thread_pool_shared = ws_pool_new(0);
+}
+
+ws_pool_t *
+thread_pool_executor(void)
+{
+	pthread_once(&thread_pool_shared_once, thread_pool_shared_init);
+
+	return thread_pool_shared;
+}
+
+static void *
+thread_pool_thread_proxy(void *arg)
+{
+	thread_pool_t *tp = (thread_pool_t*)arg;
+	int num, result;
+
+	if (tp->cpu_count)
+	{
+		result = thread_pool_set_affinity(pthread_self(), tp->cpus, tp->cpu_count);
+		show_err2(result, "thread_pool_set_affinity");
+	}
+	
+	if (tp->mode == THREAD_POOL_RING)
+		thread_pool_run_ring(tp);
+	else if (thread_pool_run_queue(tp))
+		return NULL;	// retired by an elastic pool, others still run
+
 	num = atomic_dec(&tp->num_threads);
 	if (num == 0)
 	{
-		// async queue length should be zero now
-		async_queue_destroy(tp->queue);
-		free(tp);
+		// queue length should be zero now
+		thread_pool_destroy(tp);
 	}
 
 #ifdef _THREAD_POOL_DEBUG_
@@ -47,43 +437,159 @@ thread_pool_thread_proxy(void *arg)
 static void
 thread_pool_start_threads(thread_pool_t *tp)
 {
-	pthread_t 		thread;
-	pthread_attr_t	attr;	
-	int				result;
-	
-	posix_check_cmd(pthread_attr_init(&attr));
-	posix_check_cmd(
-		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED));
+	if (tp->elastic)
+	{
+		while (atomic_get(&tp->num_threads) < atomic_get(&tp->min_threads))
+		{
+			atomic_inc(&tp->num_threads);
+			atomic_inc(&tp->idle_threads);
+			if (thread_pool_spawn(tp) != 0)
+			{
+				atomic_dec(&tp->idle_threads);
+				atomic_dec(&tp->num_threads);
+				break;
+			}
+		}
+		return;
+	}
 
 	while (atomic_get(&tp->max_threads) == -1 
 		|| atomic_get(&tp->num_threads) < atomic_get(&tp->max_threads))
 	{
-		result = pthread_create(
-			&thread, &attr, thread_pool_thread_proxy, tp);
-		show_err2(result, "pthread_create");
+		thread_pool_spawn(tp);
 		
 		atomic_inc(&tp->num_threads);
 
 		if (atomic_get(&tp->max_threads) == -1)
 			break;
 	}
+}
 
-	posix_check_cmd(pthread_attr_destroy(&attr));
+void
+thread_pool_attr_init(thread_pool_attr_t *attr)
+{
+	assert(attr);
+
+	memset(attr, 0, sizeof(thread_pool_attr_t));
+	attr->mode = THREAD_POOL_QUEUE;
+	attr->max_threads = 1;
+	attr->ring_capacity = SPSC_QUEUE_DEFAULT_CAPACITY;
+	attr->grow_depth = THREAD_POOL_GROW_DEPTH;
+	attr->grow_wait_us = THREAD_POOL_GROW_WAIT_US;
+	attr->idle_timeout_ms = THREAD_POOL_IDLE_TIMEOUT_MS;
 }
 
 thread_pool_t*
 thread_pool_new(exec_t func, void *data, int max_threads)
+{
+	thread_pool_attr_t attr;
+
+	thread_pool_attr_init(&attr);
+	attr.max_threads = max_threads;
+
+	return thread_pool_new_with_attr(func, data, &attr);
+}
+
+thread_pool_t*
+thread_pool_new_with_attr(exec_t func, void *data, const thread_pool_attr_t *attr)
 {
 	thread_pool_t *tp;
 
+	assert(attr);
+
 	tp = (thread_pool_t *)calloc(1, sizeof(thread_pool_t));
 	if (tp != NULL)
 	{
 		tp->exec = func;
+		tp->done = attr->done;
 		tp->usr_data = data;
-		tp->queue = async_queue_new();
+		tp->mode = attr->mode;
+		tp->overflow = attr->overflow;
+		tp->key = attr->key;
+		tp->resolve = attr->resolve;
+		tp->refs = 1;
 		tp->num_threads = 0;
-		tp->max_threads = max_threads ? max_threads : 1;
+		tp->max_threads = attr->max_threads ? attr->max_threads : 1;
+
+		if (tp->mode == THREAD_POOL_STEAL)
+		{
+			// a shared pool's workers belong to every pool using it
+			if (attr->steal_pool && attr->cpus && attr->cpu_count)
+			{
+				show_err2(EINVAL, "thread_pool_new: cpus with a shared steal_pool");
+				free(tp);
+				return NULL;
+			}
+
+			tp->steal = attr->steal_pool;
+			if (tp->steal == NULL)
+			{
+				tp->steal = ws_pool_new_with_cpus(tp->max_threads,
+					attr->cpus, attr->cpu_count);
+				tp->steal_owned = 1;
+			}
+
+			if (tp->steal == NULL)
+			{
+				free(tp);
+				return NULL;
+			}
+
+			if (attr->serial)
+			{
+				tp->strand = mpsc_queue_new(attr->ring_capacity);
+				if (tp->strand == NULL)
+				{
+					if (tp->steal_owned)
+						ws_pool_free(tp->steal);
+					free(tp);
+					return NULL;
+				}
+			}
+
+			return tp;
+		}
+
+		if (attr->cpus && attr->cpu_count)
+		{
+			tp->cpus = (int *)malloc(attr->cpu_count * sizeof(int));
+			if (tp->cpus == NULL)
+			{
+				free(tp);
+				return NULL;
+			}
+			memcpy(tp->cpus, attr->cpus, attr->cpu_count * sizeof(int));
+			tp->cpu_count = attr->cpu_count;
+		}
+
+		if (tp->cpu_count)
+			thread_pool_place(tp, attr);
+		else
+			thread_pool_queue_new(tp, attr);
+
+		if (tp->mode == THREAD_POOL_RING)
+			pthread_mutex_init(&tp->ring_lock, NULL);
+		else
+		{
+			pthread_mutex_init(&tp->resize_lock, NULL);
+
+			if (attr->min_threads > 0 && (tp->max_threads == -1
+				|| attr->min_threads < tp->max_threads))
+			{
+				tp->elastic = 1;
+				tp->min_threads = attr->min_threads;
+				tp->grow_depth = attr->grow_depth;
+				tp->grow_wait_ns = (uint64_t)attr->grow_wait_us * 1000;
+				tp->idle_timeout_ms = attr->idle_timeout_ms
+					? attr->idle_timeout_ms : THREAD_POOL_IDLE_TIMEOUT_MS;
+			}
+		}
+
+		if (tp->queue == NULL && tp->lanes == NULL && tp->ring == NULL)
+		{
+			thread_pool_destroy(tp);
+			return NULL;
+		}
 		
 		thread_pool_start_threads(tp);		
 	}
@@ -91,27 +597,126 @@ thread_pool_new(exec_t func, void *data, int max_threads)
 	return tp;
 }
 
-void
+int
 thread_pool_push(thread_pool_t *tp, void *data)
 {
-	task_data_t *td;
+	return thread_pool_push_lane(tp, data, 0);
+}
+
+/*
+ * "lane" only matters to a THREAD_POOL_QUEUE pool created with lanes, a
+ * lane above the last one is the last one
+ */
+int
+thread_pool_push_lane(thread_pool_t *tp, void *data, uint32_t lane)
+{
+	task_data_t *td, *dropped;
 	
 	assert(tp != NULL && data != NULL);
 
+	if (tp->mode == THREAD_POOL_RING)
+	{
+		// no allocation, the ring owns a slot for every pending data
+		if (tp->overflow == QUEUE_OVERFLOW_BLOCK)
+			spsc_queue_push(tp->ring, data);
+		else if (spsc_queue_try_push(tp->ring, data) != 0)
+		{
+			atomic_inc(&tp->dropped);
+			if (tp->done)
+				(*tp->done)(data);
+			return 1;
+		}
+		return 0;
+	}
+
+	if (tp->mode == THREAD_POOL_STEAL)
+	{
+		if (tp->strand)
+			thread_pool_strand_push(tp, data);
+		else if (tp->resolve)
+		{
+			atomic_inc(&tp->refs);
+			ws_pool_submit(tp->steal, thread_pool_run_resolved, NULL, data, tp);
+		}
+		else
+			ws_pool_submit(tp->steal, tp->exec, tp->done, data, tp->usr_data);
+		return 0;
+	}
+
 	td       = (task_data_t *)calloc(1, sizeof(task_data_t));
 	td->id    = task_run;
 	td->param = data;
+	if (tp->key && tp->overflow == QUEUE_OVERFLOW_COALESCE)
+		td->key = (*tp->key)(data);
+
+	if (tp->elastic)
+	{
+		if (tp->grow_wait_ns)
+			td->pushed_ns = thread_pool_now_ns();
+
+		// queue backing up with every thread busy
+		if (atomic_inc(&tp->pending) > (int)tp->grow_depth
+			&& atomic_get(&tp->idle_threads) == 0)
+			thread_pool_grow(tp);
+	}
 	
-	async_queue_push(tp->queue, (void *)td);	
+	if (tp->lanes)
+		dropped = (task_data_t *)prio_queue_push_overflow(tp->lanes, (void *)td,
+			lane, tp->overflow, thread_pool_task_match);
+	else
+		dropped = (task_data_t *)async_queue_push_overflow(tp->queue, (void *)td,
+			tp->overflow, thread_pool_task_match);
+
+	return dropped ? thread_pool_drop(tp, dropped) : 0;
 }
 
 void
 thread_pool_free(thread_pool_t *tp)
 {
 	task_data_t *task;
+	ws_pool_t *steal;
 	int i, length;
 
+	if (tp->mode == THREAD_POOL_RING)
+	{
+		// workers exit once the ring is drained
+		spsc_queue_close(tp->ring);
+		return;
+	}
+
+	if (tp->mode == THREAD_POOL_STEAL)
+	{
+		if (tp->strand)
+		{
+			// the strand frees us after running what is queued, and our
+			// own pool lives until that run is done
+			steal = tp->steal_owned ? tp->steal : NULL;
+			thread_pool_strand_push(tp, tp);
+			if (steal)
+				ws_pool_free(steal);
+			return;
+		}
+
+		// queued tasks carry their own function and data, only resolved
+		// ones still need us
+		if (tp->steal_owned)
+			ws_pool_free(tp->steal);
+		thread_pool_unref(tp);
+		return;
+	}
+
+	// no thread comes or goes from now on, one stop task each
+	pthread_mutex_lock(&tp->resize_lock);
+	tp->stopping = 1;
 	length = atomic_get(&tp->num_threads);
+	pthread_mutex_unlock(&tp->resize_lock);
+
+	// a stop task could overtake data of a higher lane, close instead
+	if (tp->lanes)
+	{
+		prio_queue_close(tp->lanes);
+		return;
+	}
 
 	for (i = 0; i < length; i++)
 	{
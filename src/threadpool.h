@@ -3,12 +3,18 @@
 
 #include "atomic.h"
 #include "asyncqueue.h"
+#include "prioqueue.h"
+#include "spscqueue.h"
+#include "wspool.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 typedef void (*exec_t) (void *, void *usr_data);
+typedef void (*done_t) (void *);
+typedef uint32_t (*thread_pool_key_t) (void *);
+typedef void *(*thread_pool_resolve_t) (void *);
 
 typedef enum _task_id
 {
@@ -20,22 +26,172 @@ typedef struct _task_data
 {
 	task_id_t	id;
 	void *		param;
+	uint64_t	pushed_ns;	// elastic pools with "grow_wait_us" only
+	uint32_t	key;		// QUEUE_OVERFLOW_COALESCE only
 } task_data_t;
 
+#define THREAD_POOL_GROW_DEPTH			4		// queued data per busy pool
+#define THREAD_POOL_GROW_WAIT_US		1000
+#define THREAD_POOL_IDLE_TIMEOUT_MS		10000
+
+/*
+ * how pushed data reaches the worker threads
+ */
+typedef enum _thread_pool_mode
+{
+	THREAD_POOL_QUEUE = 0,	// async_queue_t, one task_data_t allocated per push
+	THREAD_POOL_RING,		// fixed-capacity spsc_queue_t, single pushing thread
+	THREAD_POOL_STEAL		// ws_pool_t, per-worker deques and work stealing
+} thread_pool_mode_t;
+
+typedef struct _thread_pool_attr
+{
+	thread_pool_mode_t	mode;
+	int					max_threads;
+	uint32_t			ring_capacity;	// THREAD_POOL_RING, serial THREAD_POOL_STEAL
+	done_t				done;			// called with the data after exec, may be NULL
+
+	/*
+	 * THREAD_POOL_STEAL only: run on this pool, shared with other thread
+	 * pools and never freed by us. NULL creates a private one with
+	 * "max_threads" workers, thread_pool_executor() is the process-wide one.
+	 * With "serial" set the data pushed run one at a time in push order,
+	 * as a strand on the pool's workers instead of a thread of our own
+	 */
+	ws_pool_t *			steal_pool;
+	int					serial;
+
+	/*
+	 * THREAD_POOL_QUEUE only, elastic when "min_threads" is set: start
+	 * with "min_threads", add one thread whenever no thread is idle and
+	 * more than "grow_depth" data are queued or a data waited longer than
+	 * "grow_wait_us" (0 disables), never above "max_threads" (-1 no
+	 * limit). A thread idle for "idle_timeout_ms" exits while there are
+	 * more than "min_threads". 0, the default, keeps "max_threads" threads
+	 */
+	int					min_threads;
+	uint32_t			grow_depth;
+	uint32_t			grow_wait_us;
+	uint32_t			idle_timeout_ms;
+
+	/*
+	 * workers only run on these CPUs, e.g. the socket of the bus
+	 * dispatcher feeding them. Copied, NULL or 0 CPUs leaves them unpinned.
+	 * THREAD_POOL_QUEUE and THREAD_POOL_RING: every worker may use every
+	 * CPU, and the queue or ring is allocated by a thread pinned the same
+	 * way, so it lands on their node. Private THREAD_POOL_STEAL pool:
+	 * worker i runs on cpus[i % cpu_count]. A shared "steal_pool", the
+	 * executor included, can't be pinned for one pool: creation fails
+	 */
+	const int *			cpus;
+	uint32_t			cpu_count;
+
+	/*
+	 * THREAD_POOL_QUEUE only: more than 1 queues data in that many
+	 * priority lanes (at most PRIO_QUEUE_MAX_LANES), see
+	 * thread_pool_push_lane(). Other modes stay FIFO
+	 */
+	uint32_t			lanes;
+
+	/*
+	 * THREAD_POOL_QUEUE: at most "capacity" data wait, 0 is unbounded.
+	 * THREAD_POOL_RING is bounded by "ring_capacity". A push into a full
+	 * pool follows "overflow", data dropped are passed to "done" without
+	 * running. COALESCE replaces the newest waiting data with the same
+	 * "key" (NULL: all data share one key). The ring only blocks or drops
+	 * the newest, THREAD_POOL_STEAL isn't bounded
+	 */
+	uint32_t			capacity;
+	queue_overflow_t	overflow;
+	thread_pool_key_t	key;
+
+	/*
+	 * called by the worker with each data before "exec", returns the data
+	 * to run and to pass to "done", NULL skips it. Data dropped on
+	 * overflow reach "done" unresolved
+	 */
+	thread_pool_resolve_t	resolve;
+} thread_pool_attr_t;
+
 typedef struct _thread_pool
 {
 	exec_t 			exec;
+	done_t			done;
 	void 			*usr_data;
+	thread_pool_mode_t	mode;
 	async_queue_t	*queue;
+	prio_queue_t	*lanes;		// instead of "queue" with priority lanes
+	queue_overflow_t	overflow;
+	thread_pool_key_t	key;
+	thread_pool_resolve_t	resolve;
+	atomic_t		dropped;	// data dropped by the overflow policy
 	atomic_t		num_threads;
 	atomic_t		max_threads;
+
+	/*
+	 * elastic THREAD_POOL_QUEUE: "resize_lock" orders growing, retiring
+	 * and stopping so the count of stop tasks always matches the threads
+	 */
+	int				elastic;
+	atomic_t		min_threads;
+	atomic_t		idle_threads;
+	atomic_t		pending;
+	uint32_t		grow_depth;
+	uint64_t		grow_wait_ns;
+	uint32_t		idle_timeout_ms;
+	int				stopping;
+	pthread_mutex_t	resize_lock;
+
+	int				*cpus;
+	uint32_t		cpu_count;
+
+	/*
+	 * THREAD_POOL_RING: data pointers are stored in the ring directly, and
+	 * workers take ring_lock in turn to consume it when there are several
+	 */
+	spsc_queue_t	*ring;
+	pthread_mutex_t	ring_lock;
+
+	/*
+	 * THREAD_POOL_STEAL: every push becomes a task of "steal", no thread
+	 * of our own
+	 */
+	ws_pool_t		*steal;
+	int				steal_owned;
+	atomic_t		refs;		// with "resolve": 1 + tasks not run yet
+
+	/*
+	 * serial THREAD_POOL_STEAL: data wait in "strand", "strand_pending"
+	 * counts them and whoever raises it from 0 schedules the strand
+	 */
+	mpsc_queue_t	*strand;
+	volatile int32_t strand_pending;
 } thread_pool_t;
 
 
+void thread_pool_attr_init(thread_pool_attr_t *attr);
 thread_pool_t* thread_pool_new(exec_t func, void *data, int max_threads);
-void thread_pool_push(thread_pool_t *tp, void *data);
+thread_pool_t* thread_pool_new_with_attr(exec_t func, void *data, const thread_pool_attr_t *attr);
+/*
+ * returns 1 when the pool was full and a data, "data" or an older one,
+ * was dropped, 0 otherwise
+ */
+int thread_pool_push(thread_pool_t *tp, void *data);
+int thread_pool_push_lane(thread_pool_t *tp, void *data, uint32_t lane);	// higher lane first
 void thread_pool_free(thread_pool_t *tp);
 
+/*
+ * restrict "thread" to "count" CPUs, 0 or an errno value. ENOSYS where
+ * affinity isn't supported
+ */
+int thread_pool_set_affinity(pthread_t thread, const int *cpus, uint32_t count);
+
+/*
+ * work-stealing pool shared by the whole process, one worker per online CPU,
+ * created on first use and never freed
+ */
+ws_pool_t *thread_pool_executor(void);
+
 
 #ifdef __cplusplus
 }
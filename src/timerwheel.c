@@ -0,0 +1,162 @@
+/*
+ * timerwheel.c
+ * Copyright by Zhang Shiyong, 2014. shiyong.zhang.cn@outlook.com
+ */
+#include <assert.h>
+#include <string.h>
+#include "timerwheel.h"
+
+#define TIMER_WHEEL_MASK		(TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_RANGE		(1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+void
+timer_wheel_init(timer_wheel_t *wheel, uint64_t now)
+{
+	assert(wheel);
+
+	memset(wheel, 0, sizeof(timer_wheel_t));
+	wheel->current = now;
+}
+
+static void
+timer_wheel_link(timer_wheel_t *wheel, timer_node_t *node)
+{
+	uint64_t delta, at;
+	uint32_t level, slot;
+
+	at = node->expires;
+	if (at < wheel->current)
+		at = wheel->current;
+
+	// too far, park it at the end of the top level and cascade it again
+	delta = at - wheel->current;
+	if (delta >= TIMER_WHEEL_RANGE)
+	{
+		at = wheel->current + TIMER_WHEEL_RANGE - 1;
+		delta = TIMER_WHEEL_RANGE - 1;
+	}
+
+	for (level = 0; level < TIMER_WHEEL_LEVELS - 1; level++)
+	{
+		if (delta < (1ULL << (TIMER_WHEEL_BITS * (level + 1))))
+			break;
+	}
+
+	slot = (at >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+	node->bucket = level * TIMER_WHEEL_SLOTS + slot;
+
+	node->next = wheel->slots[node->bucket];
+	if (node->next)
+		node->next->pprev = &node->next;
+	node->pprev = &wheel->slots[node->bucket];
+	wheel->slots[node->bucket] = node;
+	wheel->busy[level] |= 1ULL << slot;
+}
+
+static void
+timer_wheel_unlink(timer_wheel_t *wheel, timer_node_t *node)
+{
+	*node->pprev = node->next;
+	if (node->next)
+		node->next->pprev = node->pprev;
+	node->pprev = NULL;
+
+	if (wheel->slots[node->bucket] == NULL)
+		wheel->busy[node->bucket / TIMER_WHEEL_SLOTS] &=
+			~(1ULL << (node->bucket & TIMER_WHEEL_MASK));
+}
+
+void
+timer_wheel_add(timer_wheel_t *wheel, timer_node_t *node, uint64_t expires)
+{
+	assert(wheel && node && node->pprev == NULL);
+
+	node->expires = expires;
+	timer_wheel_link(wheel, node);
+	wheel->count++;
+}
+
+void
+timer_wheel_del(timer_wheel_t *wheel, timer_node_t *node)
+{
+	assert(wheel && node);
+
+	if (node->pprev == NULL)
+		return;
+
+	timer_wheel_unlink(wheel, node);
+	wheel->count--;
+}
+
+/*
+ * "current" entered a new level 0 round, bring down the timers of the
+ * matching slot of each level whose own round starts too
+ */
+static void
+timer_wheel_cascade(timer_wheel_t *wheel)
+{
+	timer_node_t *node, *list;
+	uint32_t level, slot;
+
+	for (level = 1; level < TIMER_WHEEL_LEVELS; level++)
+	{
+		slot = (wheel->current >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+		list = wheel->slots[level * TIMER_WHEEL_SLOTS + slot];
+		wheel->slots[level * TIMER_WHEEL_SLOTS + slot] = NULL;
+		wheel->busy[level] &= ~(1ULL << slot);
+
+		while ((node = list) != NULL)
+		{
+			list = node->next;
+			node->pprev = NULL;
+			timer_wheel_link(wheel, node);
+		}
+
+		if (slot != 0)
+			break;
+	}
+}
+
+timer_node_t *
+timer_wheel_poll(timer_wheel_t *wheel, uint64_t now)
+{
+	timer_node_t *node;
+
+	assert(wheel);
+
+	while (wheel->current <= now)
+	{
+		// level 0 slots hold the timers of exactly one tick
+		node = wheel->slots[wheel->current & TIMER_WHEEL_MASK];
+		if (node)
+		{
+			timer_wheel_unlink(wheel, node);
+			wheel->count--;
+			return node;
+		}
+
+		wheel->current++;
+		if ((wheel->current & TIMER_WHEEL_MASK) == 0)
+			timer_wheel_cascade(wheel);
+	}
+
+	return NULL;
+}
+
+uint64_t
+timer_wheel_next(timer_wheel_t *wheel)
+{
+	uint64_t bits;
+
+	assert(wheel);
+
+	if (wheel->count == 0)
+		return TIMER_WHEEL_NEVER;
+
+	// rest of this round, otherwise the next cascade
+	bits = wheel->busy[0] >> (wheel->current & TIMER_WHEEL_MASK);
+	if (bits)
+		return wheel->current + __builtin_ctzll(bits);
+
+	return (wheel->current | TIMER_WHEEL_MASK) + 1;
+}
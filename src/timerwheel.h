@@ -0,0 +1,74 @@
+/*
+ * timerwheel.h
+ * Copyright by Zhang Shiyong, 2014. shiyong.zhang.cn@outlook.com
+ */
+
+#ifndef _TIMER_WHEEL_H_
+#define _TIMER_WHEEL_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TIMER_WHEEL_BITS		6
+#define TIMER_WHEEL_SLOTS		(1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS		4		// 2^24 ticks before a timer is re-cascaded
+
+#define TIMER_WHEEL_NEVER		UINT64_MAX
+
+/*
+ * Hierarchical timing wheel counting abstract ticks. Level 0 has one slot
+ * per tick for the next 64 ticks, each level above covers 64 times more
+ * with one slot per 64^level ticks, and its timers cascade down a level
+ * when the wheel gets to their slot. Adding and deleting are O(1), a
+ * bitmap per level finds the next busy slot.
+ *
+ * The wheel doesn't lock, its owner serializes every call.
+ */
+typedef struct _timer_node timer_node_t;
+struct _timer_node
+{
+	timer_node_t *	next;
+	timer_node_t **	pprev;		// NULL while not in the wheel
+	uint64_t		expires;	// absolute tick
+	uint32_t		bucket;		// level * TIMER_WHEEL_SLOTS + slot
+};
+
+typedef struct _timer_wheel
+{
+	uint64_t		current;	// next tick to expire
+	uint32_t		count;
+	uint64_t		busy[TIMER_WHEEL_LEVELS];
+	timer_node_t *	slots[TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS];
+} timer_wheel_t;
+
+void timer_wheel_init(timer_wheel_t *wheel, uint64_t now);
+
+/*
+ * "expires" in the past expires with the next poll
+ */
+void timer_wheel_add(timer_wheel_t *wheel, timer_node_t *node, uint64_t expires);
+void timer_wheel_del(timer_wheel_t *wheel, timer_node_t *node);
+
+/*
+ * one node expired at or before "now", removed from the wheel, NULL once
+ * the wheel has caught up with "now"
+ */
+timer_node_t *timer_wheel_poll(timer_wheel_t *wheel, uint64_t now);
+
+/*
+ * tick at which the next poll may return a node, TIMER_WHEEL_NEVER if the
+ * wheel is empty. May be earlier than any expiry when timers have to
+ * cascade first
+ */
+uint64_t timer_wheel_next(timer_wheel_t *wheel);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _TIMER_WHEEL_H_ */
+
+// ~ end
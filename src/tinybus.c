@@ -5,116 +5,649 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include "common.h"
+#include "epoch.h"
+#include "objpool.h"
 #include "tinybus.h"
 #include "slot.h"
 #include "trace.h"
 
+/*
+ * goes through the normal lane, behind everything published before it.
+ * Higher lanes may still hold messages when it is fetched, the dispatcher
+ * drains them all before returning
+ */
+static tiny_msg_t tiny_bus_exit_msg = {
+	.msg_id		= TINY_BUS_MSG_EXIT,
+	.priority	= TINY_MSG_PRIO_NORMAL,
+};
+
+/*
+ * message, its private part and a small payload come from one pool object,
+ * the pool lives as long as the process so messages may outlive the bus
+ * they went through
+ */
+typedef struct _tiny_msg_block
+{
+	tiny_msg_t		msg;
+	tiny_msg_priv_t	priv;
+	char			payload[TINY_MSG_INLINE_MAX] __attribute__((aligned(8)));
+} __attribute__((aligned(CACHE_LINE_SIZE))) tiny_msg_block_t;
+
+// fails to compile when a new field pushes the block onto a third line
+typedef char tiny_msg_block_size_check[
+	(sizeof(void *) != 8 || sizeof(tiny_msg_block_t) == 2 * CACHE_LINE_SIZE) ? 1 : -1];
+
+static obj_pool_t *tiny_msg_pool;
+static pthread_once_t tiny_msg_pool_once = PTHREAD_ONCE_INIT;
+
 static void
-bus_post_message(void *node, void *data)
+tiny_msg_pool_init(void)
 {
-	slot_t *slot;
-	tiny_msg_t *msg;
-	
-	slot = (slot_t *)node;
-	msg = (tiny_msg_t *)data;
-	
-	slot_write(slot, msg);
+	tiny_msg_pool = obj_pool_new(sizeof(tiny_msg_block_t));
 }
 
-static void
+static inline int
+tiny_msg_pooled(tiny_msg_t *msg)
+{
+	return msg->msg_priv && (msg->msg_priv->flags & TINY_MSG_POOLED);
+}
+
+static inline tiny_msg_block_t *
+tiny_msg_block_alloc(message_id_t id)
+{
+	tiny_msg_block_t *block;
+
+	pthread_once(&tiny_msg_pool_once, tiny_msg_pool_init);
+	if (tiny_msg_pool == NULL)
+		return NULL;
+
+	block = (tiny_msg_block_t *)obj_pool_alloc(tiny_msg_pool);
+	if (block == NULL)
+	{
+		show_err2(ENOMEM, "obj_pool_alloc");
+		return NULL;
+	}
+
+	memset(&block->msg, 0, sizeof(tiny_msg_t));
+	block->msg.msg_id = id;
+	block->msg.msg_priv = &block->priv;
+	block->priv.ref_count = 1;
+
+	return block;
+}
+
+tiny_msg_t *
+tiny_msg_alloc(message_id_t id, void *data, size_t size, tiny_msg_free_t free_data)
+{
+	tiny_msg_block_t *block;
+
+	block = tiny_msg_block_alloc(id);
+	if (block == NULL)
+		return NULL;
+
+	block->priv.data = data;
+	block->priv.size = size;
+	block->priv.free_data = free_data;
+	block->priv.flags = TINY_MSG_POOLED;
+
+	return &block->msg;
+}
+
+tiny_msg_t *
+tiny_msg_alloc_inline(message_id_t id, const void *data, size_t size)
+{
+	tiny_msg_block_t *block;
+
+	if (size > TINY_MSG_INLINE_MAX)
+		return NULL;
+
+	block = tiny_msg_block_alloc(id);
+	if (block == NULL)
+		return NULL;
+
+	if (data)
+		memcpy(block->payload, data, size);
+
+	block->priv.data = block->payload;
+	block->priv.size = size;
+	block->priv.free_data = NULL;
+	block->priv.flags = TINY_MSG_POOLED | TINY_MSG_INLINE;
+
+	return &block->msg;
+}
+
+void
+tiny_msg_release(tiny_msg_t *msg)
+{
+	tiny_msg_priv_t *priv;
+
+	assert(msg);
+
+	if (!tiny_msg_pooled(msg))
+		return;
+
+	priv = msg->msg_priv;
+	if (!atomic_dec_and_test_zero(&priv->ref_count))
+		return;
+
+	if (priv->free_data)
+		(*priv->free_data)(priv->data);
+
+	obj_pool_free(tiny_msg_pool, msg);
+}
+
+/*
+ * returns the subscribers that dropped a message
+ */
+static size_t
 tiny_bus_deliver(tiny_bus_t *self, tiny_msg_t *msg)
 {
-	int id;
-	assert(self->mutex);
-	
-	id = msg->msg_id;
-	if (self->slots[id] != NULL)
+	tiny_bus_subs_t *subs;
+	uint32_t index;
+	size_t dropped = 0;
+
+	// no lock, subscription changes publish a new array instead
+	epoch_enter();
+	subs = (tiny_bus_subs_t *)id_map_get(&self->slots, msg->msg_id);
+
+	// one reference per subscriber, set before any slot can release one
+	if (tiny_msg_pooled(msg))
 	{
-		pthread_mutex_lock(self->mutex);
-		list_foreach(self->slots[id], bus_post_message, msg);
-		pthread_mutex_unlock(self->mutex);		
+		if (subs == NULL || subs->count == 0)
+		{
+			epoch_exit();
+			tiny_msg_release(msg);
+			return 0;
+		}
+		atomic_set(&msg->msg_priv->ref_count, subs->count);
 	}
+
+	if (subs != NULL)
+	{
+		for (index = 0; index < subs->count; index++)
+		{
+			if (index + 1 < subs->count)
+				__builtin_prefetch(subs->subs[index + 1].slot);
+
+			if (subs->subs[index].slot->flags & SLOT_INLINE)
+				slot_call(subs->subs[index].slot, subs->subs[index].handler, msg);
+			else if (slot_write(subs->subs[index].slot, msg) == TINY_BUS_DROPPED)
+				dropped++;
+		}
+	}
+	epoch_exit();
+
+	return dropped;
+}
+
+static inline uint32_t
+tiny_bus_rings_ready(tiny_bus_dispatcher_t *self)
+{
+	uint32_t lane, ready = 0;
+
+	for (lane = 0; lane < self->bus->lanes; lane++)
+	{
+		if (mpsc_queue_length(self->msg_rings[lane]))
+			ready |= 1u << lane;
+	}
+
+	return ready;
+}
+
+/*
+ * take up to "max" messages from the lane rings, picking the lane again
+ * for each one. Doesn't wait
+ */
+static size_t
+tiny_bus_fetch_rings(tiny_bus_dispatcher_t *self, tiny_msg_t **msgs, size_t max)
+{
+	uint32_t ready, lane;
+	size_t count;
+
+	for (count = 0; count < max; count++)
+	{
+		ready = tiny_bus_rings_ready(self);
+		if (ready == 0)
+			break;
+
+		lane = prio_queue_pick(self->skipped, ready);
+		msgs[count] = (tiny_msg_t *)mpsc_queue_try_pop(self->msg_rings[lane]);
+		if (msgs[count] == NULL)
+			break;	// claimed but not stored yet
+	}
+
+	return count;
+}
+
+/*
+ * wait for messages, then take everything available up to "max" with one
+ * synchronization on the ingress
+ */
+static inline size_t
+tiny_bus_fetch(tiny_bus_dispatcher_t *self, tiny_msg_t **msgs, size_t max)
+{
+	uint32_t key;
+	size_t count;
+
+	if (self->msg_ring)
+		return mpsc_queue_pop_batch(self->msg_ring, (void **)msgs, max);
+
+	if (self->msg_queue)
+		return async_queue_pop_batch(self->msg_queue, (void **)msgs, max);
+
+	if (self->msg_lanes)
+		return prio_queue_pop_batch(self->msg_lanes, (void **)msgs, max);
+
+	for (;;)
+	{
+		count = tiny_bus_fetch_rings(self, msgs, max);
+		if (count)
+			return count;
+
+		key = event_count_prepare_wait(&self->doorbell);
+		if (tiny_bus_rings_ready(self))
+			event_count_cancel_wait(&self->doorbell);
+		else
+			event_count_wait(&self->doorbell, key);
+	}
+}
+
+/*
+ * with lanes the exit message may overtake messages of higher lanes,
+ * deliver them before leaving. Nothing is published any more
+ */
+static void
+tiny_bus_drain(tiny_bus_dispatcher_t *self)
+{
+	tiny_msg_t *msgs[TINY_BUS_FETCH_MAX];
+	size_t index, count;
+	tiny_msg_t *msg;
+
+	if (self->msg_lanes)
+	{
+		while ((msg = (tiny_msg_t *)prio_queue_try_pop(self->msg_lanes)) != NULL)
+			tiny_bus_deliver(self->bus, msg);
+	}
+	else if (self->msg_rings[0])
+	{
+		// a producer may still be storing into a claimed slot
+		while (tiny_bus_rings_ready(self))
+		{
+			count = tiny_bus_fetch_rings(self, msgs, TINY_BUS_FETCH_MAX);
+			for (index = 0; index < count; index++)
+				tiny_bus_deliver(self->bus, msgs[index]);
+		}
+	}
+}
+
+static int
+tiny_bus_ingress_new(tiny_bus_t *bus, tiny_bus_dispatcher_t *dispatcher)
+{
+	uint32_t lane;
+
+	if (bus->lanes > 1 && bus->ingress == TINY_BUS_INGRESS_RING)
+	{
+		event_count_init_exclusive(&dispatcher->doorbell);
+		for (lane = 0; lane < bus->lanes; lane++)
+		{
+			dispatcher->msg_rings[lane] = mpsc_queue_new(bus->ingress_capacity);
+			if (dispatcher->msg_rings[lane] == NULL)
+			{
+				show_err2(errno, "mpsc_queue_new");
+				return -1;
+			}
+		}
+	}
+	else if (bus->lanes > 1)
+	{
+		dispatcher->msg_lanes = prio_queue_new(bus->lanes, bus->queue_capacity);
+		if (dispatcher->msg_lanes == NULL)
+		{
+			show_err2(errno, "prio_queue_new");
+			return -1;
+		}
+	}
+	else if (bus->ingress == TINY_BUS_INGRESS_RING)
+	{
+		dispatcher->msg_ring = mpsc_queue_new(bus->ingress_capacity);
+		if (dispatcher->msg_ring == NULL)
+		{
+			show_err2(errno, "mpsc_queue_new");
+			return -1;
+		}
+	}
+	else
+	{
+		dispatcher->msg_queue = async_queue_new_bounded(bus->queue_capacity);
+		if (dispatcher->msg_queue == NULL)
+		{
+			show_err2(errno, "async_queue_new");	
+			return -1;
+		}
+	}
+
+	return 0;
 }
 
 static void *
 tiny_bus_thread_worker(void *context)
 {
+	tiny_msg_t *msgs[TINY_BUS_FETCH_MAX];
 	tiny_msg_t *msg;
-	tiny_bus_t *self;
+	tiny_bus_dispatcher_t *self;
+	size_t index, count;
+	int result;
+
+	self = (tiny_bus_dispatcher_t *)context;	
+	if (self->bus->dispatcher_cpu_count)
+	{
+		result = thread_pool_set_affinity(pthread_self(),
+			self->bus->dispatcher_cpus, self->bus->dispatcher_cpu_count);
+		show_err2(result, "thread_pool_set_affinity");
+
+		// first touch from here, the ingress lands on our node
+		result = tiny_bus_ingress_new(self->bus, self);
+		atomic_store_release(&self->ready, result == 0 ? 1 : -1);
+		if (result != 0)
+			return NULL;
+	}
 
-	self = (tiny_bus_t *)context;	
 	for (;;)
 	{
-		msg = (tiny_msg_t *)async_queue_pop(self->msg_queue);
-		if (msg->msg_id == TINY_BUS_MSG_EXIT)
+		count = tiny_bus_fetch(self, msgs, TINY_BUS_FETCH_MAX);
+		for (index = 0; index < count; index++)
 		{
-		    TRACE_WARNING("file %s: line %d (%s): bus exit\r\n", 
-                __FILE__, __LINE__, __FUNCTION__);
-			break;
-		}
+			msg = msgs[index];
+			if (msg->msg_id == TINY_BUS_MSG_EXIT)
+			{
+				while (++index < count)
+					tiny_bus_deliver(self->bus, msgs[index]);
+				tiny_bus_drain(self);
+
+			    TRACE_WARNING("file %s: line %d (%s): bus exit\r\n", 
+					__FILE__, __LINE__, __FUNCTION__);
+				return NULL;
+			}
 
-		atomic_dec(&msg->msg_priv->ref_count);		
-		tiny_bus_deliver(self, msg);
+			tiny_bus_deliver(self->bus, msg);
+		}
 	}
 	
 	return NULL;
 }
 
+/*
+ * dispatcher of a partition key, fibonacci hashing then scaling to the
+ * dispatcher count so any count is allowed
+ */
+static inline tiny_bus_dispatcher_t *
+tiny_bus_route(tiny_bus_t *bus, uint32_t key)
+{
+	uint32_t hash;
+
+	if (bus->dispatcher_count == 1)
+		return &bus->dispatchers[0];
+
+	hash = key * 0x9E3779B1u;
+	return &bus->dispatchers[((uint64_t)hash * bus->dispatcher_count) >> 32];
+}
+
+/*
+ * 0 when "b" may replace the waiting "a", see list_find_custom()
+ */
+static int
+tiny_bus_msg_match(void *a, void *b)
+{
+	return ((tiny_msg_t *)a)->msg_id != ((tiny_msg_t *)b)->msg_id;
+}
+
+static int
+tiny_bus_drop(tiny_bus_t *bus, tiny_msg_t *msg)
+{
+	atomic_inc(&bus->dropped);
+	tiny_msg_release(msg);
+
+	return 1;
+}
+
+static inline int
+tiny_bus_push_ring(tiny_bus_dispatcher_t *dispatcher, mpsc_queue_t *ring,
+	tiny_msg_t *msg, queue_overflow_t policy)
+{
+	if (policy == QUEUE_OVERFLOW_BLOCK)
+		mpsc_queue_push(ring, msg);
+	else if (mpsc_queue_try_push(ring, msg) != 0)
+		return tiny_bus_drop(dispatcher->bus, msg);
+
+	return 0;
+}
+
+/*
+ * returns 1 if the full ingress dropped a message, "msg" or an older one
+ */
+static inline int
+tiny_bus_push(tiny_bus_dispatcher_t *dispatcher, tiny_msg_t *msg, queue_overflow_t policy)
+{
+	tiny_msg_t *dropped;
+	uint32_t lane;
+
+	if (dispatcher->msg_ring)
+		return tiny_bus_push_ring(dispatcher, dispatcher->msg_ring, msg, policy);
+
+	if (dispatcher->msg_queue)
+		dropped = (tiny_msg_t *)async_queue_push_overflow(dispatcher->msg_queue,
+			msg, policy, tiny_bus_msg_match);
+	else if (dispatcher->msg_lanes)
+		dropped = (tiny_msg_t *)prio_queue_push_overflow(dispatcher->msg_lanes,
+			msg, msg->priority, policy, tiny_bus_msg_match);
+	else
+	{
+		lane = dispatcher->bus->lanes - 1;
+		if (msg->priority < lane)
+			lane = msg->priority;
+
+		if (tiny_bus_push_ring(dispatcher, dispatcher->msg_rings[lane], msg, policy))
+			return 1;
+		event_count_notify(&dispatcher->doorbell, 0);
+		return 0;
+	}
+
+	return dropped ? tiny_bus_drop(dispatcher->bus, dropped) : 0;
+}
+
+static inline size_t
+tiny_bus_push_batch(tiny_bus_dispatcher_t *dispatcher, tiny_msg_t **msgs, size_t count)
+{
+	queue_overflow_t policy = dispatcher->bus->ingress_overflow;
+	size_t index, dropped = 0;
+
+	if (dispatcher->msg_ring && policy == QUEUE_OVERFLOW_BLOCK)
+		mpsc_queue_push_batch(dispatcher->msg_ring, (void **)msgs, count);
+	else if (dispatcher->msg_queue && (policy == QUEUE_OVERFLOW_BLOCK
+		|| dispatcher->bus->queue_capacity == 0))
+		async_queue_push_batch(dispatcher->msg_queue, (void **)msgs, count);
+	else
+	{
+		// lanes or dropping: each message on its own
+		for (index = 0; index < count; index++)
+			dropped += tiny_bus_push(dispatcher, msgs[index], policy);
+	}
+
+	return dropped;
+}
+
+/*
+ * stop the dispatchers already running, messages published before are
+ * still delivered
+ */
+static void
+tiny_bus_stop(tiny_bus_t *bus)
+{
+	uint32_t index;
+
+	for (index = 0; index < bus->dispatcher_count; index++)
+	{
+		if (bus->dispatchers[index].started)
+			tiny_bus_push(&bus->dispatchers[index], &tiny_bus_exit_msg,
+				QUEUE_OVERFLOW_BLOCK);
+	}
+
+	for (index = 0; index < bus->dispatcher_count; index++)
+	{
+		if (bus->dispatchers[index].started)
+			pthread_join(bus->dispatchers[index].thread, NULL);
+		bus->dispatchers[index].started = 0;
+	}
+}
+
+static void
+tiny_bus_free_subs(uint32_t id, void *subs, void *data)
+{
+	free(subs);
+}
+
 static void
 tiny_bus_free0(tiny_bus_t *bus)
 {
-	int index;
+	uint32_t index, lane;
+
 	assert(bus);
 	
-	if (bus->msg_queue)
-		async_queue_destroy(bus->msg_queue);
+	if (bus->dispatchers)
+	{
+		for (index = 0; index < bus->dispatcher_count; index++)
+		{
+			if (bus->dispatchers[index].msg_queue)
+				async_queue_destroy(bus->dispatchers[index].msg_queue);
+
+			if (bus->dispatchers[index].msg_ring)
+				mpsc_queue_destroy(bus->dispatchers[index].msg_ring);
+
+			if (bus->dispatchers[index].msg_lanes)
+				prio_queue_destroy(bus->dispatchers[index].msg_lanes);
+
+			if (bus->dispatchers[index].msg_rings[0])
+				event_count_destroy(&bus->dispatchers[index].doorbell);
+
+			for (lane = 0; lane < PRIO_QUEUE_MAX_LANES; lane++)
+			{
+				if (bus->dispatchers[index].msg_rings[lane])
+					mpsc_queue_destroy(bus->dispatchers[index].msg_rings[lane]);
+			}
+		}
+		free(bus->dispatchers);
+	}
 	
 	if (bus->mutex)
 	{
 		pthread_mutex_destroy(bus->mutex);
 		free(bus->mutex);		
 	}
+
+	if (bus->dispatcher_cpus)
+		free(bus->dispatcher_cpus);
 		
-	for (index = 0; index < BUS_MESSAGE_MAX_ID; index++)
+	// bus threads are gone, nobody else can be reading the arrays
+	if (bus->slots.table)
 	{
-		if (bus->slots[index] != NULL)
-			list_free(bus->slots[index]);
+		id_map_foreach(&bus->slots, tiny_bus_free_subs, NULL);
+		id_map_destroy(&bus->slots);
 	}
 		
-	if (bus->thread)
-		free(bus->thread);		
-		
 	free(bus);
 }
 
+void
+tiny_bus_attr_init(tiny_bus_attr_t *attr)
+{
+	assert(attr);
+
+	memset(attr, 0, sizeof(tiny_bus_attr_t));
+	attr->ingress = TINY_BUS_INGRESS_QUEUE;
+	attr->ingress_capacity = MPSC_QUEUE_DEFAULT_CAPACITY;
+	attr->dispatchers = 1;
+}
+
 tiny_bus_t*
 tiny_bus_new(void)
+{
+	tiny_bus_attr_t attr;
+
+	tiny_bus_attr_init(&attr);
+
+	return tiny_bus_new_with_attr(&attr);
+}
+
+tiny_bus_t*
+tiny_bus_new_with_attr(const tiny_bus_attr_t *attr)
 {
 	tiny_bus_t *bus;
+	tiny_bus_dispatcher_t *dispatcher;
+	uint32_t index;
 	int result;
+
+	assert(attr);
 	
 	bus = (tiny_bus_t *)calloc(1, sizeof(tiny_bus_t));
 	if (bus == NULL)
 	{
-		tiny_bus_print_err(errno, "calloc");			
+		show_err2(errno, "calloc");			
 		return NULL;	
 	}
 	
-	bus->msg_queue = async_queue_new();
-	if (bus->msg_queue == NULL)
+	bus->ingress = attr->ingress;
+	bus->ingress_capacity = attr->ingress_capacity;
+	bus->direct = attr->direct;
+	bus->lanes = (attr->lanes < PRIO_QUEUE_MAX_LANES) ? attr->lanes : PRIO_QUEUE_MAX_LANES;
+	bus->queue_capacity = attr->queue_capacity;
+	bus->ingress_overflow = attr->ingress_overflow;
+	bus->dispatcher_count = attr->dispatchers ? attr->dispatchers : 1;
+	if (posix_memalign((void **)&bus->dispatchers, CACHE_LINE_SIZE,
+		bus->dispatcher_count * sizeof(tiny_bus_dispatcher_t)))
 	{
-		tiny_bus_print_err(errno, "async_queue_new");	
+		show_err2(ENOMEM, "posix_memalign");
+		bus->dispatchers = NULL;
 		tiny_bus_free0(bus);
 		return NULL;
 	}
+	memset(bus->dispatchers, 0, bus->dispatcher_count * sizeof(tiny_bus_dispatcher_t));
+
+	if (attr->dispatcher_cpus && attr->dispatcher_cpu_count)
+	{
+		bus->dispatcher_cpus = (int *)malloc(attr->dispatcher_cpu_count * sizeof(int));
+		if (bus->dispatcher_cpus == NULL)
+		{
+			show_err2(errno, "malloc");
+			tiny_bus_free0(bus);
+			return NULL;
+		}
+		memcpy(bus->dispatcher_cpus, attr->dispatcher_cpus,
+			attr->dispatcher_cpu_count * sizeof(int));
+		bus->dispatcher_cpu_count = attr->dispatcher_cpu_count;
+	}
+
+	for (index = 0; index < bus->dispatcher_count; index++)
+	{
+		dispatcher = &bus->dispatchers[index];
+		dispatcher->bus = bus;
+
+		// a pinned dispatcher creates its ingress itself
+		if (!bus->dispatcher_cpu_count && tiny_bus_ingress_new(bus, dispatcher) != 0)
+		{
+			tiny_bus_free0(bus);
+			return NULL;
+		}
+	}
 		
 	bus->mutex = (pthread_mutex_t *)calloc(1, sizeof(pthread_mutex_t));
 	if (bus->mutex == NULL)
 	{
-		tiny_bus_print_err(errno, "calloc");
+		show_err2(errno, "calloc");
 		tiny_bus_free0(bus);
 		return NULL;
 	}
@@ -122,27 +655,44 @@ tiny_bus_new(void)
 	result = pthread_mutex_init(bus->mutex, NULL);
 	if (result != 0)
 	{
-		tiny_bus_print_err(errno, "pthread_mutex_init");
+		show_err2(errno, "pthread_mutex_init");
 		tiny_bus_free0(bus);
 		return NULL;
 	}
 	
-	memset(bus->slots, 0, sizeof(bus->slots));
-	
-	bus->thread = (pthread_t *)calloc(1, sizeof(pthread_t));
-	if (bus->thread == NULL)
+	if (id_map_init(&bus->slots, BUS_MESSAGE_MAX_ID) != 0)
 	{
-		tiny_bus_print_err(errno, "calloc");
+		show_err2(errno, "id_map_init");
 		tiny_bus_free0(bus);
-		return NULL;		
+		return NULL;
 	}
 	
-	result = pthread_create(bus->thread, NULL, tiny_bus_thread_worker, bus);
-	if (result)
+	for (index = 0; index < bus->dispatcher_count; index++)
 	{
-		tiny_bus_print_err(result, "pthread_create");
-		tiny_bus_free0(bus);
-		return NULL;		
+		dispatcher = &bus->dispatchers[index];
+		result = pthread_create(&dispatcher->thread, NULL, tiny_bus_thread_worker, dispatcher);
+		if (result)
+		{
+			show_err2(result, "pthread_create");
+			tiny_bus_stop(bus);
+			tiny_bus_free0(bus);
+			return NULL;		
+		}
+
+		if (bus->dispatcher_cpu_count)
+		{
+			while (atomic_load_acquire(&dispatcher->ready) == 0)
+				sched_yield();
+
+			if (dispatcher->ready < 0)
+			{
+				pthread_join(dispatcher->thread, NULL);
+				tiny_bus_stop(bus);
+				tiny_bus_free0(bus);
+				return NULL;
+			}
+		}
+		dispatcher->started = 1;
 	}
 	
 	return bus;
@@ -151,27 +701,120 @@ tiny_bus_new(void)
 void
 tiny_bus_destroy(tiny_bus_t *bus)
 {
-	// .. to do
+	assert(bus);
+
+	// no timer publishes from now on
+	if (bus->timers)
+		tiny_bus_timers_free(bus->timers);
+
+	// messages published before this one are still delivered
+	tiny_bus_stop(bus);
+
+	// no handler can reply any more
+	if (bus->requests)
+		tiny_bus_requests_free(bus->requests);
+
+	tiny_bus_free0(bus);
 }
 
 tiny_bus_result_t
-tiny_bus_init_msg_ids(tiny_bus_t *bus, message_id_t* ids, size_t size)
+tiny_bus_post(tiny_bus_t *bus, tiny_msg_t *msg)
 {
-    size_t index, max_size;
+	assert(msg);
 
-    max_size = sizeof(bus->slots);
-    if (size >= max_size)
-        return TINY_BUS_FAILED;
+	return tiny_bus_post_keyed(bus, msg, msg->msg_id);
+}
+
+tiny_bus_result_t
+tiny_bus_post_keyed(tiny_bus_t *bus, tiny_msg_t *msg, uint32_t key)
+{
+	int dropped;
+
+	assert(bus);
+	assert(msg);
+
+	if (bus->direct)
+		dropped = (tiny_bus_deliver(bus, msg) != 0);
+	else
+		dropped = tiny_bus_push(tiny_bus_route(bus, key), msg, bus->ingress_overflow);
+
+	return dropped ? TINY_BUS_DROPPED : TINY_BUS_SUCCEED;
+}
+
+size_t
+tiny_bus_post_batch(tiny_bus_t *bus, tiny_msg_t **msgs, size_t count)
+{
+	tiny_bus_dispatcher_t *dispatcher;
+	size_t index, run, dropped = 0;
+
+	assert(bus);
+	assert(msgs);
+
+	if (bus->direct)
+	{
+		for (index = 0; index < count; index++)
+			dropped += (tiny_bus_deliver(bus, msgs[index]) != 0);
+		return dropped;
+	}
+
+	if (bus->dispatcher_count == 1)
+		return tiny_bus_push_batch(&bus->dispatchers[0], msgs, count);
+
+	// push each run of messages going to the same dispatcher at once
+	for (index = 0; index < count; index += run)
+	{
+		dispatcher = tiny_bus_route(bus, msgs[index]->msg_id);
+		for (run = 1; index + run < count; run++)
+		{
+			if (tiny_bus_route(bus, msgs[index + run]->msg_id) != dispatcher)
+				break;
+		}
+
+		dropped += tiny_bus_push_batch(dispatcher, &msgs[index], run);
+	}
+
+	return dropped;
+}
+
+static tiny_bus_subs_t *
+tiny_bus_subs_new(uint32_t count)
+{
+    tiny_bus_subs_t *subs;
+
+    if (posix_memalign((void **)&subs, CACHE_LINE_SIZE,
+        sizeof(tiny_bus_subs_t) + count * sizeof(tiny_bus_sub_t)))
+        return NULL;
+
+    subs->count = count;
+
+    return subs;
+}
+
+tiny_bus_result_t
+tiny_bus_init_msg_ids(tiny_bus_t *bus, message_id_t* ids, size_t size)
+{
+    tiny_bus_subs_t *subs;
+    size_t index;
 
     pthread_mutex_lock(bus->mutex);
     for (index = 0; index < size; index++)
     {
-        if (ids[index] < max_size)
-            bus->slots[ids[index]] = (list_t *)calloc(1, sizeof(list_t));
-        else
+        if (ids[index] == TINY_BUS_MSG_EXIT)
+        {
             assert(0);
-        
-        assert(bus->slots[ids[index]]);
+            continue;
+        }
+
+        if (id_map_get(&bus->slots, ids[index]) != NULL)
+            continue;   // already allocated, keep its subscribers
+
+        subs = tiny_bus_subs_new(0);
+        if (subs == NULL || id_map_set(&bus->slots, ids[index], subs) != 0)
+        {
+            free(subs);
+            pthread_mutex_unlock(bus->mutex);
+            return TINY_BUS_FAILED;
+        }
     }
     pthread_mutex_unlock(bus->mutex);
     
@@ -181,16 +824,87 @@ tiny_bus_init_msg_ids(tiny_bus_t *bus, message_id_t* ids, size_t size)
 void
 tiny_bus_free_msg_id(tiny_bus_t *bus, message_id_t id)
 {
-	pthread_mutex_lock(bus->mutex);
+    tiny_bus_subs_t *subs;
 
-    list_free(bus->slots[id]);
-    free(bus->slots[id]);
-    bus->slots[id] = NULL;
-    
+	pthread_mutex_lock(bus->mutex);
+    subs = id_map_remove(&bus->slots, id);
 	pthread_mutex_unlock(bus->mutex);
 
+    epoch_retire(subs, free);
+
     // Attension: here I don't run "msg_id_count--"
     // bus->msg_id_count-- ??
 }
 
+tiny_bus_result_t
+tiny_bus_subscribe(tiny_bus_t *bus, slot_t *slot, message_id_t id, msg_func_t handler)
+{
+    tiny_bus_subs_t *subs, *old;
+
+    pthread_mutex_lock(bus->mutex);
+    old = id_map_get(&bus->slots, id);
+    if (old == NULL)
+    {
+        pthread_mutex_unlock(bus->mutex);
+        return TINY_BUS_FAILED;
+    }
+
+    subs = tiny_bus_subs_new(old->count + 1);
+    if (subs == NULL)
+    {
+        pthread_mutex_unlock(bus->mutex);
+        return TINY_BUS_FAILED;
+    }
+
+    memcpy(subs->subs, old->subs, old->count * sizeof(tiny_bus_sub_t));
+    subs->subs[old->count].slot = slot;
+    subs->subs[old->count].handler = handler;
+    id_map_set(&bus->slots, id, subs);  // existing key, can't fail
+    pthread_mutex_unlock(bus->mutex);
+
+    epoch_retire(old, free);
+
+    return TINY_BUS_SUCCEED;
+}
+
+tiny_bus_result_t
+tiny_bus_unsubscribe(tiny_bus_t *bus, slot_t *slot, message_id_t id)
+{
+    tiny_bus_subs_t *subs, *old;
+    uint32_t index, count;
+
+    pthread_mutex_lock(bus->mutex);
+    old = id_map_get(&bus->slots, id);
+    if (old == NULL)
+    {
+        pthread_mutex_unlock(bus->mutex);
+        return TINY_BUS_FAILED;
+    }
+
+    subs = tiny_bus_subs_new(old->count);
+    if (subs == NULL)
+    {
+        pthread_mutex_unlock(bus->mutex);
+        return TINY_BUS_FAILED;
+    }
+
+    // drop the first occurrence only, like list_remove() did
+    for (index = 0, count = 0; index < old->count; index++)
+    {
+        if (old->subs[index].slot == slot && count == index)
+            continue;
+        subs->subs[count++] = old->subs[index];
+    }
+    subs->count = count;
+    id_map_set(&bus->slots, id, subs);
+    pthread_mutex_unlock(bus->mutex);
+
+    epoch_retire(old, free);
+
+    // once we return, no dispatcher is delivering to this slot for "id"
+    epoch_synchronize();
+
+    return TINY_BUS_SUCCEED;
+}
+
 
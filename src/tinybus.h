@@ -10,6 +10,10 @@
 #include <pthread.h>
 #include "atomic.h"
 #include "asyncqueue.h"
+#include "mpscqueue.h"
+#include "prioqueue.h"
+#include "eventcount.h"
+#include "idmap.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -18,19 +22,60 @@ extern "C" {
 #define TINY_BUS_MSG_EXIT		0xFFFFFFFF
 
 #define BUS_MESSAGE_BASE_ID     0
-#define BUS_MESSAGE_MAX_ID		256	// base index is 0
 
+/*
+ * message IDs are hashed, any 32 bits value but TINY_BUS_MSG_EXIT can be
+ * used. This is only the initial size of the ID tables
+ */
+#define BUS_MESSAGE_MAX_ID		256
+
+/*
+ * max messages the bus thread takes from ingress per synchronization
+ */
+#define TINY_BUS_FETCH_MAX		256
+
+/*
+ * frees a payload handed to tiny_msg_alloc()
+ */
+typedef void (*tiny_msg_free_t)(void *data);
+
+#define TINY_MSG_POOLED			0x0001	// from tiny_msg_alloc(), owned by the bus
+#define TINY_MSG_INLINE			0x0002	// payload stored in the message block
+
+/*
+ * payloads up to this size can live inside the pooled message block, which
+ * then fills exactly two cache lines on 64 bits targets
+ */
+#define TINY_MSG_INLINE_MAX		56
+
+/*
+ * message priorities, each one is a lane of the bus ingress and of slot
+ * pools created with lanes. Higher goes first, a priority above the last
+ * lane uses the last lane
+ */
+#define TINY_MSG_PRIO_NORMAL	0
+#define TINY_MSG_PRIO_HIGH		1
+#define TINY_MSG_PRIO_CONTROL	2	// heartbeats, shutdown...
+
+/*
+ * for a pooled message "ref_count" is set to the number of subscribers when
+ * the bus dispatches it, and each slot releases it after the handler has
+ * run. The payload is never copied, "free_data" is called once, after the
+ * last handler returned
+ */
 typedef struct _tiny_bus_msg_priv
 {
 	atomic_t	ref_count;
+	uint32_t	flags;		// packed with "ref_count", keeps the block at two lines
 	void *		data;
 	size_t		size;
+	tiny_msg_free_t	free_data;
 } tiny_msg_priv_t;
 
 typedef uint32_t message_id_t;
 typedef struct _tiny_bus_msg
 {
-	uint32_t		seq;
+	uint32_t		seq;	// correlation ID of a request and its reply, 0 otherwise
 	message_id_t	msg_id;
 	
 	tiny_msg_priv_t *msg_priv;
@@ -40,20 +85,146 @@ typedef struct _tiny_bus_msg
 	 */
 	void *		user_data;
 	size_t		user_size;
+
+	uint32_t	priority;	// TINY_MSG_PRIO_*, 0 for zeroed messages
 } tiny_msg_t;
 
 
-typedef struct _tiny_bus
+/*
+ * bus ingress, the queue carrying published messages to the bus thread
+ */
+typedef enum _tiny_bus_ingress
 {
+	TINY_BUS_INGRESS_QUEUE	= 0,	// mutex/cond async_queue_t, unbounded
+	TINY_BUS_INGRESS_RING			// lock-free bounded mpsc_queue_t
+} tiny_bus_ingress_t;
+
+/*
+ * With "direct" set the publishing thread looks the subscribers up and
+ * writes into their slots itself, skipping the ingress and the dispatcher
+ * wakeup. Each publisher's messages stay in order, the dispatchers are
+ * left idle.
+ *
+ * Otherwise "dispatchers" threads deliver messages, each with its own ingress. A
+ * message goes to the dispatcher picked by hashing its partition key, the
+ * message ID unless published with slot_publish_keyed(), so messages of one
+ * key keep their order while different keys are delivered in parallel
+ */
+typedef struct _tiny_bus_attr
+{
+	tiny_bus_ingress_t	ingress;
+	uint32_t			ingress_capacity;	// ring only, rounded to power of 2
+	uint32_t			dispatchers;		// 0 means 1
+	int					direct;				// publishers deliver themselves, see above
+
 	/*
-	 * bus thread
+	 * dispatchers only run on these CPUs (copied, NULL or 0 CPUs leaves
+	 * them unpinned). A pinned dispatcher allocates its own ingress, so
+	 * the kernel's first-touch policy puts it on the dispatcher's node
 	 */
-	pthread_t       *thread;	
-	
+	const int *			dispatcher_cpus;
+	uint32_t			dispatcher_cpu_count;
+
+	/*
+	 * more than 1 gives each dispatcher that many ingress lanes, at most
+	 * PRIO_QUEUE_MAX_LANES, so a message of a higher priority overtakes
+	 * the ones queued below it. Messages of one lane keep their order
+	 */
+	uint32_t			lanes;
+
 	/*
-	 * contain tiny_msg_t object
+	 * the queue ingress holds at most "queue_capacity" messages, 0, the
+	 * default, is unbounded; the ring always holds "ingress_capacity".
+	 * Publishing into a full ingress follows "ingress_overflow", coalescing
+	 * by message ID, and slot_publish() reports a drop. The ring can only
+	 * block or drop the newest
+	 */
+	uint32_t			queue_capacity;
+	queue_overflow_t	ingress_overflow;
+} tiny_bus_attr_t;
+
+typedef enum _msg_result_t
+{
+    MSG_SUCCEED = 0,
+    MSG_FAILED  = 0X0001
+} msg_result_t;
+
+typedef struct _slot slot_t;
+typedef msg_result_t (*msg_func_t)(slot_t *slot, tiny_msg_t *msg);
+
+/*
+ * one subscriber of a message ID, the handler is resolved at subscription
+ * so dispatch never has to look into the slot's handler table
+ */
+typedef struct _tiny_bus_sub
+{
+	slot_t *		slot;
+	msg_func_t		handler;
+} tiny_bus_sub_t;
+
+/*
+ * immutable subscriber array of a message ID, allocated on a cache line
+ * boundary with the entries packed right after the count, so a fan-out
+ * walks consecutive lines. Subscribing or unsubscribing builds a new array
+ * and swaps it in, the old one is handed to epoch_retire() and freed once
+ * no dispatcher can still be walking it
+ */
+typedef struct _tiny_bus_subs
+{
+	uint32_t		count;
+	tiny_bus_sub_t	subs[] __attribute__((aligned(16)));
+} tiny_bus_subs_t;
+
+typedef struct _tiny_bus tiny_bus_t;
+typedef struct _tiny_bus_timers tiny_bus_timers_t;
+typedef struct _tiny_bus_requests tiny_bus_requests_t;
+typedef struct _tiny_bus_future tiny_bus_future_t;
+
+/*
+ * one dispatcher thread and the ingress feeding it
+ */
+typedef struct _tiny_bus_dispatcher
+{
+	pthread_t		thread;
+	int				started;
+	volatile int	ready;		// pinned dispatcher: 1 ingress created, -1 failed
+
+	/*
+	 * contain tiny_msg_t object, only one of them is used according to
+	 * the ingress selected at creation
 	 */
 	async_queue_t	*msg_queue;
+	mpsc_queue_t	*msg_ring;
+
+	/*
+	 * instead of the above with lanes: "msg_lanes" for the queue ingress,
+	 * one ring per lane for the ring ingress, "doorbell" is rung after
+	 * each push so the dispatcher can wait for any of them
+	 */
+	prio_queue_t	*msg_lanes;
+	mpsc_queue_t	*msg_rings[PRIO_QUEUE_MAX_LANES];
+	event_count_t	doorbell;
+	uint32_t		skipped[PRIO_QUEUE_MAX_LANES];
+
+	tiny_bus_t		*bus;
+} __attribute__((aligned(CACHE_LINE_SIZE))) tiny_bus_dispatcher_t;
+
+struct _tiny_bus
+{
+	/*
+	 * bus threads
+	 */
+	tiny_bus_ingress_t	ingress;
+	uint32_t		dispatcher_count;
+	tiny_bus_dispatcher_t	*dispatchers;
+	int				direct;
+	int				*dispatcher_cpus;
+	uint32_t		dispatcher_cpu_count;
+	uint32_t		ingress_capacity;
+	uint32_t		lanes;
+	uint32_t		queue_capacity;
+	queue_overflow_t	ingress_overflow;
+	atomic_t		dropped;	// by the ingress overflow policy
 
 	/*
 	 * Identify current registered message ID count
@@ -61,24 +232,41 @@ typedef struct _tiny_bus
     uint32_t        msg_id_count;
 	
 	/*
-	 * contain slot_t objects, here I use array to associate message ID
-	 * and slot list, a message ID is a index of array actually, and it
-	 * can be assocaited with a slot list, slot subscribed message ID
-	 * will be pushed into the slot list
+	 * contain slot_t objects, here I use a hash map to associate message ID
+	 * and subscriber array, an ID without entry isn't allocated. Dispatch
+	 * reads it without any lock inside an epoch, "mutex" only serializes
+	 * subscription changes
 	 */
 	pthread_mutex_t	*mutex;	
-	list_t          *slots[BUS_MESSAGE_MAX_ID];
-} tiny_bus_t;
+	id_map_t		slots;
+
+	/*
+	 * timer thread and its wheel, created by the first tiny_bus_timer_add()
+	 */
+	tiny_bus_timers_t * volatile timers;
+
+	/*
+	 * requests waiting for a reply, created by the first tiny_bus_request()
+	 */
+	tiny_bus_requests_t * volatile requests;
+};
 
 typedef enum
 {	
 	TINY_BUS_FAILED	= -1,
-	TINY_BUS_SUCCEED
+	TINY_BUS_SUCCEED,
+	TINY_BUS_DROPPED		// a bounded queue was full, a message was dropped
 } tiny_bus_result_t;
 
+void
+tiny_bus_attr_init(tiny_bus_attr_t *attr);	// fill attr with defaults
+
 tiny_bus_t *
 tiny_bus_new(void); // allocate a bus object
 
+tiny_bus_t *
+tiny_bus_new_with_attr(const tiny_bus_attr_t *attr);
+
 void
 tiny_bus_destroy(tiny_bus_t *bus);  // destroy a bus object
 
@@ -88,6 +276,150 @@ tiny_bus_init_msg_ids(tiny_bus_t *bus, message_id_t* ids, size_t size);
 void
 tiny_bus_free_msg_id(tiny_bus_t *bus, message_id_t id);
 
+/*
+ * add or remove a slot in the subscriber array of message ID, used by
+ * slot_subscribe_message() and slot_unsubscribe_message()
+ */
+tiny_bus_result_t
+tiny_bus_subscribe(tiny_bus_t *bus, slot_t *slot, message_id_t id, msg_func_t handler);
+
+tiny_bus_result_t
+tiny_bus_unsubscribe(tiny_bus_t *bus, slot_t *slot, message_id_t id);
+
+/*
+ * push message into bus ingress, used by slot_publish()
+ */
+tiny_bus_result_t
+tiny_bus_post(tiny_bus_t *bus, tiny_msg_t *msg);
+
+size_t
+tiny_bus_post_batch(tiny_bus_t *bus, tiny_msg_t **msgs, size_t count);	// messages dropped
+
+/*
+ * push message with an explicit partition key instead of its message ID,
+ * used by slot_publish_keyed()
+ */
+tiny_bus_result_t
+tiny_bus_post_keyed(tiny_bus_t *bus, tiny_msg_t *msg, uint32_t key);
+
+/*
+ * take a message from the bus message pool, no malloc once the pool is
+ * warm. "data" isn't copied: the message owns it from now on and passes it
+ * to "free_data" (may be NULL) when released. Publish the message once,
+ * the bus releases it after delivery, never free it yourself
+ */
+tiny_msg_t *
+tiny_msg_alloc(message_id_t id, void *data, size_t size, tiny_msg_free_t free_data);
+
+/*
+ * same, for a payload of at most TINY_MSG_INLINE_MAX bytes: "data" is
+ * copied into the message block, so message, private part and payload are
+ * one allocation on adjacent cache lines. "data" may be NULL, then fill
+ * msg->msg_priv->data yourself before publishing. NULL if "size" is too big
+ */
+tiny_msg_t *
+tiny_msg_alloc_inline(message_id_t id, const void *data, size_t size);
+
+/*
+ * timer resolution, a timer never fires before its deadline and usually
+ * less than one tick after
+ */
+#define TINY_BUS_TIMER_TICK_MS		1
+
+/*
+ * publish a message of "id" in "delay_ms", then every "period_ms" unless
+ * 0. "data", at most TINY_MSG_INLINE_MAX bytes, is copied into each
+ * message, taken with tiny_msg_alloc_inline(). A periodic timer that fell
+ * behind skips the periods it missed instead of firing in a burst.
+ * All timers of a bus share one thread, started by the first call.
+ * Returns the timer for tiny_bus_timer_cancel(), 0 on failure
+ */
+uint32_t
+tiny_bus_timer_add(tiny_bus_t *bus, message_id_t id, const void *data, size_t size,
+	uint32_t delay_ms, uint32_t period_ms);
+
+/*
+ * TINY_BUS_FAILED if "timer" already fired for the last time. A message
+ * being published while we cancel may still be delivered
+ */
+tiny_bus_result_t
+tiny_bus_timer_cancel(tiny_bus_t *bus, uint32_t timer);
+
+/*
+ * stops the timer thread and frees every timer, used by tiny_bus_destroy()
+ */
+void
+tiny_bus_timers_free(tiny_bus_timers_t *timers);
+
+/*
+ * called once per future, with the reply or with NULL if the request was
+ * cancelled by tiny_bus_destroy(), which must not be called back into then.
+ * The reply belongs to the future, it is released after the callback returns
+ */
+typedef void (*tiny_bus_future_cb_t)(tiny_msg_t *reply, void *user_data);
+
+/*
+ * publish "request" with a fresh correlation ID in its "seq" and return
+ * the future of its reply, NULL on failure, "request" is released then.
+ * A subscriber answers with tiny_bus_reply(), which hands the reply to the
+ * future directly. A request the bus reports as dropped is cancelled right
+ * away, its future completes without a reply. Under DROP_OLDEST or
+ * COALESCE that report may be about an older message, and the request's
+ * reply is then discarded. A request dropped later, to make room for
+ * another message, is never answered: wait with a timeout, or free the
+ * future
+ */
+tiny_bus_future_t *
+tiny_bus_request(tiny_bus_t *bus, tiny_msg_t *request);
+
+/*
+ * answer "request" with "reply", from tiny_msg_alloc() or
+ * tiny_msg_alloc_inline(). Only the first reply is taken; TINY_BUS_FAILED
+ * and "reply" released if the request was already answered, cancelled, or
+ * its future freed
+ */
+tiny_bus_result_t
+tiny_bus_reply(tiny_bus_t *bus, tiny_msg_t *request, tiny_msg_t *reply);
+
+/*
+ * wait for the reply, NULL if the request was cancelled. The reply stays
+ * valid until tiny_bus_future_free()
+ */
+tiny_msg_t *
+tiny_bus_future_wait(tiny_bus_future_t *future);
+
+tiny_msg_t *
+tiny_bus_future_timed_wait(tiny_bus_future_t *future, unsigned int timeout_ms);	// NULL on timeout too
+
+/*
+ * run "callback" on completion instead of waiting: by the replying thread,
+ * or right away if the reply is already there. The future is freed after
+ * the callback, don't use it once this is called
+ */
+void
+tiny_bus_future_then(tiny_bus_future_t *future, tiny_bus_future_cb_t callback, void *user_data);
+
+/*
+ * release the future and its reply. A late reply to a pending request is
+ * dropped
+ */
+void
+tiny_bus_future_free(tiny_bus_future_t *future);
+
+/*
+ * cancels the pending requests, used by tiny_bus_destroy()
+ */
+void
+tiny_bus_requests_free(tiny_bus_requests_t *requests);
+
+/*
+ * drop one reference, called by the slot after a handler returns. The last
+ * one frees the payload and recycles the message. No-op for messages not
+ * coming from tiny_msg_alloc()
+ */
+void
+tiny_msg_release(tiny_msg_t *msg);
+
 
 #ifdef __cplusplus
 }
@@ -1,13 +1,51 @@
 #include <sys/types.h>
 #include <sys/time.h>
+#include <time.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <assert.h>
+#include <sched.h>
 #include "trace.h"
 
-#define TRACE_MAX_BUF  (4 * 1024)
+/*
+ * each thread's ring, a line is at most TRACE_LINE_MAX_SIZE and a record
+ * never wraps, so a ring holds at least two of the biggest records
+ */
+#define TRACE_MAX_BUF  (16 * 1024)
+
+/*
+ * how long the trace thread may leave lines in the rings, a ring past half
+ * full wakes it right away
+ */
+#define TRACE_FLUSH_MS  10
+
+/*
+ * a writer stamps its line before publishing it, and announces the stamp
+ * in its ring's "pending" meanwhile. The trace thread only prints lines
+ * older than every pending stamp, so a line published late still comes
+ * out in order. TRACE_STAMPING is the value while the clock is being read.
+ * After TRACE_STALL_PASSES passes that couldn't drain a full ring, e.g.
+ * the wall clock was set back, everything is printed regardless
+ */
+#define TRACE_STAMPING      1
+#define TRACE_STALL_PASSES  10
+
+#define TRACE_RECORD_ALIGN  16
+#define TRACE_RECORD_PAD    0xFFFFFFFF  // "len" of the filler up to the ring end
+#define TRACE_RECORD_BINARY 0x80000000  // "len" flag, a trace_binary_t and its arguments
+
+/*
+ * header of a line in a ring, the text follows
+ */
+typedef struct _trace_record
+{
+    uint32_t    size;   // whole record, multiple of TRACE_RECORD_ALIGN
+    uint32_t    len;    // text bytes, or TRACE_RECORD_BINARY and binary bytes
+    uint64_t    stamp;  // wall clock ns, the rings are merged in this order
+} trace_record_t;
 
 #define print_err(err, name) \
 do {\
@@ -17,141 +55,719 @@ do {\
            __FILE__, __LINE__, __FUNCTION__, err, name);				\
 } while (0)
 
-static uint32_t
-async_ring_buf_get_free_space(async_ring_buf_t *buf)
+static inline uint64_t
+trace_now_ns(void)
 {
-    uint32_t space = 0;
+    struct timespec ts;
 
-    if (buf->read_reverse == buf->write_reverse)
-        space = buf->size - buf->write_pos + buf->read_pos;
-    else if ((buf->write_reverse - buf->read_reverse) == 1)
-        space = buf->read_pos - buf->write_pos;
-        
-    return space;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
-static uint32_t
-async_ring_buf_get_used_space(async_ring_buf_t *buf)
+static trace_ring_t *
+trace_ring_new(uint32_t size)
 {
-    int datasize = 0;
+    trace_ring_t *ring;
 
-    if (buf->read_reverse == buf->write_reverse)
-        datasize = buf->write_pos - buf->read_pos;
-    else if ((buf->write_reverse - buf->read_reverse) == 1)
-        datasize = buf->size - buf->read_pos + buf->write_pos;
-    else
-        datasize = buf->size;
-    
-    return datasize;    
+    if (posix_memalign((void **)&ring, CACHE_LINE_SIZE, sizeof(trace_ring_t)))
+        return NULL;
+    memset(ring, 0, sizeof(trace_ring_t));
+
+    ring->start = (char *)malloc(size);
+    if (ring->start == NULL)
+    {
+        free(ring);
+        return NULL;
+    }
+    ring->size = size;
+    event_count_init(&ring->not_full);
+
+    return ring;
 }
 
+static void
+trace_ring_free(trace_ring_t *ring)
+{
+    event_count_destroy(&ring->not_full);
+    free(ring->start);
+    free(ring);
+}
 
-static uint32_t
-async_ring_buf_read(async_ring_buf_t *buf, char *dest, size_t len)
+static void
+trace_ring_exit(void *ring)
 {
-    uint32_t readbytes, usedbytes;
+    atomic_store_release(&((trace_ring_t *)ring)->in_use, 0);
+}
 
-    assert(buf);
-    if (buf->read_reverse == buf->write_reverse)
+/*
+ * ring of the calling thread, registered on its first line
+ */
+static trace_ring_t *
+trace_ring_get(async_ring_buf_t *buf)
+{
+    trace_ring_t *ring;
+
+    ring = (trace_ring_t *)pthread_getspecific(buf->key);
+    if (ring)
+        return ring;
+
+    pthread_mutex_lock(&buf->mutex);
+    for (ring = buf->rings; ring; ring = ring->next)
     {
-        usedbytes = buf->write_pos - buf->read_pos;
-        readbytes = (len <= usedbytes) ? len : usedbytes;
-        strncpy(dest, buf->start + buf->read_pos, readbytes);
+        // drained, the trace thread is done with the old writer's lines
+        if (!atomic_load_acquire(&ring->in_use)
+            && atomic_load_acquire(&ring->read_pos) == ring->write_pos
+            && atomic_cas(&ring->in_use, 0, 1))
+            break;
     }
-    else if ((buf->write_reverse - buf->read_reverse) == 1)
+
+    if (ring == NULL)
     {
-        if (len <= (buf->size - buf->read_pos))
+        ring = trace_ring_new(buf->size);
+        if (ring)
         {
-            strncpy(dest, buf->start + buf->read_pos, len);
-            readbytes = len;
+            ring->in_use = 1;
+            ring->next = buf->rings;
+            atomic_store_release(&buf->rings, ring);
         }
-        else
+    }
+    pthread_mutex_unlock(&buf->mutex);
+
+    if (ring)
+        pthread_setspecific(buf->key, ring);
+
+    return ring;
+}
+
+/*
+ * next line of "ring" up to the trace thread's snapshot, fillers skipped.
+ * An overwriting writer may move "read_pos" past the snapshot, and change
+ * the record under us: it is only ours once "read_pos" is moved past it
+ */
+static trace_record_t *
+trace_ring_peek(trace_ring_t *ring)
+{
+    trace_record_t *record;
+    uint32_t pos;
+
+    for (;;)
+    {
+        pos = atomic_load_acquire(&ring->read_pos);
+        if ((int32_t)(ring->write_cache - pos) <= 0)
+            return NULL;
+
+        record = (trace_record_t *)(ring->start + (pos & (ring->size - 1)));
+        if (record->len != TRACE_RECORD_PAD)
         {
-            usedbytes = buf->size - buf->read_pos + buf->write_pos;
-            readbytes = len <= usedbytes ? len : usedbytes;
-            
-            strncpy(dest, buf->start + buf->read_pos, buf->size - buf->read_pos);
-            strncpy(dest + buf->size - buf->read_pos, buf->start, readbytes - buf->size + buf->read_pos);
-        }        
+            ring->peek_pos = pos;
+            return record;
+        }
+
+        atomic_cas(&ring->read_pos, pos, pos + record->size);
     }
-    else
+}
+
+/*
+ * writer overwriting: take the oldest record back from the trace thread
+ */
+static void
+trace_ring_reclaim(trace_ring_t *ring, uint32_t pos)
+{
+    trace_record_t *record;
+
+    record = (trace_record_t *)(ring->start + (pos & (ring->size - 1)));
+    if (atomic_cas(&ring->read_pos, pos, pos + record->size)
+        && record->len != TRACE_RECORD_PAD)
+        atomic_inc(&ring->lost);
+}
+
+/*
+ * Binary records: the calling thread stores the format pointer and the raw
+ * arguments, the trace thread formats them. Arguments take 8 bytes each,
+ * a long double 16, a string its length then its bytes and NUL, all 8
+ * aligned
+ */
+typedef struct _trace_binary
+{
+    const char *    format;     // must live until printed, e.g. a literal
+    int32_t         level;
+    uint32_t        reserved;
+} trace_binary_t;
+
+#define TRACE_ARG_ALIGN     8
+
+enum
+{
+    TRACE_ARG_NONE = 0,     // "%%"
+    TRACE_ARG_INT,
+    TRACE_ARG_UINT,
+    TRACE_ARG_DOUBLE,
+    TRACE_ARG_LDOUBLE,
+    TRACE_ARG_STRING,
+    TRACE_ARG_POINTER,
+    TRACE_ARG_BAD           // %n, wide characters...: formatted as text
+};
+
+enum
+{
+    TRACE_LEN_NONE = 0,
+    TRACE_LEN_HH,
+    TRACE_LEN_H,
+    TRACE_LEN_L,
+    TRACE_LEN_LL,
+    TRACE_LEN_J,
+    TRACE_LEN_Z,
+    TRACE_LEN_T,
+    TRACE_LEN_LD
+};
+
+#define TRACE_PRECISION_NONE    (-1)
+#define TRACE_PRECISION_STAR    (-2)    // the last '*' argument
+
+typedef struct _trace_spec
+{
+    const char *    start;      // '%'
+    const char *    modifier;   // length modifier, or conversion
+    const char *    end;        // past the conversion
+    int             stars;      // '*' width and precision, int arguments
+    int             precision;  // TRACE_PRECISION_NONE, _STAR or the literal one
+    int             length;
+    int             type;
+} trace_spec_t;
+
+static uint32_t get_timestamp_str(int level, struct timeval *timestamp, char *buf, size_t len);
+
+/*
+ * conversion specification starting at "p", a '%'
+ */
+static const char *
+trace_spec_parse(const char *p, trace_spec_t *spec)
+{
+    spec->start = p++;
+    spec->stars = 0;
+    spec->precision = TRACE_PRECISION_NONE;
+
+    while (*p && strchr("-+ #0'", *p))
+        p++;
+
+    if (*p == '*')
+    {
+        spec->stars++;
+        p++;
+    }
+    while (*p >= '0' && *p <= '9')
+        p++;
+
+    if (*p == '.')
     {
-        assert(0);
+        p++;
+        spec->precision = 0;
+        if (*p == '*')
+        {
+            spec->precision = TRACE_PRECISION_STAR;
+            spec->stars++;
+            p++;
+        }
+        for (; *p >= '0' && *p <= '9'; p++)
+        {
+            if (spec->precision >= 0 && spec->precision < TRACE_LINE_MAX_SIZE)
+                spec->precision = spec->precision * 10 + (*p - '0');
+        }
     }
 
-    buf->read_pos += readbytes;
-    if (buf->read_pos > buf->size)
+    spec->modifier = p;
+    spec->length = TRACE_LEN_NONE;
+    switch (*p)
     {
-        buf->read_pos = buf->read_pos % buf->size;
-        buf->read_reverse++;
+    case 'h':
+        spec->length = (p[1] == 'h') ? TRACE_LEN_HH : TRACE_LEN_H;
+        break;
+    case 'l':
+        spec->length = (p[1] == 'l') ? TRACE_LEN_LL : TRACE_LEN_L;
+        break;
+    case 'q':
+        spec->length = TRACE_LEN_LL;
+        break;
+    case 'j':
+        spec->length = TRACE_LEN_J;
+        break;
+    case 'z':
+        spec->length = TRACE_LEN_Z;
+        break;
+    case 't':
+        spec->length = TRACE_LEN_T;
+        break;
+    case 'L':
+        spec->length = TRACE_LEN_LD;
+        break;
     }
-        
-    return readbytes;
+    if (spec->length == TRACE_LEN_HH || (spec->length == TRACE_LEN_LL && *p == 'l'))
+        p += 2;
+    else if (spec->length != TRACE_LEN_NONE)
+        p++;
+
+    switch (*p)
+    {
+    case 'd': case 'i':
+        spec->type = TRACE_ARG_INT;
+        break;
+    case 'o': case 'u': case 'x': case 'X':
+        spec->type = TRACE_ARG_UINT;
+        break;
+    case 'c':
+        spec->type = (spec->length == TRACE_LEN_NONE) ? TRACE_ARG_INT : TRACE_ARG_BAD;
+        break;
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+        spec->type = (spec->length == TRACE_LEN_LD) ? TRACE_ARG_LDOUBLE : TRACE_ARG_DOUBLE;
+        break;
+    case 's':
+        spec->type = (spec->length == TRACE_LEN_NONE) ? TRACE_ARG_STRING : TRACE_ARG_BAD;
+        break;
+    case 'p':
+        spec->type = TRACE_ARG_POINTER;
+        break;
+    case '%':
+        spec->type = TRACE_ARG_NONE;
+        break;
+    default:
+        spec->type = TRACE_ARG_BAD;
+        break;
+    }
+
+    if (*p)
+        p++;
+    spec->end = p;
+
+    return p;
 }
 
-static void
-trace_print_until_zero(async_ring_buf_t *buf)
+static inline int
+trace_put(char *buf, size_t *pos, size_t size, const void *value, size_t len)
 {
-    int     readbytes, cycle;
-    char    string[TRACE_LINE_MAX_SIZE];
+    if (*pos + len > size)
+        return -1;
 
-    readbytes = 0; // initiate every time    
-    do
+    memcpy(buf + *pos, value, len);
+    *pos = (*pos + len + TRACE_ARG_ALIGN - 1) & ~(size_t)(TRACE_ARG_ALIGN - 1);
+
+    return 0;
+}
+
+static int64_t
+trace_get_int(int length, va_list *args)
+{
+    switch (length)
+    {
+    case TRACE_LEN_HH:  return (signed char)va_arg(*args, int);
+    case TRACE_LEN_H:   return (short)va_arg(*args, int);
+    case TRACE_LEN_L:   return va_arg(*args, long);
+    case TRACE_LEN_LL:  return va_arg(*args, long long);
+    case TRACE_LEN_J:   return va_arg(*args, intmax_t);
+    case TRACE_LEN_Z:   return va_arg(*args, ssize_t);
+    case TRACE_LEN_T:   return va_arg(*args, ptrdiff_t);
+    default:            return va_arg(*args, int);
+    }
+}
+
+static uint64_t
+trace_get_uint(int length, va_list *args)
+{
+    switch (length)
+    {
+    case TRACE_LEN_HH:  return (unsigned char)va_arg(*args, unsigned int);
+    case TRACE_LEN_H:   return (unsigned short)va_arg(*args, unsigned int);
+    case TRACE_LEN_L:   return va_arg(*args, unsigned long);
+    case TRACE_LEN_LL:  return va_arg(*args, unsigned long long);
+    case TRACE_LEN_J:   return va_arg(*args, uintmax_t);
+    case TRACE_LEN_Z:   return va_arg(*args, size_t);
+    case TRACE_LEN_T:   return va_arg(*args, ptrdiff_t);
+    default:            return va_arg(*args, unsigned int);
+    }
+}
+
+/*
+ * store the arguments "format" takes into "buf", the bytes used or -1 if
+ * this format can't be deferred or doesn't fit
+ */
+static int
+trace_pack(const char *format, va_list *args, char *buf, size_t size)
+{
+    trace_spec_t spec;
+    const char *p, *string;
+    size_t pos = 0, limit;
+    int64_t star = 0, integer;
+    uint64_t uinteger;
+    double real;
+    long double lreal;
+    uint32_t len;
+    void *pointer;
+    int index;
+
+    for (p = strchr(format, '%'); p; p = strchr(p, '%'))
+    {
+        p = trace_spec_parse(p, &spec);
+        if (spec.type == TRACE_ARG_BAD)
+            return -1;
+
+        for (index = 0; index < spec.stars; index++)
+        {
+            star = va_arg(*args, int);
+            if (trace_put(buf, &pos, size, &star, sizeof(star)))
+                return -1;
+        }
+
+        switch (spec.type)
+        {
+        case TRACE_ARG_INT:
+            integer = trace_get_int(spec.length, args);
+            if (trace_put(buf, &pos, size, &integer, sizeof(integer)))
+                return -1;
+            break;
+
+        case TRACE_ARG_UINT:
+            uinteger = trace_get_uint(spec.length, args);
+            if (trace_put(buf, &pos, size, &uinteger, sizeof(uinteger)))
+                return -1;
+            break;
+
+        case TRACE_ARG_DOUBLE:
+            real = va_arg(*args, double);
+            if (trace_put(buf, &pos, size, &real, sizeof(real)))
+                return -1;
+            break;
+
+        case TRACE_ARG_LDOUBLE:
+            lreal = va_arg(*args, long double);
+            if (trace_put(buf, &pos, size, &lreal, sizeof(lreal)))
+                return -1;
+            break;
+
+        case TRACE_ARG_STRING:
+            // copied, the caller's buffer may be gone when it's printed
+            string = va_arg(*args, const char *);
+            if (string == NULL)
+                string = "(null)";
+
+            // a precision bounds the read, the string needn't be terminated
+            limit = size - pos;
+            if (spec.precision == TRACE_PRECISION_STAR && star >= 0 && (uint64_t)star < limit)
+                limit = star;
+            else if (spec.precision >= 0 && (size_t)spec.precision < limit)
+                limit = spec.precision;
+            len = strnlen(string, limit);
+            if (trace_put(buf, &pos, size, &len, sizeof(len)) || pos + len + 1 > size)
+                return -1;
+            memcpy(buf + pos, string, len);
+            buf[pos + len] = '\0';
+            pos = (pos + len + 1 + TRACE_ARG_ALIGN - 1) & ~(size_t)(TRACE_ARG_ALIGN - 1);
+            break;
+
+        case TRACE_ARG_POINTER:
+            pointer = va_arg(*args, void *);
+            if (trace_put(buf, &pos, size, &pointer, sizeof(pointer)))
+                return -1;
+            break;
+        }
+    }
+
+    return pos;
+}
+
+/*
+ * next stored argument of "len" bytes, NULL past the end of a torn record
+ */
+static inline const char *
+trace_get(const char *buf, size_t *pos, size_t size, size_t len)
+{
+    const char *value = buf + *pos;
+
+    if (*pos + len > size)
+        return NULL;
+
+    *pos = (*pos + len + TRACE_ARG_ALIGN - 1) & ~(size_t)(TRACE_ARG_ALIGN - 1);
+
+    return value;
+}
+
+#define trace_snprintf(out, room, fmt, spec, stars, value) \
+    ((spec).stars == 0 ? snprintf(out, room, fmt, value) : \
+     (spec).stars == 1 ? snprintf(out, room, fmt, (int)(stars)[0], value) : \
+        snprintf(out, room, fmt, (int)(stars)[0], (int)(stars)[1], value))
+
+/*
+ * format a binary record on the trace thread, one snprintf() per
+ * conversion with the length modifier matching how the value was stored
+ */
+static uint32_t
+trace_unpack(const char *record, size_t size, uint64_t stamp, char *line, size_t room)
+{
+    const trace_binary_t *head = (const trace_binary_t *)record;
+    const char *args = record + sizeof(trace_binary_t);
+    const char *p, *next, *value;
+    char fmt[64];
+    trace_spec_t spec;
+    struct timeval timestamp;
+    int64_t stars[2];
+    long double ldouble;
+    size_t pos = 0, out, prefix;
+    uint32_t len;
+    int index, result;
+
+    size -= sizeof(trace_binary_t);
+    timestamp.tv_sec = stamp / 1000000000ULL;
+    timestamp.tv_usec = (stamp % 1000000000ULL) / 1000;
+    out = get_timestamp_str(head->level, &timestamp, line, room);
+
+    for (p = head->format; *p && out < room - 1; p = spec.end)
     {
-        pthread_mutex_lock(&buf->mutex);
-        readbytes = async_ring_buf_get_used_space(buf);
-        if (readbytes > 0)
+        next = strchr(p, '%');
+        len = next ? (size_t)(next - p) : strlen(p);
+        if (len > room - 1 - out)
+            len = room - 1 - out;
+        memcpy(line + out, p, len);
+        out += len;
+        if (next == NULL)
+            break;
+
+        trace_spec_parse(next, &spec);
+        if (spec.type == TRACE_ARG_NONE)
+        {
+            line[out++] = '%';
+            continue;
+        }
+
+        for (index = 0; index < spec.stars; index++)
+        {
+            value = trace_get(args, &pos, size, sizeof(int64_t));
+            if (value == NULL)
+                return out;
+            memcpy(&stars[index], value, sizeof(int64_t));
+        }
+
+        // flags, width and precision as written, then our length modifier
+        prefix = spec.modifier - spec.start;
+        if (prefix > sizeof(fmt) - 4)
+            return out;
+        memcpy(fmt, spec.start, prefix);
+        fmt[prefix] = '\0';
+
+        result = 0;
+        switch (spec.type)
         {
-            if (readbytes > sizeof(string) - 1)
+        case TRACE_ARG_INT:
+        case TRACE_ARG_UINT:
+            value = trace_get(args, &pos, size, sizeof(int64_t));
+            if (value == NULL)
+                return out;
+            if (spec.end[-1] == 'c')
             {
-                readbytes = sizeof(string) - 1;
-                cycle = 1;
+                snprintf(fmt + prefix, 4, "c");
+                result = trace_snprintf(line + out, room - out, fmt, spec, stars,
+                    (int)*(const long long *)value);
+                break;
             }
+
+            snprintf(fmt + prefix, 4, "ll%c", spec.end[-1]);
+            if (spec.type == TRACE_ARG_INT)
+                result = trace_snprintf(line + out, room - out, fmt, spec, stars,
+                    *(const long long *)value);
             else
-                cycle = 0;
-    
-            readbytes = async_ring_buf_read(buf, string, readbytes);
-        }        
-        pthread_mutex_unlock(&buf->mutex);
-      
-        
-        if (readbytes > 0)
+                result = trace_snprintf(line + out, room - out, fmt, spec, stars,
+                    *(const unsigned long long *)value);
+            break;
+
+        case TRACE_ARG_DOUBLE:
+            value = trace_get(args, &pos, size, sizeof(double));
+            if (value == NULL)
+                return out;
+            snprintf(fmt + prefix, 4, "%c", spec.end[-1]);
+            result = trace_snprintf(line + out, room - out, fmt, spec, stars,
+                *(const double *)value);
+            break;
+
+        case TRACE_ARG_LDOUBLE:
+            value = trace_get(args, &pos, size, sizeof(long double));
+            if (value == NULL)
+                return out;
+            memcpy(&ldouble, value, sizeof(ldouble));   // only 8 aligned
+            snprintf(fmt + prefix, 4, "L%c", spec.end[-1]);
+            result = trace_snprintf(line + out, room - out, fmt, spec, stars, ldouble);
+            break;
+
+        case TRACE_ARG_STRING:
+            value = trace_get(args, &pos, size, sizeof(uint32_t));
+            if (value == NULL)
+                return out;
+            memcpy(&len, value, sizeof(len));
+            value = trace_get(args, &pos, size, len + 1);
+            if (value == NULL || value[len] != '\0')
+                return out;
+            snprintf(fmt + prefix, 4, "s");
+            result = trace_snprintf(line + out, room - out, fmt, spec, stars, value);
+            break;
+
+        case TRACE_ARG_POINTER:
+            value = trace_get(args, &pos, size, sizeof(void *));
+            if (value == NULL)
+                return out;
+            snprintf(fmt + prefix, 4, "p");
+            result = trace_snprintf(line + out, room - out, fmt, spec, stars,
+                *(void * const *)value);
+            break;
+        }
+
+        if (result > 0)
+            out += ((size_t)result < room - 1 - out) ? (size_t)result : room - 1 - out;
+    }
+
+    return out;
+}
+
+/*
+ * oldest stamp a line not published yet may carry, see TRACE_STAMPING
+ */
+static uint64_t
+trace_horizon(trace_ring_t *rings)
+{
+    trace_ring_t *ring;
+    uint64_t horizon, pending;
+
+    // a writer that hasn't announced itself yet reads the clock after us
+    horizon = trace_now_ns();
+    atomic_fence();
+
+    for (ring = rings; ring; ring = ring->next)
+    {
+        while ((pending = atomic_load_acquire(&ring->pending)) == TRACE_STAMPING)
+            sched_yield();
+        if (pending && pending < horizon)
+            horizon = pending;
+    }
+
+    return horizon;
+}
+
+/*
+ * print what every ring holds now, merging the rings by timestamp. Unless
+ * "all", lines a writer still busy may go before wait for the next pass
+ */
+static void
+trace_drain(async_ring_buf_t *buf, int all)
+{
+    char line[TRACE_LINE_MAX_SIZE];
+    uint64_t raw[TRACE_LINE_MAX_SIZE / sizeof(uint64_t)];
+    trace_ring_t *ring, *rings, *oldest;
+    trace_record_t *record, *first;
+    uint32_t pos, size, len, kind, lost;
+    uint64_t stamp, horizon;
+    int printed = 0, full = 0;
+
+    // before the snapshot: a line missing from it was announced by then
+    rings = atomic_load_acquire(&buf->rings);
+    horizon = all ? UINT64_MAX : trace_horizon(rings);
+
+    for (ring = rings; ring; ring = ring->next)
+    {
+        ring->write_cache = atomic_load_acquire(&ring->write_pos);
+        if (ring->write_cache - atomic_load_acquire(&ring->read_pos) >= ring->size / 2)
+            full = 1;
+    }
+
+    for (;;)
+    {
+        oldest = NULL;
+        first = NULL;
+        for (ring = rings; ring; ring = ring->next)
         {
-            string[readbytes] = '\0'; // string terminated with NULL
-            fprintf(stdout, "%s", string);
+            record = trace_ring_peek(ring);
+            if (record && (first == NULL || record->stamp < first->stamp))
+            {
+                oldest = ring;
+                first = record;
+            }
         }
-    
-    } while (cycle);
-    
-    return;
+
+        // every other ring's first line is younger still
+        if (oldest == NULL || first->stamp >= horizon)
+            break;
+
+        // copy first, the line may be overwritten until we own it
+        pos = oldest->peek_pos;
+        size = first->size;
+        stamp = first->stamp;
+        kind = first->len & TRACE_RECORD_BINARY;
+        len = first->len & ~TRACE_RECORD_BINARY;
+        if (len > oldest->size - (pos & (oldest->size - 1)) - sizeof(trace_record_t)
+            || len > sizeof(raw) || (kind && len < sizeof(trace_binary_t)))
+            len = kind = 0;     // torn by an overwrite, the cas fails
+        memcpy(kind ? (char *)raw : line, first + 1, len);
+        if (!atomic_cas(&oldest->read_pos, pos, pos + size))
+            continue;
+
+        if (kind)
+            len = trace_unpack((char *)raw, len, stamp, line, sizeof(line));
+        fwrite(line, 1, len, stdout);
+        event_count_notify(&oldest->not_full, 0);
+        printed = 1;
+    }
+
+    if (printed || !full)
+        buf->stalled = 0;
+    else if (++buf->stalled >= TRACE_STALL_PASSES)
+    {
+        buf->stalled = 0;
+        trace_drain(buf, 1);
+    }
+
+    for (ring = rings; ring; ring = ring->next)
+    {
+        lost = atomic_xchg(&ring->lost, 0);
+        if (lost)
+        {
+            fprintf(stdout, "WARNING: %u trace lines lost\r\n", lost);
+            printed = 1;
+        }
+    }
+
+    if (printed)
+        fflush(stdout);
 }
 
 static void *
 trace_thread_worker(void *self)
 {
-    int     exit_thread;
     async_ring_buf_t *buf = (async_ring_buf_t *)self;
+    struct timespec deadline;
+    uint32_t key;
 
-    if (atomic_get(&buf->level) <= TRACE_DETAIL_LEVEL)
+    if (atomic_load_relaxed(&buf->level) <= TRACE_DETAIL_LEVEL)
         fprintf(stderr, "\r\ntrace thread started...\r\n");
 
-    exit_thread = 0;
-    while (!exit_thread)
+    for (;;)
     {
-        assert(buf);        
+        trace_drain(buf, 0);
 
-        sem_wait(buf->sem);
-        
-        trace_print_until_zero(buf);
-        
-        exit_thread = atomic_get(&buf->exit);
-    }        
+        key = event_count_prepare_wait(&buf->wakeup);
+        if (atomic_get(&buf->exit))
+        {
+            event_count_cancel_wait(&buf->wakeup);
+            break;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += TRACE_FLUSH_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        event_count_timed_wait(&buf->wakeup, key, &deadline);
+    }
 
     // check whether there are still buffer needing to print
-    trace_print_until_zero(buf);
+    trace_drain(buf, 1);
     
-    
-    if (atomic_get(&buf->level) <= TRACE_DETAIL_LEVEL)
+    if (atomic_load_relaxed(&buf->level) <= TRACE_DETAIL_LEVEL)
     {
         fprintf(stderr, "\r\ntrace thread exited...\r\n");
     }
@@ -159,121 +775,230 @@ trace_thread_worker(void *self)
     return NULL;
 }
 
+void
+async_ring_buf_attr_init(async_ring_buf_attr_t *attr)
+{
+    assert(attr);
+
+    memset(attr, 0, sizeof(async_ring_buf_attr_t));
+    attr->size = TRACE_MAX_BUF;
+    attr->overflow = QUEUE_OVERFLOW_BLOCK;
+}
+
+/*
+ * "size" of each thread's ring, blocking when full
+ */
 async_ring_buf_t*
 async_ring_buf_new(uint32_t size)
+{
+    async_ring_buf_attr_t attr;
+
+    async_ring_buf_attr_init(&attr);
+    attr.size = size;
+
+    return async_ring_buf_new_with_attr(&attr);
+}
+
+async_ring_buf_t*
+async_ring_buf_new_with_attr(const async_ring_buf_attr_t *attr)
 {
     async_ring_buf_t *buf;
+    uint32_t size, min_size;
     int result;
     
+    assert(attr);
+
     buf = (async_ring_buf_t *)calloc(1, sizeof(async_ring_buf_t));
     if (buf == NULL)
         return NULL;
 
-    buf->start = (char *)calloc(size, sizeof(char));
-    if (buf->start == NULL)
+    // a record never wraps, the biggest one must fit twice
+    min_size = 2 * (sizeof(trace_record_t) + TRACE_LINE_MAX_SIZE);
+    size = (attr->size < min_size) ? min_size : attr->size;
+    for (buf->size = TRACE_RECORD_ALIGN; buf->size < size; buf->size <<= 1)
+        ;
+    buf->overflow = attr->overflow;
+    buf->binary = attr->binary;
+
+    result = pthread_key_create(&buf->key, trace_ring_exit);
+    if (result)
     {
+        print_err(result, "pthread_key_create");
         free(buf);
         return NULL;
     }
-    buf->size = size;
 
     pthread_mutex_init(&buf->mutex, NULL);
-
-    buf->sem = (sem_t *)malloc(sizeof(sem_t));
-    if (buf->sem == NULL)
-    {
-        free(buf);
-        return NULL;
-    }    
-    sem_init(buf->sem, 0, 0);;
+    event_count_init_exclusive(&buf->wakeup);
+    atomic_set(&buf->level, TRACE_DETAIL_LEVEL);
        
     result = pthread_create(&buf->thread, NULL, trace_thread_worker, buf);
     if (result)
     {
-        free(buf->start);
+        print_err(result, "pthread_create");
+        event_count_destroy(&buf->wakeup);
+        pthread_mutex_destroy(&buf->mutex);
+        pthread_key_delete(buf->key);
         free(buf);
         return NULL;
     }
 
-    atomic_set(&buf->level, TRACE_DETAIL_LEVEL);
-    
     return buf;
 }
 
 void
 async_ring_buf_free(async_ring_buf_t *buf)
 {
+    trace_ring_t *ring;
+
     assert(buf);
 
-    atomic_set(&buf->exit, 1);
-    sem_post(buf->sem);
+    atomic_store_release(&buf->exit, 1);
+    event_count_notify(&buf->wakeup, 0);
     
     pthread_join(buf->thread, NULL);
     
+    pthread_key_delete(buf->key);
+    while ((ring = buf->rings) != NULL)
+    {
+        buf->rings = ring->next;
+        trace_ring_free(ring);
+    }
+
+    event_count_destroy(&buf->wakeup);
     pthread_mutex_destroy(&buf->mutex);    
-    sem_destroy(buf->sem);
-    free(buf->sem);
+    free(buf);
+}
+
+/*
+ * ring of the calling thread, with the stamp of its next line announced,
+ * see TRACE_STAMPING. trace_ring_end() withdraws it
+ */
+static trace_ring_t *
+trace_ring_begin(async_ring_buf_t *buf, uint64_t *stamp)
+{
+    trace_ring_t *ring;
 
-    if (buf->start)
-        free(buf->start);
+    ring = trace_ring_get(buf);
+    if (ring == NULL)
+        return NULL;
 
-    free(buf);
+    atomic_store_relaxed(&ring->pending, TRACE_STAMPING);
+    atomic_fence();
+    *stamp = trace_now_ns();
+    atomic_store_release(&ring->pending, *stamp);
+
+    return ring;
 }
 
-uint32_t
-async_ring_buf_write(async_ring_buf_t *buf, char *string, size_t len)
+static inline void
+trace_ring_end(trace_ring_t *ring)
+{
+    atomic_store_release(&ring->pending, 0);
+}
+
+/*
+ * append a line to the calling thread's ring: a copy and a release store,
+ * the trace thread is woken only once the ring is half full. A full ring
+ * follows the overflow policy, 0 if the line was dropped
+ */
+static uint32_t
+trace_ring_put(async_ring_buf_t *buf, trace_ring_t *ring, const void *string, size_t len,
+    uint64_t stamp, uint32_t kind)
 {
-    uint32_t free_size;
-    int32_t sem_value;
+    trace_record_t *record;
+    uint32_t pos, offset, room, need, total, key;
 
     assert(buf);
     assert(len <= TRACE_LINE_MAX_SIZE);
 
-    pthread_mutex_lock(&buf->mutex);
-    free_size = async_ring_buf_get_free_space(buf);
-    pthread_mutex_unlock(&buf->mutex);
-        
-    while (free_size < len)
+    need = (sizeof(trace_record_t) + len + TRACE_RECORD_ALIGN - 1) & ~(TRACE_RECORD_ALIGN - 1);
+    pos = ring->write_pos;
+    offset = pos & (ring->size - 1);
+    room = ring->size - offset;
+    total = (room < need) ? room + need : need;
+
+    while (pos + total - ring->read_cache > ring->size)
     {
-        usleep(10000);   // wait 10 millsecond
+        ring->read_cache = atomic_load_acquire(&ring->read_pos);
+        if (pos + total - ring->read_cache <= ring->size)
+            break;
 
-        // check whether no semaphore for work thread, obviously if semaphore's
-        // value is zero, its free space existe
-        sem_getvalue(buf->sem, &sem_value);
-        if (sem_value <= 0)
+        if (buf->overflow == QUEUE_OVERFLOW_DROP_NEWEST)
         {
-            pthread_mutex_lock(&buf->mutex);
-            free_size = async_ring_buf_get_free_space(buf);
-            pthread_mutex_unlock(&buf->mutex);
+            atomic_inc(&ring->lost);
+            return 0;
         }
-    }
 
-    pthread_mutex_lock(&buf->mutex);
-    if(buf->write_pos + len > buf->size)
-    {
-        memcpy(buf->start + buf->write_pos, string, buf->size - buf->write_pos);
-        memcpy(buf->start, string + buf->size - buf->write_pos, 
-            len - (buf->size - buf->write_pos));
+        if (buf->overflow != QUEUE_OVERFLOW_BLOCK)
+        {
+            trace_ring_reclaim(ring, ring->read_cache);
+            continue;
+        }
+
+        if (atomic_get(&buf->exit))
+            return 0;
+
+        event_count_notify(&buf->wakeup, 0);
+        key = event_count_prepare_wait(&ring->not_full);
+        if (pos + total - atomic_load_acquire(&ring->read_pos) <= ring->size)
+            event_count_cancel_wait(&ring->not_full);
+        else
+            event_count_wait(&ring->not_full, key);
     }
-    else
+
+    if (room < need)
     {
-        memcpy(buf->start + buf->write_pos, string, len);
+        record = (trace_record_t *)(ring->start + offset);
+        record->size = room;
+        record->len = TRACE_RECORD_PAD;
+        pos += room;
+        offset = 0;
     }
 
-    buf->write_pos += len;
-    if (buf->write_pos > buf->size)
+    record = (trace_record_t *)(ring->start + offset);
+    record->size = need;
+    record->len = len | kind;
+    record->stamp = stamp;
+    memcpy(record + 1, string, len);
+    atomic_store_release(&ring->write_pos, pos + need);
+
+    if (pos + need - ring->read_cache > ring->size / 2)
     {
-        buf->write_pos = buf->write_pos % buf->size;
-        buf->write_reverse++;
+        ring->read_cache = atomic_load_acquire(&ring->read_pos);
+        if (pos + need - ring->read_cache > ring->size / 2)
+            event_count_notify(&buf->wakeup, 0);
     }
 
-    pthread_mutex_unlock(&buf->mutex);
-    
-    sem_getvalue(buf->sem, &sem_value);
-    if (sem_value <= 0)
-        sem_post(buf->sem);         
+    return len;
+}
+
+/*
+ * "ring" and "stamp" from trace_ring_begin()
+ */
+static uint32_t
+trace_ring_write(async_ring_buf_t *buf, trace_ring_t *ring, const void *string, size_t len,
+    uint64_t stamp, uint32_t kind)
+{
+    uint32_t result;
+
+    result = trace_ring_put(buf, ring, string, len, stamp, kind);
+    trace_ring_end(ring);
+
+    return result;
+}
 
-    return free_size;
+uint32_t
+async_ring_buf_write(async_ring_buf_t *buf, char *string, size_t len)
+{
+    trace_ring_t *ring;
+    uint64_t stamp;
+
+    ring = trace_ring_begin(buf, &stamp);
+    if (ring == NULL)
+        return 0;
+
+    return trace_ring_write(buf, ring, string, len, stamp, 0);
 }
 
 //===========================================================================
@@ -307,34 +1032,72 @@ static char *get_level_str(uint32_t level)
     return NULL;        
 }
 
+/*
+ * "HH:MM:SS." of the last second this thread formatted, localtime_r()
+ * only runs when the second rolls over
+ */
+typedef struct _trace_time_cache
+{
+    time_t  sec;
+    char    prefix[16];
+} trace_time_cache_t;
+
+static __thread trace_time_cache_t trace_time_cache = {(time_t)-1, ""};
+
 static uint32_t
-get_timestamp_str(int level, char *buf, size_t len)
+get_timestamp_str(int level, struct timeval *timestamp, char *buf, size_t len)
 {
-    int             result;
-    struct tm       *tmTime;
-    struct timeval  timestamp;
+    trace_time_cache_t *cache = &trace_time_cache;
+    struct tm   tmTime;
+    const char  *level_str;
+    long        usec;
+    size_t      level_len;
+    int         i;
     
     if (len < 32)
         return 0;
-    
-    gettimeofday(&timestamp, NULL);
 
-    tmTime = (struct tm *)malloc(sizeof(struct tm));
-    tmTime = localtime_r((time_t *)&timestamp.tv_sec, tmTime);
-    
-    result = sprintf(buf, "%02d:%02d:%02d.%06ld %s ", 
-        tmTime->tm_hour, tmTime->tm_min, tmTime->tm_sec, timestamp.tv_usec,
-        get_level_str(level));
+    if (cache->sec != timestamp->tv_sec)
+    {
+        localtime_r(&timestamp->tv_sec, &tmTime);
+        snprintf(cache->prefix, sizeof(cache->prefix), "%02d:%02d:%02d.",
+            tmTime.tm_hour, tmTime.tm_min, tmTime.tm_sec);
+        cache->sec = timestamp->tv_sec;
+    }
 
-    free(tmTime);
+    memcpy(buf, cache->prefix, 9);
+    usec = timestamp->tv_usec;
+    for (i = 14; i >= 9; i--, usec /= 10)
+        buf[i] = '0' + usec % 10;
+    buf[15] = ' ';
 
-    return result;
+    level_str = get_level_str(level);
+    if (level_str == NULL)
+        level_str = "(null)";
+    level_len = strlen(level_str);
+    if (level_len > len - 18)
+        level_len = len - 18;
+    memcpy(buf + 16, level_str, level_len);
+    buf[16 + level_len] = ' ';
+    buf[17 + level_len] = '\0';
+
+    return 17 + level_len;
 }
 
 int
 async_trace_init(void)
 {
-    output = async_ring_buf_new(TRACE_MAX_BUF);
+    async_ring_buf_attr_t attr;
+
+    async_ring_buf_attr_init(&attr);
+
+    return async_trace_init_with_attr(&attr);
+}
+
+int
+async_trace_init_with_attr(const async_ring_buf_attr_t *attr)
+{
+    output = async_ring_buf_new_with_attr(attr);
     if (output == NULL)
         return -1;
 
@@ -346,47 +1109,131 @@ async_trace_destroy(void)
 {
     if (output)
         async_ring_buf_free(output);
+    output = NULL;
 }
 
 static void
 trace_args(int level, const char *format, va_list args)
 {
     char string[TRACE_LINE_MAX_SIZE];
+    struct timeval timestamp;
+    trace_ring_t *ring;
+    uint64_t stamp;
     int  len, result;
     
     if (output == NULL)
         return;
   
-    len = get_timestamp_str(level, string, sizeof(string));
+    // one clock read for the prefix and the print order
+    ring = trace_ring_begin(output, &stamp);
+    if (ring == NULL)
+        return;
+
+    timestamp.tv_sec = stamp / 1000000000ULL;
+    timestamp.tv_usec = (stamp % 1000000000ULL) / 1000;
+    len = get_timestamp_str(level, &timestamp, string, sizeof(string));
     if (len <= 0)
+    {
+        trace_ring_end(ring);
         return;       
+    }
 
     result = vsnprintf(string+len, (sizeof(string) - len), format, args);
-    if (result > (sizeof(string) - len))
-        result = sizeof(string) - len;
+    if (result > (int)(sizeof(string) - len - 1))
+        result = sizeof(string) - len - 1;     // truncated, not the NUL
 
     len += result;
-    if (len > 0)
-        async_ring_buf_write(output, string, len);
+    trace_ring_write(output, ring, string, len, stamp, 0);
 
     return;
 }
 
+/*
+ * binary mode: no formatting here, only the format and the raw arguments.
+ * A format we can't defer is formatted as text
+ */
+static void
+trace_binary(int level, const char *format, va_list args)
+{
+    uint64_t record[TRACE_LINE_MAX_SIZE / sizeof(uint64_t)];
+    trace_binary_t *head = (trace_binary_t *)record;
+    trace_ring_t *ring;
+    uint64_t stamp;
+    va_list copy;
+    int size;
+
+    if (output == NULL)
+        return;
+
+    head->format = format;
+    head->level = level;
+    head->reserved = 0;
+
+    va_copy(copy, args);
+    size = trace_pack(format, &copy, (char *)(head + 1), sizeof(record) - sizeof(trace_binary_t));
+    va_end(copy);
+
+    if (size < 0)
+    {
+        trace_args(level, format, args);
+        return;
+    }
+
+    ring = trace_ring_begin(output, &stamp);
+    if (ring)
+        trace_ring_write(output, ring, record, sizeof(trace_binary_t) + size, stamp,
+            TRACE_RECORD_BINARY);
+}
+
+static void
+trace_vprint(int level, const char *format, va_list args)
+{
+    if (output->binary)
+        trace_binary(level, format, args);
+    else
+        trace_args(level, format, args);
+}
+
 void
 trace(int level, const char *format, ...)
 {
     va_list args;
 
-    if (level < atomic_get(&output->level))
+    if (!trace_enabled(NULL, level))
         return;
 
     va_start(args, format);
-    trace_args(level, format, args);
+    trace_vprint(level, format, args);
+    va_end(args);    
+}
+
+/*
+ * for callers that have checked the level already, see TRACE_MODULE_LOG()
+ */
+void
+trace_print(int level, const char *format, ...)
+{
+    va_list args;
+
+    if (output == NULL)
+        return;
+
+    va_start(args, format);
+    trace_vprint(level, format, args);
     va_end(args);    
 }
 
 void
 trace_dump(int level, char *buffer, size_t size)
+{
+    if (!trace_enabled(NULL, level))
+        return;
+
+    trace_print_dump(level, buffer, size);
+}
+
+void
+trace_print_dump(int level, char *buffer, size_t size)
 {
     int           i;      // used to keep track of line lengths
     char *line;  // used to print char version of data
@@ -394,27 +1241,23 @@ trace_dump(int level, char *buffer, size_t size)
     
     if (output == NULL)
       return;
-
-    atomic_get(&output->level);        
-    if (output->level > level)
-      return;
     
-    trace(level, "JPU-DUMP: ");
+    trace_print(level, "JPU-DUMP: ");
     if (size > 512)
     {
-      trace(level, "buffer size is too big(%u bytes), now only display first 512 bytes.", size);
+      trace_print(level, "buffer size is too big(%u bytes), now only display first 512 bytes.", size);
       size = 512;
     }
-    trace(level, "\n");
+    trace_print(level, "\n");
     
     
     i = 0; 
     line = buffer; 
     
-    trace(level, "%08X | ", (int)buffer); // print the address we are pulling from
+    trace_print(level, "%08X | ", (int)buffer); // print the address we are pulling from
     while (size-- > 0)
     {
-      trace(level, "%02X ", *buffer++); // print each char
+      trace_print(level, "%02X ", *buffer++); // print each char
       if (!(++i % 16) || (size == 0 && i % 16))
       { 
         // if we come to the end of a line...
@@ -424,26 +1267,26 @@ trace_dump(int level, char *buffer, size_t size)
         {
           while (i++ % 16)
           { 
-            trace(level, "__ ");
+            trace_print(level, "__ ");
           }
         }
     
-        trace(level, "| ");
+        trace_print(level, "| ");
           
         while (line < buffer) // print the character version
         {  
           ch = *line++;
-          trace(level, "%c", (ch < 33 || ch == 255) ? 0x2E : ch);
+          trace_print(level, "%c", (ch < 33 || ch == 255) ? 0x2E : ch);
         }
           
         // If we are not on the last line, prefix the next line with the address.
         if (size > 0)
         {
-          trace(level, "\n%08X | ", (int)buffer);
+          trace_print(level, "\n%08X | ", (int)buffer);
         }
       }
     }
-    trace(level, "\n\n");
+    trace_print(level, "\n\n");
     
 }
 
@@ -457,3 +1300,11 @@ trace_adjust(int level)
     return;
 }
 
+void
+trace_module_adjust(trace_module_t *module, int level)
+{
+    assert(module);
+
+    atomic_set(&module->level, level);
+}
+
@@ -6,33 +6,88 @@
 #include <pthread.h>
 #include <fcntl.h>
 #include <sys/stat.h>
-#include <semaphore.h>
 #include "atomic.h"
+#include "common.h"
+#include "eventcount.h"
+#include "queue.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/*
+ * one ring per writing thread, single producer/single consumer: the thread
+ * appends records, the trace thread consumes them, so writing a line takes
+ * no lock. A ring lives as long as its buffer, once its thread is gone and
+ * it is drained the next thread registering adopts it.
+ * Lines of all rings print in stamp order; only a ring that stays full
+ * while another writer is stuck before publishing gets flushed out of order
+ */
+typedef struct _trace_ring trace_ring_t;
+struct _trace_ring
+{
+    char *              start;
+    uint32_t            size;           // power of 2
+    volatile int        in_use;         // a live thread writes into it
+    trace_ring_t *      next;
+    CACHE_LINE_PAD(pad0);
+
+    volatile uint32_t   write_pos;      // free running, written by the thread
+    uint32_t            read_cache;     // thread's view of read_pos
+    atomic_t            lost;           // lines dropped or overwritten, not reported yet
+    volatile uint64_t   pending;        // stamp of the line being written, 0 when idle
+    CACHE_LINE_PAD(pad1);
+
+    volatile uint32_t   read_pos;       // trace thread, and the writer overwriting
+    uint32_t            write_cache;    // trace thread's view of write_pos
+    uint32_t            peek_pos;       // trace thread, record it looks at
+    CACHE_LINE_PAD(pad2);
+
+    event_count_t       not_full;
+};
+
+/*
+ * a line that doesn't fit in its thread's ring follows "overflow":
+ *  - QUEUE_OVERFLOW_BLOCK, the default, waits for the trace thread to
+ *    print older lines, nothing is lost
+ *  - QUEUE_OVERFLOW_DROP_NEWEST drops the line
+ *  - QUEUE_OVERFLOW_DROP_OLDEST (or COALESCE) overwrites the oldest ones
+ * Dropping never waits, the trace thread prints how many lines were lost
+ */
+typedef struct _async_ring_buf_attr
+{
+    uint32_t            size;       // of each thread's ring, rounded up to a power of 2
+    queue_overflow_t    overflow;
+
+    /*
+     * trace() only stores the format and the raw arguments, strings copied,
+     * and the trace thread formats the line. The format must live until
+     * then, a literal does; %n and wide characters are formatted as text
+     */
+    int                 binary;
+} async_ring_buf_attr_t;
+
 typedef struct _async_ring_buffer
 {    
-    uint32_t        size;
-    char *          start;
+    uint32_t        size;       // of each thread's ring
+    queue_overflow_t overflow;
+    int             binary;
 
-    uint32_t        read_pos;
-    uint32_t        read_reverse;   // identify times read_pos reversed
-
-    uint32_t        write_pos;
-    uint32_t        write_reverse;  // identify times write_pos reversed
+    pthread_key_t   key;        // ring of the calling thread
+    pthread_mutex_t mutex;      // ring registration only
+    trace_ring_t * volatile rings;
 
     pthread_t       thread;
-    pthread_mutex_t mutex;
-    sem_t*          sem;
+    event_count_t   wakeup;     // trace thread, rung when a ring fills up
+    uint32_t        stalled;    // trace thread, passes a full ring couldn't drain
     atomic_t        exit;   // 0 - don't exit; 1 - thread exit
     atomic_t        level;
     
 } async_ring_buf_t;
 
+void async_ring_buf_attr_init(async_ring_buf_attr_t *attr);
 async_ring_buf_t* async_ring_buf_new(uint32_t size);
+async_ring_buf_t* async_ring_buf_new_with_attr(const async_ring_buf_attr_t *attr);
 void async_ring_buf_free(async_ring_buf_t *buf);
 uint32_t async_ring_buf_write(async_ring_buf_t *buf, char *string, size_t len);
 
@@ -45,38 +100,111 @@ uint32_t async_ring_buf_write(async_ring_buf_t *buf, char *string, size_t len);
 #define TRACE_WARNING_LEVEL  3
 #define TRACE_ERROR_LEVEL    6
 
+/*
+ * TRACE_* calls below TRACE_MIN_LEVEL compile to nothing, arguments
+ * included, e.g. -DTRACE_MIN_LEVEL=3 keeps warnings and errors only
+ */
+#ifndef TRACE_MIN_LEVEL
+#define TRACE_MIN_LEVEL      TRACE_DETAIL_LEVEL
+#endif
+
+/*
+ * a module's own runtime level, TRACE_INHERIT_LEVEL follows trace_adjust().
+ * A file traces through its module by replacing the default TRACE_MODULE
+ * before the TRACE_* calls:
+ *
+ *   #include "trace.h"
+ *
+ *   TRACE_MODULE_DEFINE(bus_trace, "bus");
+ *   #undef TRACE_MODULE
+ *   #define TRACE_MODULE (&bus_trace)
+ *
+ * or by defining it before the include, the module declared as
+ * "extern struct _trace_module bus_trace;"
+ */
+typedef struct _trace_module
+{
+    const char *        name;
+    volatile int32_t    level;
+} trace_module_t;
+
+#define TRACE_INHERIT_LEVEL  (-1)
+#define TRACE_MODULE_DEFINE(module, module_name) \
+    trace_module_t module = {module_name, TRACE_INHERIT_LEVEL}
+#define TRACE_MODULE_INIT(module, module_name) \
+    do {(module)->name = (module_name); (module)->level = TRACE_INHERIT_LEVEL;} while(0)
+
+#ifndef TRACE_MODULE
+#define TRACE_MODULE         ((trace_module_t *)NULL)
+#endif
+
+/*
+ * whether "level" passes both filters. Disabled calls cost a constant
+ * compare, or two relaxed loads, and never evaluate their arguments
+ */
+#define TRACE_ENABLED(module, level) \
+    ((level) >= TRACE_MIN_LEVEL && trace_enabled(module, level))
+
+#define TRACE_MODULE_LOG(module, level, format, ...) \
+    do { \
+        if (TRACE_ENABLED(module, level)) \
+            trace_print(level, format, ## __VA_ARGS__); \
+    } while(0)
+
 #define TRACE_SUPPORT_INIT()    do {async_trace_init();} while(0)
 #define TRACE_SUPPORT_UNINIT()      do {async_trace_destroy();} while(0)
 
 #define TRACE_ENTER_FUNCTION \
-    do {trace(TRACE_DETAIL_LEVEL, " %s\t%s:%d\n", \
+    TRACE_MODULE_LOG(TRACE_MODULE, TRACE_DETAIL_LEVEL, " %s\t%s:%d\n", \
         __FILE__, __FUNCTION__, __LINE__, \
-        "Entering"); \
-    } while(0)
+        "Entering")
 #define TRACE_EXIT_FUNCTION \
-    do {trace(TRACE_DETAIL_LEVEL, " %s\t%s:%d\n", \
+    TRACE_MODULE_LOG(TRACE_MODULE, TRACE_DETAIL_LEVEL, " %s\t%s:%d\n", \
         __FILE__, __FUNCTION__, __LINE__, \
-        "Exiting"); \
-    } while(0)
+        "Exiting")
     
-#define TRACE_DETAIL(format, ...)       do {trace(TRACE_DETAIL_LEVEL, format, ## __VA_ARGS__);} while(0)
-#define TRACE_DEBUG(format, ...)        do {trace(TRACE_DEBUG_LEVEL, format, ## __VA_ARGS__);} while(0)
-#define TRACE_TRACE(format, ...)        do {trace(TRACE_TRACE_LEVEL, format, ## __VA_ARGS__);} while(0) 
-#define TRACE_WARNING(format, ...)      do {trace(TRACE_WARNING_LEVEL, format, ## __VA_ARGS__);} while(0)
-#define TRACE_ERROR(format, ...)        do {trace(TRACE_ERROR_LEVEL, format, ## __VA_ARGS__);} while(0)
-#define TRACE_DEBUG_DUMP(buf, size)     do {trace_dump(TRACE_DEBUG_LEVEL, buf, size);} while(0)
-#define TRACE_TRACE_DUMP(buf, size)     do {trace_dump(TRACE_TRACE_LEVEL, buf, size);} while(0)
-#define TRACE_WARNING_DUMP(buf, size)   do {trace_dump(TRACE_WARNING_LEVEL, buf, size);} while(0)
-#define TRACE_ERROR_DUMP(buf, size)     do {trace_dump(TRACE_ERROR_LEVEL, buf, size);} while(0)
+#define TRACE_DETAIL(format, ...)       TRACE_MODULE_LOG(TRACE_MODULE, TRACE_DETAIL_LEVEL, format, ## __VA_ARGS__)
+#define TRACE_DEBUG(format, ...)        TRACE_MODULE_LOG(TRACE_MODULE, TRACE_DEBUG_LEVEL, format, ## __VA_ARGS__)
+#define TRACE_TRACE(format, ...)        TRACE_MODULE_LOG(TRACE_MODULE, TRACE_TRACE_LEVEL, format, ## __VA_ARGS__)
+#define TRACE_WARNING(format, ...)      TRACE_MODULE_LOG(TRACE_MODULE, TRACE_WARNING_LEVEL, format, ## __VA_ARGS__)
+#define TRACE_ERROR(format, ...)        TRACE_MODULE_LOG(TRACE_MODULE, TRACE_ERROR_LEVEL, format, ## __VA_ARGS__)
+#define TRACE_DEBUG_DUMP(buf, size) \
+    do {if (TRACE_ENABLED(TRACE_MODULE, TRACE_DEBUG_LEVEL)) trace_print_dump(TRACE_DEBUG_LEVEL, buf, size);} while(0)
+#define TRACE_TRACE_DUMP(buf, size) \
+    do {if (TRACE_ENABLED(TRACE_MODULE, TRACE_TRACE_LEVEL)) trace_print_dump(TRACE_TRACE_LEVEL, buf, size);} while(0)
+#define TRACE_WARNING_DUMP(buf, size) \
+    do {if (TRACE_ENABLED(TRACE_MODULE, TRACE_WARNING_LEVEL)) trace_print_dump(TRACE_WARNING_LEVEL, buf, size);} while(0)
+#define TRACE_ERROR_DUMP(buf, size) \
+    do {if (TRACE_ENABLED(TRACE_MODULE, TRACE_ERROR_LEVEL)) trace_print_dump(TRACE_ERROR_LEVEL, buf, size);} while(0)
 
 #define TRACE_ADJUST_LEVEL(level)       do {trace_adjust(level);} while(0)
 
 extern async_ring_buf_t *output;
 extern int async_trace_init(void);
+extern int async_trace_init_with_attr(const async_ring_buf_attr_t *attr);
 extern void async_trace_destroy(void);
 extern void trace(int level, const char *format, ...);
+extern void trace_print(int level, const char *format, ...);
 extern void trace_dump(int level, char *buffer, size_t size);
+extern void trace_print_dump(int level, char *buffer, size_t size);
 extern void trace_adjust(int level);
+extern void trace_module_adjust(trace_module_t *module, int level);
+
+static inline int
+trace_enabled(const trace_module_t *module, int level)
+{
+    int32_t min = TRACE_INHERIT_LEVEL;
+
+    if (output == NULL)
+        return 0;
+
+    if (module)
+        min = atomic_load_relaxed(&module->level);
+    if (min == TRACE_INHERIT_LEVEL)
+        min = atomic_load_relaxed(&output->level);
+
+    return level >= min;
+}
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,469 @@
+/*
+ * wspool.c
+ * Copyright by Zhang Shiyong, 2014. shiyong.zhang.cn@outlook.com
+ */
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "atomic.h"
+#include "objpool.h"
+#include "threadpool.h"
+#include "wspool.h"
+
+#define WS_POOL_DRAIN_MAX	32		// inbox tasks moved per lock
+
+static obj_pool_t *ws_task_pool;
+static pthread_once_t ws_task_pool_once = PTHREAD_ONCE_INIT;
+
+static __thread ws_worker_t *ws_current;
+
+static void
+ws_task_pool_init(void)
+{
+	ws_task_pool = obj_pool_new(sizeof(ws_task_t));
+}
+
+static int
+ws_deque_init(ws_deque_t *deque, uint32_t capacity)
+{
+	deque->top = 0;
+	deque->bottom = 0;
+	deque->mask = capacity - 1;
+	deque->buffer = (ws_task_t * volatile *)calloc(capacity, sizeof(ws_task_t *));
+
+	return deque->buffer ? 0 : -1;
+}
+
+static inline int64_t
+ws_deque_size(ws_deque_t *deque)
+{
+	return atomic_load_acquire(&deque->bottom) - atomic_load_acquire(&deque->top);
+}
+
+/*
+ * owner only
+ */
+static inline int
+ws_deque_push(ws_deque_t *deque, ws_task_t *task)
+{
+	int64_t bottom, top;
+
+	bottom = atomic_load_relaxed(&deque->bottom);
+	top = atomic_load_acquire(&deque->top);
+	if (bottom - top > deque->mask)
+		return -1;
+
+	atomic_store_relaxed(&deque->buffer[bottom & deque->mask], task);
+	atomic_store_release(&deque->bottom, bottom + 1);
+
+	return 0;
+}
+
+/*
+ * owner only, newest first
+ */
+static inline ws_task_t *
+ws_deque_take(ws_deque_t *deque)
+{
+	ws_task_t *task;
+	int64_t bottom, top;
+
+	bottom = atomic_load_relaxed(&deque->bottom) - 1;
+	atomic_store_relaxed(&deque->bottom, bottom);
+	atomic_fence();
+	top = atomic_load_relaxed(&deque->top);
+
+	if (top > bottom)
+	{
+		atomic_store_relaxed(&deque->bottom, bottom + 1);
+		return NULL;
+	}
+
+	task = atomic_load_relaxed(&deque->buffer[bottom & deque->mask]);
+	if (top == bottom)
+	{
+		// last one, race the thieves for it
+		if (!atomic_cas(&deque->top, top, top + 1))
+			task = NULL;
+		atomic_store_relaxed(&deque->bottom, bottom + 1);
+	}
+
+	return task;
+}
+
+/*
+ * any thread, oldest first. NULL when empty or when another thief won
+ */
+static inline ws_task_t *
+ws_deque_steal(ws_deque_t *deque)
+{
+	ws_task_t *task;
+	int64_t bottom, top;
+
+	top = atomic_load_acquire(&deque->top);
+	atomic_fence();
+	bottom = atomic_load_acquire(&deque->bottom);
+	if (top >= bottom)
+		return NULL;
+
+	task = atomic_load_relaxed(&deque->buffer[top & deque->mask]);
+	if (!atomic_cas(&deque->top, top, top + 1))
+		return NULL;
+
+	return task;
+}
+
+/*
+ * move tasks from victim's inbox into self's deque, return one to run
+ */
+static ws_task_t *
+ws_worker_drain(ws_worker_t *self, ws_worker_t *victim)
+{
+	ws_task_t *task, *next;
+	int count;
+
+	if (mpsc_queue_length(victim->inbox) == 0)
+		return NULL;
+
+	if (pthread_mutex_trylock(&victim->inbox_lock) != 0)
+		return NULL;
+
+	task = (ws_task_t *)mpsc_queue_try_pop(victim->inbox);
+	for (count = 1; task && count < WS_POOL_DRAIN_MAX; count++)
+	{
+		if (ws_deque_size(&self->deque) > self->deque.mask)
+			break;
+
+		next = (ws_task_t *)mpsc_queue_try_pop(victim->inbox);
+		if (next == NULL)
+			break;
+		ws_deque_push(&self->deque, next);
+	}
+	pthread_mutex_unlock(&victim->inbox_lock);
+
+	return task;
+}
+
+static ws_task_t *
+ws_worker_steal(ws_worker_t *self)
+{
+	ws_pool_t *pool = self->pool;
+	ws_worker_t *victim;
+	ws_task_t *task;
+	uint32_t start, index;
+
+	// xorshift, cheap and good enough to spread thieves over victims
+	self->seed ^= self->seed << 13;
+	self->seed ^= self->seed >> 17;
+	self->seed ^= self->seed << 5;
+	start = self->seed % pool->num_workers;
+
+	for (index = 0; index < pool->num_workers; index++)
+	{
+		victim = &pool->workers[(start + index) % pool->num_workers];
+		if (victim == self)
+			continue;
+
+		task = ws_deque_steal(&victim->deque);
+		if (task == NULL)
+			task = ws_worker_drain(self, victim);
+		if (task)
+			return task;
+	}
+
+	return NULL;
+}
+
+static int
+ws_pool_has_work(ws_pool_t *pool)
+{
+	uint32_t index;
+
+	for (index = 0; index < pool->num_workers; index++)
+	{
+		if (ws_deque_size(&pool->workers[index].deque) > 0
+			|| mpsc_queue_length(pool->workers[index].inbox) > 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * wake one parked worker other than "self", if any
+ */
+static void
+ws_pool_wake_one(ws_pool_t *pool, ws_worker_t *self)
+{
+	ws_worker_t *worker;
+	uint32_t start, index;
+
+	start = self ? self->index + 1 : 0;
+	for (index = 0; index < pool->num_workers; index++)
+	{
+		worker = &pool->workers[(start + index) % pool->num_workers];
+		if (worker != self && atomic_load_acquire(&worker->parked))
+		{
+			event_count_notify(&worker->wakeup, 0);
+			return;
+		}
+	}
+}
+
+static void
+ws_pool_destroy(ws_pool_t *pool)
+{
+	ws_worker_t *worker;
+	uint32_t index;
+
+	for (index = 0; index < pool->num_workers; index++)
+	{
+		worker = &pool->workers[index];
+		if (worker->inbox)
+			mpsc_queue_destroy(worker->inbox);
+		free((void *)worker->deque.buffer);
+		pthread_mutex_destroy(&worker->inbox_lock);
+		event_count_destroy(&worker->wakeup);
+	}
+
+	free(pool->workers);
+	free(pool);
+}
+
+static inline void
+ws_task_run(ws_task_t *task)
+{
+	(*task->func)(task->data, task->usr_data);
+	if (task->done)
+		(*task->done)(task->data);
+
+	obj_pool_free(ws_task_pool, task);
+}
+
+static void *
+ws_worker_main(void *arg)
+{
+	ws_worker_t *self = (ws_worker_t *)arg;
+	ws_pool_t *pool = self->pool;
+	ws_task_t *task;
+	uint32_t key;
+	int result;
+
+	if (self->cpu >= 0)
+	{
+		result = thread_pool_set_affinity(pthread_self(), &self->cpu, 1);
+		show_err2(result, "thread_pool_set_affinity");
+	}
+
+	ws_current = self;
+	for (;;)
+	{
+		task = ws_deque_take(&self->deque);
+		if (task == NULL)
+			task = ws_worker_drain(self, self);
+		if (task == NULL)
+			task = ws_worker_steal(self);
+
+		if (task)
+		{
+			// more work than this worker can run right now, get help
+			if (atomic_load_relaxed(&pool->parked) > 0
+				&& ws_deque_size(&self->deque) > 0)
+				ws_pool_wake_one(pool, self);
+
+			ws_task_run(task);
+			continue;
+		}
+
+		if (atomic_load_acquire(&pool->stopping) && !ws_pool_has_work(pool))
+			break;
+
+		atomic_inc(&pool->parked);
+		atomic_store_release(&self->parked, 1);
+		key = event_count_prepare_wait(&self->wakeup);
+		if (ws_pool_has_work(pool) || atomic_load_acquire(&pool->stopping))
+			event_count_cancel_wait(&self->wakeup);
+		else
+			event_count_wait(&self->wakeup, key);
+		atomic_store_release(&self->parked, 0);
+		atomic_dec(&pool->parked);
+	}
+
+	ws_current = NULL;
+	if (atomic_dec(&pool->running) == 0)
+		ws_pool_destroy(pool);
+
+	return NULL;
+}
+
+ws_pool_t *
+ws_pool_new(int num_workers)
+{
+	return ws_pool_new_with_cpus(num_workers, NULL, 0);
+}
+
+ws_pool_t *
+ws_pool_new_with_cpus(int num_workers, const int *cpus, uint32_t cpu_count)
+{
+	ws_pool_t *pool;
+	ws_worker_t *worker;
+	pthread_attr_t attr;
+	uint32_t index;
+	int result;
+
+	pthread_once(&ws_task_pool_once, ws_task_pool_init);
+	if (ws_task_pool == NULL)
+		return NULL;
+
+	if (num_workers <= 0)
+		num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (num_workers <= 0)
+		num_workers = 1;
+
+	pool = (ws_pool_t *)calloc(1, sizeof(ws_pool_t));
+	if (pool == NULL)
+	{
+		show_err2(errno, "calloc");
+		return NULL;
+	}
+
+	pool->num_workers = num_workers;
+	if (posix_memalign((void **)&pool->workers, CACHE_LINE_SIZE,
+		num_workers * sizeof(ws_worker_t)))
+	{
+		show_err2(ENOMEM, "posix_memalign");
+		free(pool);
+		return NULL;
+	}
+	memset(pool->workers, 0, num_workers * sizeof(ws_worker_t));
+
+	for (index = 0; index < pool->num_workers; index++)
+	{
+		worker = &pool->workers[index];
+		worker->pool = pool;
+		worker->index = index;
+		worker->seed = 2654435761u * (index + 1);
+		worker->cpu = (cpus && cpu_count) ? cpus[index % cpu_count] : -1;
+		pthread_mutex_init(&worker->inbox_lock, NULL);
+		event_count_init_exclusive(&worker->wakeup);
+
+		worker->inbox = mpsc_queue_new(WS_POOL_INBOX_CAPACITY);
+		if (worker->inbox == NULL
+			|| ws_deque_init(&worker->deque, WS_POOL_DEQUE_CAPACITY) != 0)
+		{
+			show_err2(ENOMEM, "ws_pool_new");
+			pool->num_workers = index + 1;
+			ws_pool_destroy(pool);
+			return NULL;
+		}
+	}
+
+	posix_check_cmd(pthread_attr_init(&attr));
+	posix_check_cmd(pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED));
+
+	pool->running = pool->num_workers;
+	for (index = 0; index < pool->num_workers; index++)
+	{
+		worker = &pool->workers[index];
+		result = pthread_create(&worker->thread, &attr, ws_worker_main, worker);
+		if (result != 0)
+		{
+			// the ones started take care of the queues, and of freeing
+			show_err2(result, "pthread_create");
+			if (atomic_sub(&pool->running, pool->num_workers - index) == 0)
+				ws_pool_destroy(pool);
+			else
+				ws_pool_free(pool);
+
+			posix_check_cmd(pthread_attr_destroy(&attr));
+			return NULL;
+		}
+	}
+
+	posix_check_cmd(pthread_attr_destroy(&attr));
+
+	return pool;
+}
+
+void
+ws_pool_submit(ws_pool_t *pool,
+	ws_func_t func, ws_done_t done, void *data, void *usr_data)
+{
+	ws_worker_t *self, *target;
+	ws_task_t *task;
+	uint32_t index, i;
+
+	assert(pool && func);
+
+	task = (ws_task_t *)obj_pool_alloc(ws_task_pool);
+	if (task == NULL)
+	{
+		// out of memory, run it here rather than losing it
+		(*func)(data, usr_data);
+		if (done)
+			(*done)(data);
+		return;
+	}
+
+	task->func = func;
+	task->done = done;
+	task->data = data;
+	task->usr_data = usr_data;
+
+	self = ws_current;
+	if (self && self->pool == pool)
+	{
+		// spawned by a task of this pool, stays local unless stolen
+		if (ws_deque_push(&self->deque, task) != 0)
+		{
+			ws_task_run(task);
+			return;
+		}
+
+		if (atomic_load_relaxed(&pool->parked) > 0)
+			ws_pool_wake_one(pool, self);
+		return;
+	}
+
+	// spread outside submits, skipping full inboxes when we can
+	index = atomic_inc(&pool->next);
+	for (i = 0; i < pool->num_workers; i++)
+	{
+		target = &pool->workers[(index + i) % pool->num_workers];
+		if (mpsc_queue_try_push(target->inbox, task) == 0)
+			break;
+	}
+	if (i == pool->num_workers)
+	{
+		// every inbox full, wait for room
+		target = &pool->workers[index % pool->num_workers];
+		mpsc_queue_push(target->inbox, task);
+	}
+
+	atomic_fence();
+	if (atomic_load_acquire(&target->parked))
+		event_count_notify(&target->wakeup, 0);
+	else if (atomic_load_relaxed(&pool->parked) > 0)
+		ws_pool_wake_one(pool, target);
+}
+
+void
+ws_pool_free(ws_pool_t *pool)
+{
+	uint32_t index;
+
+	assert(pool);
+
+	// hold the pool, the last worker must not free it under our feet
+	atomic_inc(&pool->running);
+	atomic_store_release(&pool->stopping, 1);
+	atomic_fence();
+
+	for (index = 0; index < pool->num_workers; index++)
+		event_count_notify(&pool->workers[index].wakeup, 0);
+
+	if (atomic_dec(&pool->running) == 0)
+		ws_pool_destroy(pool);
+}
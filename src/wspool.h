@@ -0,0 +1,109 @@
+/*
+ * wspool.h
+ * Copyright by Zhang Shiyong, 2014. shiyong.zhang.cn@outlook.com
+ */
+
+#ifndef _WS_POOL_H_
+#define _WS_POOL_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include "common.h"
+#include "eventcount.h"
+#include "mpscqueue.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define WS_POOL_DEQUE_CAPACITY		1024	// per worker, power of 2
+#define WS_POOL_INBOX_CAPACITY		4096	// per worker, tasks from other threads
+
+typedef void (*ws_func_t)(void *data, void *usr_data);	// same as exec_t
+typedef void (*ws_done_t)(void *data);					// same as done_t
+
+typedef struct _ws_task
+{
+	ws_func_t		func;
+	ws_done_t		done;
+	void *			data;
+	void *			usr_data;
+} ws_task_t;
+
+/*
+ * Chase-Lev deque, the owner pushes and takes at the bottom, thieves steal
+ * at the top
+ */
+typedef struct _ws_deque
+{
+	volatile int64_t	top;
+	CACHE_LINE_PAD(pad0);
+	volatile int64_t	bottom;
+	int64_t				mask;
+	ws_task_t * volatile *buffer;
+} ws_deque_t;
+
+typedef struct _ws_pool ws_pool_t;
+
+typedef struct _ws_worker
+{
+	ws_pool_t *			pool;
+	pthread_t			thread;
+	uint32_t			index;
+	uint32_t			seed;		// victim selection
+	int					cpu;		// pinned to, -1 runs anywhere
+
+	ws_deque_t			deque;
+
+	/*
+	 * tasks submitted from outside the pool land here, whoever holds
+	 * "inbox_lock" (the owner or a thief) moves them into its own deque
+	 */
+	mpsc_queue_t *		inbox;
+	pthread_mutex_t		inbox_lock;
+
+	event_count_t		wakeup;		// only this worker ever waits on it
+	volatile int		parked;
+} __attribute__((aligned(CACHE_LINE_SIZE))) ws_worker_t;
+
+/*
+ * Work-stealing pool. Each worker runs tasks from its own deque without
+ * any lock, idle workers steal from random victims, and a worker with
+ * nothing to do parks on its own event count so it is woken individually
+ * rather than through one shared condition. Can serve one slot or be
+ * shared by many, every task carries its own function.
+ */
+struct _ws_pool
+{
+	uint32_t			num_workers;
+	ws_worker_t *		workers;
+
+	volatile uint32_t	next;		// round robin for outside submits
+	volatile int32_t	parked;
+	volatile int32_t	running;
+	volatile int		stopping;
+};
+
+ws_pool_t *ws_pool_new(int num_workers);	// 0 means one per online CPU
+
+/*
+ * same, worker i pinned to cpus[i % cpu_count]. NULL or 0 CPUs leaves
+ * them unpinned
+ */
+ws_pool_t *ws_pool_new_with_cpus(int num_workers, const int *cpus, uint32_t cpu_count);
+void ws_pool_submit(ws_pool_t *pool,
+	ws_func_t func, ws_done_t done, void *data, void *usr_data);
+
+/*
+ * workers finish every queued task, then exit, the last one frees the pool.
+ * Returns at once, nothing may be submitted from outside afterwards
+ */
+void ws_pool_free(ws_pool_t *pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _WS_POOL_H_ */
+
+// ~ end
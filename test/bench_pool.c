@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sched.h>
+#include "threadpool.h"
+
+#define MAX_WORKERS     32
+#define PRODUCERS       4
+#define TASK_SPIN       200     // busy loop per task, a small handler
+
+static volatile long done_count;
+
+static void
+task_exec(void *data, void *usr_data)
+{
+    volatile int spin;
+
+    for (spin = 0; spin < TASK_SPIN; spin++)
+        ;
+
+    __sync_add_and_fetch(&done_count, 1);
+}
+
+typedef struct _producer
+{
+    pthread_t       thread;
+    thread_pool_t   *pool;
+    size_t          count;
+} producer_t;
+
+static void *
+producer_worker(void *arg)
+{
+    producer_t *producer = (producer_t *)arg;
+    size_t index;
+
+    for (index = 0; index < producer->count; index++)
+        thread_pool_push(producer->pool, producer);
+
+    return NULL;
+}
+
+static double
+now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * PRODUCERS threads push "count" tasks each into a pool of "workers"
+ * threads, measure until every task has run
+ */
+static double
+bench_run(thread_pool_mode_t mode, int workers, size_t count)
+{
+    thread_pool_attr_t attr;
+    thread_pool_t   *pool;
+    producer_t      producers[PRODUCERS];
+    double          start, elapsed;
+    int             i;
+
+    thread_pool_attr_init(&attr);
+    attr.mode = mode;
+    attr.max_threads = workers;
+
+    pool = thread_pool_new_with_attr(task_exec, NULL, &attr);
+    if (pool == NULL)
+        return 0;
+
+    done_count = 0;
+    start = now_sec();
+    for (i = 0; i < PRODUCERS; i++)
+    {
+        producers[i].pool = pool;
+        producers[i].count = count;
+        pthread_create(&producers[i].thread, NULL, producer_worker, &producers[i]);
+    }
+    for (i = 0; i < PRODUCERS; i++)
+        pthread_join(producers[i].thread, NULL);
+
+    while (done_count < (long)(count * PRODUCERS))
+        sched_yield();
+    elapsed = now_sec() - start;
+
+    thread_pool_free(pool);
+
+    return (count * PRODUCERS) / elapsed;
+}
+
+int
+main(int argc, char **argv)
+{
+    size_t count;
+    int workers;
+
+    count = (argc > 1) ? strtoul(argv[1], NULL, 10) : 200000;
+
+    fprintf(stdout, "%-10s %16s %16s\n", "workers", "queue(task/s)", "steal(task/s)");
+    for (workers = 1; workers <= MAX_WORKERS; workers <<= 1)
+    {
+        fprintf(stdout, "%-10d %16.0f %16.0f\n", workers,
+            bench_run(THREAD_POOL_QUEUE, workers, count),
+            bench_run(THREAD_POOL_STEAL, workers, count));
+    }
+
+    return 0;
+}
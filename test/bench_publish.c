@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "tinybus.h"
+#include "slot.h"
+#include "message.h"
+
+#define MAX_PRODUCERS   32
+#define BURST           64
+
+typedef struct _producer
+{
+    pthread_t       thread;
+    tiny_bus_t      *bus;
+    tiny_msg_t      *msgs;
+    size_t          count;
+    size_t          burst;      // 0 - slot_publish() one by one
+} producer_t;
+
+static void *
+producer_worker(void *arg)
+{
+    producer_t *producer = (producer_t *)arg;
+    tiny_msg_t *burst[BURST];
+    size_t index, num, i;
+
+    if (producer->burst == 0)
+    {
+        for (index = 0; index < producer->count; index++)
+            slot_publish(producer->bus, &producer->msgs[index]);
+
+        return NULL;
+    }
+
+    for (index = 0; index < producer->count; index += num)
+    {
+        num = producer->count - index;
+        num = (num < producer->burst) ? num : producer->burst;
+        for (i = 0; i < num; i++)
+            burst[i] = &producer->msgs[index + i];
+
+        slot_publish_batch(producer->bus, burst, num);
+    }
+
+    return NULL;
+}
+
+static double
+now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * publish "count" messages from each of "num" producers into a bus without
+ * subscribers, and measure until the bus thread has drained all of them
+ */
+static uint32_t dispatchers = 1;
+
+static double
+bench_run(tiny_bus_ingress_t ingress, int num, size_t count, size_t burst)
+{
+    tiny_bus_attr_t attr;
+    tiny_bus_t      *bus;
+    tiny_msg_priv_t priv;
+    producer_t      producers[MAX_PRODUCERS];
+    double          start, elapsed;
+    size_t          index;
+    int             i;
+
+    tiny_bus_attr_init(&attr);
+    attr.ingress = ingress;
+    attr.dispatchers = dispatchers;
+
+    bus = tiny_bus_new_with_attr(&attr);
+    if (bus == NULL)
+        return 0;
+
+    memset(&priv, 0, sizeof(priv));
+    for (i = 0; i < num; i++)
+    {
+        producers[i].bus = bus;
+        producers[i].count = count;
+        producers[i].burst = burst;
+        producers[i].msgs = (tiny_msg_t *)calloc(count, sizeof(tiny_msg_t));
+        for (index = 0; index < count; index++)
+        {
+            // one ID per producer, so several dispatchers share the load
+            producers[i].msgs[index].msg_id = BUS_MSG_TRACE + i;
+            producers[i].msgs[index].msg_priv = &priv;
+        }
+    }
+
+    start = now_sec();
+    for (i = 0; i < num; i++)
+        pthread_create(&producers[i].thread, NULL, producer_worker, &producers[i]);
+    for (i = 0; i < num; i++)
+        pthread_join(producers[i].thread, NULL);
+
+    // bus thread exits after everything published before is consumed
+    tiny_bus_destroy(bus);
+    elapsed = now_sec() - start;
+
+    for (i = 0; i < num; i++)
+        free(producers[i].msgs);
+
+    return (num * count) / elapsed;
+}
+
+int
+main(int argc, char **argv)
+{
+    size_t count;
+    int num;
+
+    count = (argc > 1) ? strtoul(argv[1], NULL, 10) : 200000;
+    dispatchers = (argc > 2) ? strtoul(argv[2], NULL, 10) : 1;
+
+    fprintf(stdout, "%-10s %16s %16s %16s %16s\n", "producers",
+        "queue(msg/s)", "ring(msg/s)", "queue-batch", "ring-batch");
+    for (num = 1; num <= MAX_PRODUCERS; num <<= 1)
+    {
+        fprintf(stdout, "%-10d %16.0f %16.0f %16.0f %16.0f\n", num,
+            bench_run(TINY_BUS_INGRESS_QUEUE, num, count, 0),
+            bench_run(TINY_BUS_INGRESS_RING, num, count, 0),
+            bench_run(TINY_BUS_INGRESS_QUEUE, num, count, BURST),
+            bench_run(TINY_BUS_INGRESS_RING, num, count, BURST));
+    }
+
+    return 0;
+}
@@ -2,3 +2,9 @@
 
 gcc -g -o test_trace test_trace.c -I/home/zhangsy/usr/x86/debug/tinybus/include -L/home/zhangsy/usr/x86/debug/tinybus/lib -ltinybus -lpthread -lrt
 gcc -g -o test_bus test_bus.c -I. -I/home/zhangsy/usr/x86/debug/tinybus/include -L/home/zhangsy/usr/x86/debug/tinybus/lib -ltinybus -lpthread -lrt
+gcc -g -o test_overflow test_overflow.c -I. -I/home/zhangsy/usr/x86/debug/tinybus/include -L/home/zhangsy/usr/x86/debug/tinybus/lib -ltinybus -lpthread -lrt
+gcc -g -o test_conflate test_conflate.c -I. -I/home/zhangsy/usr/x86/debug/tinybus/include -L/home/zhangsy/usr/x86/debug/tinybus/lib -ltinybus -lpthread -lrt
+gcc -g -o test_timer test_timer.c -I. -I/home/zhangsy/usr/x86/debug/tinybus/include -L/home/zhangsy/usr/x86/debug/tinybus/lib -ltinybus -lpthread -lrt
+gcc -g -o test_request test_request.c -I. -I/home/zhangsy/usr/x86/debug/tinybus/include -L/home/zhangsy/usr/x86/debug/tinybus/lib -ltinybus -lpthread -lrt
+gcc -g -O2 -o bench_publish bench_publish.c -I. -I/home/zhangsy/usr/x86/debug/tinybus/include -L/home/zhangsy/usr/x86/debug/tinybus/lib -ltinybus -lpthread -lrt
+gcc -g -O2 -o bench_pool bench_pool.c -I. -I/home/zhangsy/usr/x86/debug/tinybus/include -L/home/zhangsy/usr/x86/debug/tinybus/lib -ltinybus -lpthread -lrt
@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "tinybus.h"
+#include "slot.h"
+#include "message.h"
+
+#define TEST_MSG_HOLD       BUS_MESSAGE_BASE_ID + 10    // keeps the worker busy
+#define TEST_MSG_LATEST     BUS_MESSAGE_BASE_ID + 11    // one key
+#define TEST_MSG_PARITY     BUS_MESSAGE_BASE_ID + 12    // keyed by value parity
+
+#define PUBLISHES           100     // of each conflated ID
+
+#define CHECK(cond)                                                     \
+    do {                                                                \
+        if (!(cond))                                                    \
+        {                                                               \
+            fprintf(stderr, "%s:%d: %s: check failed: %s\n",            \
+                __FILE__, __LINE__, test_name, #cond);                  \
+            failures++;                                                 \
+        }                                                               \
+    } while (0)
+
+static const char *test_name;
+static int failures;
+
+// the worker waits in the hold message until the gate opens
+static pthread_mutex_t gate_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gate_cond = PTHREAD_COND_INITIALIZER;
+static int gate_open, worker_waiting;
+
+static volatile int handled_count;
+static int latest_count, latest_value;
+static int parity_count, parity_value[2];
+
+static volatile int freed_count;
+static int written_count;
+
+static void
+test_reset(const char *name)
+{
+    test_name = name;
+
+    gate_open = 0;
+    worker_waiting = 0;
+    handled_count = 0;
+    latest_count = 0;
+    latest_value = -1;
+    parity_count = 0;
+    parity_value[0] = parity_value[1] = -1;
+    freed_count = 0;
+    written_count = 0;
+}
+
+static void
+msg_exec(void *data, void *usr_data)
+{
+    tiny_msg_t *msg = (tiny_msg_t *)data;
+    int value = *(int *)msg->msg_priv->data;
+
+    if (msg->msg_id == TEST_MSG_HOLD)
+    {
+        pthread_mutex_lock(&gate_mutex);
+        worker_waiting = 1;
+        pthread_cond_broadcast(&gate_cond);
+        while (!gate_open)
+            pthread_cond_wait(&gate_cond, &gate_mutex);
+        pthread_mutex_unlock(&gate_mutex);
+    }
+    else if (msg->msg_id == TEST_MSG_LATEST)
+    {
+        latest_count++;
+        latest_value = value;
+    }
+    else
+    {
+        parity_count++;
+        parity_value[value & 1] = value;
+    }
+
+    __sync_add_and_fetch(&handled_count, 1);
+}
+
+static msg_result_t
+msg_handler(slot_t *slot, tiny_msg_t *msg)
+{
+    return 0;
+}
+
+static uint32_t
+parity_key(tiny_msg_t *msg)
+{
+    return *(int *)msg->msg_priv->data & 1;
+}
+
+static void
+value_free(void *data)
+{
+    free(data);
+    __sync_add_and_fetch(&freed_count, 1);
+}
+
+static tiny_msg_t *
+value_msg(message_id_t id, int value)
+{
+    int *data;
+
+    data = (int *)malloc(sizeof(int));
+    *data = value;
+    written_count++;
+
+    return tiny_msg_alloc(id, data, sizeof(int), value_free);
+}
+
+/*
+ * with the worker held, PUBLISHES messages of each conflated ID are
+ * published through a direct bus: only the latest of each key may run
+ */
+static void
+test_conflate(const char *name, thread_pool_mode_t mode, uint32_t flags)
+{
+    message_id_t ids[] = { TEST_MSG_HOLD, TEST_MSG_LATEST, TEST_MSG_PARITY };
+    tiny_bus_attr_t bus_attr;
+    slot_attr_t attr;
+    tiny_bus_t *bus;
+    slot_t *slot;
+    int value;
+
+    test_reset(name);
+
+    tiny_bus_attr_init(&bus_attr);
+    bus_attr.direct = 1;
+    bus = tiny_bus_new_with_attr(&bus_attr);
+    tiny_bus_init_msg_ids(bus, ids, sizeof(ids) / sizeof(ids[0]));
+
+    slot_attr_init(&attr);
+    attr.pool.mode = mode;
+    attr.pool.max_threads = 1;
+    attr.flags = flags;
+    slot = slot_new_with_attr("conflate", 0, msg_exec, NULL, &attr);
+    CHECK(slot != NULL);
+    if (slot == NULL)
+    {
+        tiny_bus_destroy(bus);
+        return;
+    }
+
+    slot_subscribe_message(bus, slot, TEST_MSG_HOLD, msg_handler);
+    slot_subscribe_conflated(bus, slot, TEST_MSG_LATEST, msg_handler, NULL);
+    slot_subscribe_conflated(bus, slot, TEST_MSG_PARITY, msg_handler, parity_key);
+
+    slot_publish(bus, value_msg(TEST_MSG_HOLD, 0));
+    pthread_mutex_lock(&gate_mutex);
+    while (!worker_waiting)
+        pthread_cond_wait(&gate_cond, &gate_mutex);
+    pthread_mutex_unlock(&gate_mutex);
+
+    for (value = 0; value < PUBLISHES; value++)
+    {
+        CHECK(slot_publish(bus, value_msg(TEST_MSG_LATEST, value)) == TINY_BUS_SUCCEED);
+        CHECK(slot_publish(bus, value_msg(TEST_MSG_PARITY, value)) == TINY_BUS_SUCCEED);
+    }
+
+    // all but the waiting one of each key were replaced and released
+    CHECK(slot->conflated == (PUBLISHES - 1) + (PUBLISHES - 2));
+    CHECK(freed_count == slot->conflated);
+
+    pthread_mutex_lock(&gate_mutex);
+    gate_open = 1;
+    pthread_cond_broadcast(&gate_cond);
+    pthread_mutex_unlock(&gate_mutex);
+
+    while (handled_count < 4)
+        usleep(1000);
+    usleep(20000);
+
+    CHECK(handled_count == 4);
+    CHECK(latest_count == 1);
+    CHECK(latest_value == PUBLISHES - 1);
+    CHECK(parity_count == 2);
+    CHECK(parity_value[0] == PUBLISHES - 2);
+    CHECK(parity_value[1] == PUBLISHES - 1);
+
+    slot_unsubscribe_message(bus, slot, TEST_MSG_HOLD);
+    slot_unsubscribe_message(bus, slot, TEST_MSG_LATEST);
+    slot_unsubscribe_message(bus, slot, TEST_MSG_PARITY);
+    tiny_bus_destroy(bus);
+    slot_free(slot);
+
+    CHECK(freed_count == written_count);
+}
+
+int
+main(int argc, char **argv)
+{
+    test_conflate("queue", THREAD_POOL_QUEUE, 0);
+    test_conflate("ring", THREAD_POOL_RING, 0);
+    test_conflate("strand", THREAD_POOL_QUEUE, SLOT_EXECUTOR);
+
+    if (failures)
+    {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    fprintf(stdout, "all conflation tests passed\n");
+
+    return 0;
+}
@@ -0,0 +1,380 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include "tinybus.h"
+#include "slot.h"
+#include "message.h"
+
+#define TEST_MSG_ODD        BUS_MESSAGE_BASE_ID + 10
+#define TEST_MSG_EVEN       BUS_MESSAGE_BASE_ID + 11
+
+#define CAPACITY            4
+#define WRITES              10      // after the one the worker holds
+
+#define CHECK(cond)                                                     \
+    do {                                                                \
+        if (!(cond))                                                    \
+        {                                                               \
+            fprintf(stderr, "%s:%d: %s: check failed: %s\n",            \
+                __FILE__, __LINE__, test_name, #cond);                  \
+            failures++;                                                 \
+        }                                                               \
+    } while (0)
+
+static const char *test_name;
+static int failures;
+
+// the worker waits in its first message until the gate opens
+static pthread_mutex_t gate_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gate_cond = PTHREAD_COND_INITIALIZER;
+static int gate_open, worker_waiting;
+
+static volatile int handled_count;
+static int handled[WRITES + 1];
+
+static volatile int freed_count;
+static volatile int written_count;
+
+static void
+gate_reset(void)
+{
+    pthread_mutex_lock(&gate_mutex);
+    gate_open = 0;
+    worker_waiting = 0;
+    pthread_mutex_unlock(&gate_mutex);
+
+    handled_count = 0;
+    freed_count = 0;
+    written_count = 0;
+    memset(handled, 0xff, sizeof(handled));
+}
+
+static void
+gate_wait_worker(void)
+{
+    pthread_mutex_lock(&gate_mutex);
+    while (!worker_waiting)
+        pthread_cond_wait(&gate_cond, &gate_mutex);
+    pthread_mutex_unlock(&gate_mutex);
+}
+
+static void
+gate_release(void)
+{
+    pthread_mutex_lock(&gate_mutex);
+    gate_open = 1;
+    pthread_cond_broadcast(&gate_cond);
+    pthread_mutex_unlock(&gate_mutex);
+}
+
+static void
+msg_exec(void *data, void *usr_data)
+{
+    tiny_msg_t *msg = (tiny_msg_t *)data;
+    int index;
+
+    pthread_mutex_lock(&gate_mutex);
+    worker_waiting = 1;
+    pthread_cond_broadcast(&gate_cond);
+    while (!gate_open)
+        pthread_cond_wait(&gate_cond, &gate_mutex);
+    pthread_mutex_unlock(&gate_mutex);
+
+    index = handled_count;
+    if (index <= WRITES)
+        handled[index] = *(int *)msg->msg_priv->data;
+    __sync_add_and_fetch(&handled_count, 1);
+}
+
+static void
+value_free(void *data)
+{
+    free(data);
+    __sync_add_and_fetch(&freed_count, 1);
+}
+
+/*
+ * pooled message carrying "value", odd and even values have their own ID
+ * so COALESCE has two keys to work with
+ */
+static tiny_msg_t *
+value_msg(int value)
+{
+    int *data;
+
+    data = (int *)malloc(sizeof(int));
+    *data = value;
+    written_count++;
+
+    return tiny_msg_alloc((value & 1) ? TEST_MSG_ODD : TEST_MSG_EVEN,
+        data, sizeof(int), value_free);
+}
+
+static void
+wait_handled(int count)
+{
+    while (handled_count < count)
+        usleep(1000);
+}
+
+static slot_t *
+bounded_slot_new(thread_pool_mode_t mode, queue_overflow_t overflow, uint32_t lanes)
+{
+    slot_attr_t attr;
+
+    slot_attr_init(&attr);
+    attr.pool.mode = mode;
+    attr.pool.max_threads = 1;
+    attr.pool.capacity = CAPACITY;
+    attr.pool.ring_capacity = CAPACITY;
+    attr.pool.overflow = overflow;
+    attr.pool.lanes = lanes;
+
+    return slot_new_with_attr("overflow", 0, msg_exec, NULL, &attr);
+}
+
+/*
+ * the worker holds message 0 while 1..WRITES are written into its full
+ * queue, "expected" are the values it handles once the gate opens
+ */
+static void
+test_policy(const char *name, thread_pool_mode_t mode, queue_overflow_t overflow,
+    uint32_t lanes, const int *expected, int expected_count)
+{
+    tiny_msg_t *msg;
+    slot_t *slot;
+    int value, drops = 0, index;
+
+    test_name = name;
+    gate_reset();
+
+    slot = bounded_slot_new(mode, overflow, lanes);
+    CHECK(slot != NULL);
+    if (slot == NULL)
+        return;
+
+    for (value = 0; value <= WRITES; value++)
+    {
+        // what the bus does before writing into a slot
+        msg = value_msg(value);
+        msg->msg_priv->ref_count = 1;
+
+        if (slot_write(slot, msg) == TINY_BUS_DROPPED)
+            drops++;
+        if (value == 0)
+            gate_wait_worker();
+    }
+
+    // every write past the first CAPACITY ones dropped a message
+    CHECK(drops == WRITES - CAPACITY);
+    CHECK(slot->msg_pool->dropped == WRITES - CAPACITY);
+
+    gate_release();
+    wait_handled(expected_count);
+    slot_free(slot);
+
+    CHECK(handled_count == expected_count);
+    for (index = 0; index < expected_count; index++)
+        CHECK(handled[index] == expected[index]);
+
+    // kept or dropped, every message was released exactly once
+    CHECK(freed_count == written_count);
+}
+
+static void *
+block_writer(void *arg)
+{
+    slot_t *slot = (slot_t *)arg;
+    tiny_msg_t *msg;
+    int value, drops = 0;
+
+    for (value = 0; value <= WRITES; value++)
+    {
+        msg = value_msg(value);
+        msg->msg_priv->ref_count = 1;
+        if (slot_write(slot, msg) == TINY_BUS_DROPPED)
+            drops++;
+    }
+
+    return (void *)(intptr_t)drops;
+}
+
+/*
+ * BLOCK keeps everything, the writer waits for room instead
+ */
+static void
+test_block(void)
+{
+    pthread_t thread;
+    slot_t *slot;
+    void *drops;
+    int index;
+
+    test_name = "block";
+    gate_reset();
+
+    slot = bounded_slot_new(THREAD_POOL_QUEUE, QUEUE_OVERFLOW_BLOCK, 0);
+    CHECK(slot != NULL);
+    if (slot == NULL)
+        return;
+
+    pthread_create(&thread, NULL, block_writer, slot);
+    gate_wait_worker();
+
+    // one held, CAPACITY queued and the writer stuck on the next one
+    usleep(50000);
+    CHECK(written_count == CAPACITY + 2);
+
+    gate_release();
+    pthread_join(thread, &drops);
+    wait_handled(WRITES + 1);
+    slot_free(slot);
+
+    CHECK(drops == NULL);
+    CHECK(handled_count == WRITES + 1);
+    for (index = 0; index <= WRITES; index++)
+        CHECK(handled[index] == index);
+    CHECK(freed_count == written_count);
+}
+
+static msg_result_t
+msg_handler(slot_t *slot, tiny_msg_t *msg)
+{
+    return 0;
+}
+
+/*
+ * a direct bus writes into the subscriber in slot_publish(), which reports
+ * the subscriber's drop
+ */
+static void
+test_direct_publish(void)
+{
+    static const int expected[] = { 0, 1, 2, 3, 4 };
+    message_id_t ids[] = { TEST_MSG_ODD, TEST_MSG_EVEN };
+    tiny_bus_attr_t bus_attr;
+    tiny_bus_t *bus;
+    slot_t *slot;
+    int value, drops = 0, index;
+
+    test_name = "direct publish";
+    gate_reset();
+
+    tiny_bus_attr_init(&bus_attr);
+    bus_attr.direct = 1;
+    bus = tiny_bus_new_with_attr(&bus_attr);
+    tiny_bus_init_msg_ids(bus, ids, sizeof(ids) / sizeof(ids[0]));
+
+    slot = bounded_slot_new(THREAD_POOL_QUEUE, QUEUE_OVERFLOW_DROP_NEWEST, 0);
+    slot_subscribe_message(bus, slot, TEST_MSG_ODD, msg_handler);
+    slot_subscribe_message(bus, slot, TEST_MSG_EVEN, msg_handler);
+
+    for (value = 0; value <= WRITES; value++)
+    {
+        if (slot_publish(bus, value_msg(value)) == TINY_BUS_DROPPED)
+            drops++;
+        if (value == 0)
+            gate_wait_worker();
+    }
+
+    CHECK(drops == WRITES - CAPACITY);
+    CHECK(slot->msg_pool->dropped == WRITES - CAPACITY);
+
+    gate_release();
+    wait_handled(CAPACITY + 1);
+    slot_unsubscribe_message(bus, slot, TEST_MSG_ODD);
+    slot_unsubscribe_message(bus, slot, TEST_MSG_EVEN);
+    slot_free(slot);
+    tiny_bus_destroy(bus);
+
+    CHECK(handled_count == CAPACITY + 1);
+    for (index = 0; index <= CAPACITY; index++)
+        CHECK(handled[index] == expected[index]);
+    CHECK(freed_count == written_count);
+}
+
+/*
+ * a bounded ingress behind a stuck subscriber: slot_publish() reports what
+ * the ingress refused, the rest is delivered
+ */
+static void
+test_ingress(void)
+{
+    message_id_t ids[] = { TEST_MSG_ODD, TEST_MSG_EVEN };
+    tiny_bus_attr_t bus_attr;
+    tiny_bus_t *bus;
+    slot_t *slot;
+    int value, drops = 0;
+
+    test_name = "ingress";
+    gate_reset();
+
+    tiny_bus_attr_init(&bus_attr);
+    bus_attr.dispatchers = 1;
+    bus_attr.queue_capacity = CAPACITY;
+    bus_attr.ingress_overflow = QUEUE_OVERFLOW_DROP_NEWEST;
+    bus = tiny_bus_new_with_attr(&bus_attr);
+    tiny_bus_init_msg_ids(bus, ids, sizeof(ids) / sizeof(ids[0]));
+
+    slot = bounded_slot_new(THREAD_POOL_QUEUE, QUEUE_OVERFLOW_BLOCK, 0);
+    slot_subscribe_message(bus, slot, TEST_MSG_ODD, msg_handler);
+    slot_subscribe_message(bus, slot, TEST_MSG_EVEN, msg_handler);
+
+    for (value = 0; value <= 10 * WRITES; value++)
+    {
+        if (slot_publish(bus, value_msg(value)) == TINY_BUS_DROPPED)
+            drops++;
+        if (value == 0)
+            gate_wait_worker();
+    }
+
+    CHECK(drops > 0);
+
+    gate_release();
+    wait_handled(written_count - drops);
+    usleep(50000);
+    CHECK(handled_count == written_count - drops);
+
+    slot_unsubscribe_message(bus, slot, TEST_MSG_ODD);
+    slot_unsubscribe_message(bus, slot, TEST_MSG_EVEN);
+    tiny_bus_destroy(bus);
+    slot_free(slot);
+
+    CHECK(freed_count == written_count);
+}
+
+int
+main(int argc, char **argv)
+{
+    // newest refused: the first CAPACITY waiting are kept
+    static const int newest[] = { 0, 1, 2, 3, 4 };
+    // oldest evicted: the last CAPACITY written are kept
+    static const int oldest[] = { 0, 7, 8, 9, 10 };
+    // the newest waiting one of the same ID is replaced where it waits
+    static const int coalesce[] = { 0, 1, 2, 9, 10 };
+
+    test_policy("drop newest", THREAD_POOL_QUEUE, QUEUE_OVERFLOW_DROP_NEWEST,
+        0, newest, 5);
+    test_policy("drop oldest", THREAD_POOL_QUEUE, QUEUE_OVERFLOW_DROP_OLDEST,
+        0, oldest, 5);
+    test_policy("coalesce", THREAD_POOL_QUEUE, QUEUE_OVERFLOW_COALESCE,
+        0, coalesce, 5);
+    test_policy("coalesce lanes", THREAD_POOL_QUEUE, QUEUE_OVERFLOW_COALESCE,
+        2, coalesce, 5);
+    test_policy("ring drop newest", THREAD_POOL_RING, QUEUE_OVERFLOW_DROP_NEWEST,
+        0, newest, 5);
+    test_block();
+    test_direct_publish();
+    test_ingress();
+
+    if (failures)
+    {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    fprintf(stdout, "all overflow tests passed\n");
+
+    return 0;
+}
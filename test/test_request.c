@@ -0,0 +1,368 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include "tinybus.h"
+#include "slot.h"
+#include "message.h"
+
+#define TEST_MSG_REQUEST    BUS_MESSAGE_BASE_ID + 10
+#define TEST_MSG_REPLY      BUS_MESSAGE_BASE_ID + 11
+
+#define CHECK(cond)                                                     \
+    do {                                                                \
+        if (!(cond))                                                    \
+        {                                                               \
+            fprintf(stderr, "%s:%d: %s: check failed: %s\n",            \
+                __FILE__, __LINE__, test_name, #cond);                  \
+            failures++;                                                 \
+        }                                                               \
+    } while (0)
+
+static const char *test_name;
+static int failures;
+
+static tiny_bus_t *bus;
+
+/*
+ * the service answers a request once the gate is open, "waiting" counts
+ * the requests it holds
+ */
+static pthread_mutex_t gate_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gate_cond = PTHREAD_COND_INITIALIZER;
+static int gate_open = 1, waiting, replied;
+static tiny_bus_result_t reply_result;
+
+static volatile int freed_count;
+
+static int callback_count;
+static int callback_value;
+static pthread_t callback_thread;
+
+static uint64_t
+now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void
+gate_close(void)
+{
+    pthread_mutex_lock(&gate_mutex);
+    gate_open = 0;
+    pthread_mutex_unlock(&gate_mutex);
+}
+
+static void
+gate_release(void)
+{
+    pthread_mutex_lock(&gate_mutex);
+    gate_open = 1;
+    pthread_cond_broadcast(&gate_cond);
+    pthread_mutex_unlock(&gate_mutex);
+}
+
+// until the service holds "count" requests
+static void
+gate_wait_service(int count)
+{
+    pthread_mutex_lock(&gate_mutex);
+    while (waiting < count)
+        pthread_cond_wait(&gate_cond, &gate_mutex);
+    pthread_mutex_unlock(&gate_mutex);
+}
+
+// until the service answered "count" requests in all
+static void
+wait_replied(int count)
+{
+    pthread_mutex_lock(&gate_mutex);
+    while (replied < count)
+        pthread_cond_wait(&gate_cond, &gate_mutex);
+    pthread_mutex_unlock(&gate_mutex);
+}
+
+static void
+value_free(void *data)
+{
+    free(data);
+    __sync_add_and_fetch(&freed_count, 1);
+}
+
+static tiny_msg_t *
+value_msg(message_id_t id, int value)
+{
+    int *data;
+
+    data = (int *)malloc(sizeof(int));
+    *data = value;
+
+    return tiny_msg_alloc(id, data, sizeof(int), value_free);
+}
+
+static int
+msg_value(tiny_msg_t *msg)
+{
+    return *(int *)msg->msg_priv->data;
+}
+
+/*
+ * the service doubles the request's value
+ */
+static void
+service_exec(void *data, void *usr_data)
+{
+    tiny_msg_t *request = (tiny_msg_t *)data;
+    tiny_bus_result_t result;
+
+    pthread_mutex_lock(&gate_mutex);
+    waiting++;
+    pthread_cond_broadcast(&gate_cond);
+    while (!gate_open)
+        pthread_cond_wait(&gate_cond, &gate_mutex);
+    waiting--;
+    pthread_mutex_unlock(&gate_mutex);
+
+    result = tiny_bus_reply(bus, request,
+        value_msg(TEST_MSG_REPLY, msg_value(request) * 2));
+
+    pthread_mutex_lock(&gate_mutex);
+    reply_result = result;
+    replied++;
+    pthread_cond_broadcast(&gate_cond);
+    pthread_mutex_unlock(&gate_mutex);
+}
+
+static msg_result_t
+msg_handler(slot_t *slot, tiny_msg_t *msg)
+{
+    return 0;
+}
+
+static void
+future_callback(tiny_msg_t *reply, void *user_data)
+{
+    callback_value = reply ? msg_value(reply) : -1;
+    callback_thread = pthread_self();
+    __sync_add_and_fetch(&callback_count, 1);
+}
+
+static void
+test_wait(void)
+{
+    tiny_bus_future_t *future;
+    tiny_msg_t *reply;
+
+    test_name = "wait";
+
+    future = tiny_bus_request(bus, value_msg(TEST_MSG_REQUEST, 21));
+    CHECK(future != NULL);
+
+    reply = tiny_bus_future_wait(future);
+    CHECK(reply != NULL);
+    if (reply)
+    {
+        CHECK(msg_value(reply) == 42);
+        CHECK(reply->seq != 0);
+    }
+    tiny_bus_future_free(future);
+    CHECK(reply_result == TINY_BUS_SUCCEED);
+}
+
+/*
+ * NULL once the timeout expires, the reply is still taken afterwards
+ */
+static void
+test_timed_wait(void)
+{
+    tiny_bus_future_t *future;
+    tiny_msg_t *reply;
+    uint64_t start;
+
+    test_name = "timed wait";
+    gate_close();
+
+    future = tiny_bus_request(bus, value_msg(TEST_MSG_REQUEST, 5));
+    gate_wait_service(1);
+
+    start = now_ms();
+    CHECK(tiny_bus_future_timed_wait(future, 50) == NULL);
+    CHECK(now_ms() - start >= 50);
+
+    gate_release();
+    reply = tiny_bus_future_timed_wait(future, 5000);
+    CHECK(reply != NULL && msg_value(reply) == 10);
+    tiny_bus_future_free(future);
+}
+
+/*
+ * a callback registered before the reply runs in the replying thread,
+ * one registered after it right away
+ */
+static void
+test_then(void)
+{
+    tiny_bus_future_t *future;
+    int count;
+
+    test_name = "then before";
+    gate_close();
+    callback_count = 0;
+    count = replied;
+
+    future = tiny_bus_request(bus, value_msg(TEST_MSG_REQUEST, 1));
+    gate_wait_service(1);
+    tiny_bus_future_then(future, future_callback, NULL);
+    CHECK(callback_count == 0);
+
+    gate_release();
+    wait_replied(count + 1);
+    CHECK(callback_count == 1);
+    CHECK(callback_value == 2);
+    CHECK(!pthread_equal(callback_thread, pthread_self()));
+
+    test_name = "then after";
+    callback_count = 0;
+    count = replied;
+
+    future = tiny_bus_request(bus, value_msg(TEST_MSG_REQUEST, 2));
+    wait_replied(count + 1);
+    CHECK(callback_count == 0);
+    tiny_bus_future_then(future, future_callback, NULL);
+    CHECK(callback_count == 1);
+    CHECK(callback_value == 4);
+    CHECK(pthread_equal(callback_thread, pthread_self()));
+}
+
+/*
+ * a reply to a freed future is refused and released
+ */
+static void
+test_late_reply(void)
+{
+    tiny_bus_future_t *future;
+    int count, freed;
+
+    test_name = "late reply";
+    gate_close();
+    count = replied;
+
+    future = tiny_bus_request(bus, value_msg(TEST_MSG_REQUEST, 3));
+    gate_wait_service(1);
+    tiny_bus_future_free(future);
+
+    freed = freed_count;
+    gate_release();
+    wait_replied(count + 1);
+    CHECK(reply_result == TINY_BUS_FAILED);
+
+    // the reply, then the request once the slot is done with it
+    while (freed_count < freed + 2)
+        usleep(1000);
+}
+
+/*
+ * a direct bus writing into a full subscriber reports the drop, so the
+ * request is cancelled there and then instead of never being answered
+ */
+static void
+test_dropped(void)
+{
+    message_id_t ids[] = { TEST_MSG_REQUEST };
+    tiny_bus_future_t *held, *queued, *dropped;
+    tiny_bus_attr_t bus_attr;
+    tiny_bus_t *service_bus;
+    slot_attr_t attr;
+    slot_t *slot;
+    tiny_msg_t *reply;
+    uint64_t start;
+    int count;
+
+    test_name = "dropped";
+
+    tiny_bus_attr_init(&bus_attr);
+    bus_attr.direct = 1;
+    service_bus = tiny_bus_new_with_attr(&bus_attr);
+    tiny_bus_init_msg_ids(service_bus, ids, 1);
+
+    slot_attr_init(&attr);
+    attr.pool.max_threads = 1;
+    attr.pool.capacity = 1;
+    attr.pool.overflow = QUEUE_OVERFLOW_DROP_NEWEST;
+    slot = slot_new_with_attr("bounded service", 0, service_exec, NULL, &attr);
+    slot_subscribe_message(service_bus, slot, TEST_MSG_REQUEST, msg_handler);
+
+    // service_exec() answers on "bus"
+    bus = service_bus;
+    gate_close();
+    count = replied;
+
+    held = tiny_bus_request(bus, value_msg(TEST_MSG_REQUEST, 1));
+    gate_wait_service(1);
+    queued = tiny_bus_request(bus, value_msg(TEST_MSG_REQUEST, 2));
+    dropped = tiny_bus_request(bus, value_msg(TEST_MSG_REQUEST, 3));
+    CHECK(held != NULL && queued != NULL && dropped != NULL);
+
+    start = now_ms();
+    CHECK(tiny_bus_future_timed_wait(dropped, 5000) == NULL);
+    CHECK(now_ms() - start < 1000);
+    tiny_bus_future_free(dropped);
+
+    // then() on a dropped request runs without a reply
+    callback_count = 0;
+    dropped = tiny_bus_request(bus, value_msg(TEST_MSG_REQUEST, 4));
+    tiny_bus_future_then(dropped, future_callback, NULL);
+    CHECK(callback_count == 1);
+    CHECK(callback_value == -1);
+
+    gate_release();
+    reply = tiny_bus_future_wait(held);
+    CHECK(reply != NULL && msg_value(reply) == 2);
+    reply = tiny_bus_future_wait(queued);
+    CHECK(reply != NULL && msg_value(reply) == 4);
+    tiny_bus_future_free(held);
+    tiny_bus_future_free(queued);
+    wait_replied(count + 2);
+
+    slot_unsubscribe_message(service_bus, slot, TEST_MSG_REQUEST);
+    tiny_bus_destroy(service_bus);
+    slot_free(slot);
+}
+
+int
+main(int argc, char **argv)
+{
+    message_id_t ids[] = { TEST_MSG_REQUEST };
+    tiny_bus_t *service_bus;
+    slot_t *slot;
+
+    service_bus = tiny_bus_new();
+    tiny_bus_init_msg_ids(service_bus, ids, 1);
+    slot = slot_new("service", 0, service_exec, NULL, 1);
+    slot_subscribe_message(service_bus, slot, TEST_MSG_REQUEST, msg_handler);
+    bus = service_bus;
+
+    test_wait();
+    test_timed_wait();
+    test_then();
+    test_late_reply();
+
+    slot_unsubscribe_message(service_bus, slot, TEST_MSG_REQUEST);
+    tiny_bus_destroy(service_bus);
+    slot_free(slot);
+
+    test_dropped();
+
+    if (failures)
+    {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    fprintf(stdout, "all request tests passed\n");
+
+    return 0;
+}
@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include "tinybus.h"
+#include "slot.h"
+#include "message.h"
+
+#define TEST_MSG_ONESHOT    BUS_MESSAGE_BASE_ID + 10
+#define TEST_MSG_PERIODIC   BUS_MESSAGE_BASE_ID + 11
+#define TEST_MSG_CANCELLED  BUS_MESSAGE_BASE_ID + 12
+
+#define LATE_MS             30      // how late a loaded machine may deliver
+#define PERIOD_MS           25
+#define PERIODS             20
+
+#define CHECK(cond)                                                     \
+    do {                                                                \
+        if (!(cond))                                                    \
+        {                                                               \
+            fprintf(stderr, "%s:%d: %s: check failed: %s\n",            \
+                __FILE__, __LINE__, test_name, #cond);                  \
+            failures++;                                                 \
+        }                                                               \
+    } while (0)
+
+static const char *test_name;
+static int failures;
+
+/*
+ * one-shot delays: within the first wheel level, cascaded once from the
+ * second (over 64 ticks) and twice from the third (over 4096 ticks)
+ */
+static const uint32_t oneshot_delay[] = { 5, 100, 1000, 4500 };
+#define ONESHOTS            (sizeof(oneshot_delay) / sizeof(oneshot_delay[0]))
+
+static uint64_t oneshot_arrival[ONESHOTS];
+static volatile int oneshot_count;
+
+static uint64_t periodic_arrival[PERIODS * 2];
+static volatile int periodic_count;
+
+static volatile int cancelled_count;
+
+static uint64_t
+now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void
+msg_exec(void *data, void *usr_data)
+{
+    tiny_msg_t *msg = (tiny_msg_t *)data;
+    uint64_t now = now_ms();
+    int index;
+
+    switch (msg->msg_id)
+    {
+    case TEST_MSG_ONESHOT:
+        index = *(int *)msg->msg_priv->data;
+        oneshot_arrival[index] = now;
+        __sync_add_and_fetch(&oneshot_count, 1);
+        break;
+
+    case TEST_MSG_PERIODIC:
+        if (periodic_count < PERIODS * 2)
+            periodic_arrival[periodic_count] = now;
+        __sync_add_and_fetch(&periodic_count, 1);
+        break;
+
+    default:
+        __sync_add_and_fetch(&cancelled_count, 1);
+        break;
+    }
+}
+
+static msg_result_t
+msg_handler(slot_t *slot, tiny_msg_t *msg)
+{
+    return 0;
+}
+
+/*
+ * every one-shot arrives once, never before its delay and not much after
+ */
+static void
+test_oneshot(tiny_bus_t *bus, uint64_t start)
+{
+    int index;
+
+    test_name = "one-shot";
+
+    while (oneshot_count < ONESHOTS && now_ms() < start + 10000)
+        usleep(10000);
+
+    CHECK(oneshot_count == ONESHOTS);
+    for (index = 0; index < ONESHOTS; index++)
+    {
+        CHECK(oneshot_arrival[index] >= start + oneshot_delay[index]);
+        CHECK(oneshot_arrival[index] < start + oneshot_delay[index] + LATE_MS);
+    }
+}
+
+/*
+ * the k-th period arrives at start + delay + k * period, never early and
+ * without the lateness adding up
+ */
+static void
+test_periodic(tiny_bus_t *bus)
+{
+    uint64_t start, deadline;
+    uint32_t timer;
+    int index, count;
+
+    test_name = "periodic";
+
+    start = now_ms();
+    timer = tiny_bus_timer_add(bus, TEST_MSG_PERIODIC, NULL, 0, PERIOD_MS / 2, PERIOD_MS);
+    CHECK(timer != 0);
+
+    while (periodic_count < PERIODS)
+        usleep(1000);
+    CHECK(tiny_bus_timer_cancel(bus, timer) == TINY_BUS_SUCCEED);
+    count = periodic_count;
+
+    for (index = 0; index < PERIODS; index++)
+    {
+        deadline = start + PERIOD_MS / 2 + (uint64_t)index * PERIOD_MS;
+        CHECK(periodic_arrival[index] >= deadline);
+        CHECK(periodic_arrival[index] < deadline + LATE_MS);
+    }
+
+    // at most the one being published while we cancelled
+    usleep(PERIOD_MS * 4 * 1000);
+    CHECK(periodic_count <= count + 1);
+    CHECK(tiny_bus_timer_cancel(bus, timer) == TINY_BUS_FAILED);
+}
+
+/*
+ * cancelled before its deadline, a timer is never delivered
+ */
+static void
+test_cancel(tiny_bus_t *bus)
+{
+    uint32_t oneshot, periodic;
+
+    test_name = "cancel";
+
+    oneshot = tiny_bus_timer_add(bus, TEST_MSG_CANCELLED, NULL, 0, 50, 0);
+    periodic = tiny_bus_timer_add(bus, TEST_MSG_CANCELLED, NULL, 0, 200, 10);
+    CHECK(oneshot != 0 && periodic != 0);
+
+    CHECK(tiny_bus_timer_cancel(bus, oneshot) == TINY_BUS_SUCCEED);
+    CHECK(tiny_bus_timer_cancel(bus, periodic) == TINY_BUS_SUCCEED);
+
+    usleep(400000);
+    CHECK(cancelled_count == 0);
+    CHECK(tiny_bus_timer_cancel(bus, oneshot) == TINY_BUS_FAILED);
+}
+
+int
+main(int argc, char **argv)
+{
+    message_id_t ids[] = { TEST_MSG_ONESHOT, TEST_MSG_PERIODIC, TEST_MSG_CANCELLED };
+    tiny_bus_t *bus;
+    slot_t *slot;
+    uint64_t start;
+    int index;
+
+    bus = tiny_bus_new();
+    tiny_bus_init_msg_ids(bus, ids, sizeof(ids) / sizeof(ids[0]));
+
+    slot = slot_new("timer", 0, msg_exec, NULL, 1);
+    for (index = 0; index < sizeof(ids) / sizeof(ids[0]); index++)
+        slot_subscribe_message(bus, slot, ids[index], msg_handler);
+
+    // the long one-shots run while the other tests do
+    start = now_ms();
+    for (index = 0; index < ONESHOTS; index++)
+    {
+        if (tiny_bus_timer_add(bus, TEST_MSG_ONESHOT, &index, sizeof(index),
+                oneshot_delay[index], 0) == 0)
+        {
+            test_name = "one-shot";
+            CHECK(0);
+        }
+    }
+
+    test_cancel(bus);
+    test_periodic(bus);
+    test_oneshot(bus, start);
+
+    for (index = 0; index < sizeof(ids) / sizeof(ids[0]); index++)
+        slot_unsubscribe_message(bus, slot, ids[index]);
+    tiny_bus_destroy(bus);
+    slot_free(slot);
+
+    if (failures)
+    {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    fprintf(stdout, "all timer tests passed\n");
+
+    return 0;
+}
@@ -1,10 +1,155 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
 #include "trace.h"
 
 #define MAX_BUF 512
 
+#define RING_WRITERS    8
+#define RING_LINES      10000   // per writer
+#define RING_PAYLOAD    "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx"
+
+static void *
+ring_writer(void *arg)
+{
+    long writer = (long)arg;
+    int index;
+
+    for (index = 0; index < RING_LINES; index++)
+        TRACE_TRACE("T%ld %d %s\r\n", writer, index, RING_PAYLOAD);
+
+    return NULL;
+}
+
+/*
+ * child side: RING_WRITERS threads share the smallest rings there are
+ */
+static void
+ring_write(queue_overflow_t overflow, int binary)
+{
+    async_ring_buf_attr_t attr;
+    pthread_t threads[RING_WRITERS];
+    long writer;
+
+    async_ring_buf_attr_init(&attr);
+    attr.size = 1;
+    attr.overflow = overflow;
+    attr.binary = binary;
+    async_trace_init_with_attr(&attr);
+    TRACE_ADJUST_LEVEL(TRACE_DETAIL_LEVEL);
+
+    for (writer = 0; writer < RING_WRITERS; writer++)
+        pthread_create(&threads[writer], NULL, ring_writer, (void *)writer);
+    for (writer = 0; writer < RING_WRITERS; writer++)
+        pthread_join(threads[writer], NULL);
+
+    TRACE_SUPPORT_UNINIT();
+    fflush(stdout);
+}
+
+/*
+ * a line the writer traced, whole: "hh:mm:ss.us TRACE:  T<writer> <index> <payload>"
+ */
+static int
+ring_line_parse(const char *line, int *writer, int *index)
+{
+    const char *rest;
+    int offset = 0;
+
+    if (sscanf(line, "%*d:%*d:%*d.%*d TRACE:  T%d %d %n", writer, index, &offset) != 2
+        || offset == 0 || *writer < 0 || *writer >= RING_WRITERS)
+        return -1;
+
+    rest = line + offset;
+    if (strncmp(rest, RING_PAYLOAD, strlen(RING_PAYLOAD)) != 0)
+        return -1;
+    rest += strlen(RING_PAYLOAD);
+
+    return (strcmp(rest, "\r\n") == 0 || strcmp(rest, "\n") == 0) ? 0 : -1;
+}
+
+/*
+ * run the writers in a child printing into a pipe: no line may be torn or
+ * out of its writer's order, and the lines printed plus the ones reported
+ * lost are the lines written
+ */
+static int
+ring_test(const char *name, queue_overflow_t overflow, int binary)
+{
+    int fds[2], status, writer, index, last[RING_WRITERS];
+    long lines = 0, lost = 0, torn = 0, backwards = 0;
+    unsigned int count;
+    char *line = NULL;
+    size_t length = 0;
+    pid_t pid;
+    FILE *fp;
+
+    if (pipe(fds) != 0)
+        return -1;
+
+    // or the child prints what we buffered too
+    fflush(stdout);
+    pid = fork();
+    if (pid == 0)
+    {
+        close(fds[0]);
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[1]);
+        ring_write(overflow, binary);
+        _exit(0);
+    }
+    close(fds[1]);
+
+    for (writer = 0; writer < RING_WRITERS; writer++)
+        last[writer] = -1;
+
+    fp = fdopen(fds[0], "r");
+    while (getline(&line, &length, fp) > 0)
+    {
+        if (ring_line_parse(line, &writer, &index) == 0)
+        {
+            lines++;
+            if (index <= last[writer])
+                backwards++;
+            last[writer] = index;
+        }
+        else if (sscanf(line, "WARNING: %u trace lines lost", &count) == 1)
+            lost += count;
+        else
+            torn++;
+    }
+    free(line);
+    fclose(fp);
+    waitpid(pid, &status, 0);
+
+    fprintf(stdout, "%-20s lines %ld lost %ld torn %ld backwards %ld\r\n",
+        name, lines, lost, torn, backwards);
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 || torn || backwards
+        || lines + lost != (long)RING_WRITERS * RING_LINES
+        || (overflow == QUEUE_OVERFLOW_BLOCK && lost))
+        return -1;
+
+    return 0;
+}
+
+static int
+ring_tests(void)
+{
+    int failed = 0;
+
+    failed |= ring_test("block", QUEUE_OVERFLOW_BLOCK, 0);
+    failed |= ring_test("drop newest", QUEUE_OVERFLOW_DROP_NEWEST, 0);
+    failed |= ring_test("drop oldest", QUEUE_OVERFLOW_DROP_OLDEST, 0);
+    failed |= ring_test("binary drop newest", QUEUE_OVERFLOW_DROP_NEWEST, 1);
+    failed |= ring_test("binary drop oldest", QUEUE_OVERFLOW_DROP_OLDEST, 1);
+
+    return failed ? 1 : 0;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -15,10 +160,14 @@ main(int argc, char **argv)
     
     if (argc < 2)
     {
-        fprintf(stdout, "Usage: %s [Filename].\r\n", argv[0]);
+        fprintf(stdout, "Usage: %s [Filename] | -r.\r\n", argv[0]);
         fprintf(stdout, "\tOpen a text file and print its context.\r\n");
+        fprintf(stdout, "\t-r: trace from many threads into tiny rings and check the output.\r\n");
         return 0;
     }
+
+    if (strcmp(argv[1], "-r") == 0)
+        return ring_tests();
     
     fp = fopen(argv[1], "r");
     if (fp == NULL)